@@ -0,0 +1,178 @@
+//
+// Copyright 0000 <Nobody>
+// @file
+// @author David Matthew Mattli <dmattli@usgs.gov>
+//
+// @section LICENSE
+//
+// This software is in the public domain, furnished "as is", without
+// technical support, and with no warranty, express or implied, as to
+// its usefulness for any purpose.
+//
+// @section DESCRIPTION
+//
+// A pool of aligned pixel buffers that are reused between chunks.
+//
+//
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "bufferpool.h"
+
+namespace librasterblaster {
+/** \cond DOXYHIDE **/
+namespace {
+// Rounds bytes up to a multiple of BufferPool::alignment, and above 4 KiB to
+// one of four sizes per power of two, so at most a fifth is wasted.
+size_t BufferSize(size_t bytes) {
+  const size_t small = 4096;
+  if (bytes <= small) {
+    return std::max<size_t>(1, (bytes + BufferPool::alignment - 1)
+                            / BufferPool::alignment) * BufferPool::alignment;
+  }
+
+  size_t power = small;
+  while (power * 2 <= bytes) {
+    power *= 2;
+  }
+  const size_t step = power / 4;
+  return (bytes + step - 1) / step * step;
+}
+}  // namespace
+/** \endcond **/
+
+const size_t BufferPool::alignment;
+
+BufferPool& BufferPool::Global() {
+  // Never destroyed, chunks may be released during exit
+  static BufferPool *pool = new BufferPool();
+  return *pool;
+}
+
+BufferPool::BufferPool()
+    : huge_pages_(false), idle_limit_(512 * 1024 * 1024) {
+  statistics_.acquires = 0;
+  statistics_.reuses = 0;
+  statistics_.allocations = 0;
+  statistics_.bytes_in_use = 0;
+  statistics_.bytes_idle = 0;
+  statistics_.peak_bytes = 0;
+}
+
+BufferPool::~BufferPool() {
+  Trim();
+}
+
+void *BufferPool::Acquire(size_t bytes) {
+  const size_t size = BufferSize(bytes);
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++statistics_.acquires;
+
+  std::multimap<size_t, void*>::iterator idle = idle_.find(size);
+  if (idle != idle_.end()) {
+    void *buffer = idle->second;
+    idle_.erase(idle);
+    buffers_[buffer].in_use = true;
+    ++statistics_.reuses;
+    statistics_.bytes_idle -= size;
+    statistics_.bytes_in_use += size;
+    return buffer;
+  }
+
+  void *buffer = NULL;
+  bool mapped = false;
+#ifdef MADV_HUGEPAGE
+  const size_t huge_page_size = 2 * 1024 * 1024;
+  if (huge_pages_ && size >= huge_page_size) {
+    buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+      buffer = NULL;
+    } else {
+      madvise(buffer, size, MADV_HUGEPAGE);
+      mapped = true;
+    }
+  }
+#endif
+  if (buffer == NULL && posix_memalign(&buffer, alignment, size) != 0) {
+    return NULL;
+  }
+
+  Buffer info;
+  info.size = size;
+  info.mapped = mapped;
+  info.in_use = true;
+  buffers_[buffer] = info;
+
+  ++statistics_.allocations;
+  statistics_.bytes_in_use += size;
+  statistics_.peak_bytes = std::max(statistics_.peak_bytes,
+                                    statistics_.bytes_in_use
+                                    + statistics_.bytes_idle);
+  return buffer;
+}
+
+bool BufferPool::Release(void *buffer) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::unordered_map<void*, Buffer>::iterator found = buffers_.find(buffer);
+  if (found == buffers_.end() || !found->second.in_use) {
+    return false;
+  }
+
+  const size_t size = found->second.size;
+  found->second.in_use = false;
+  idle_.insert(std::make_pair(size, buffer));
+  statistics_.bytes_in_use -= size;
+  statistics_.bytes_idle += size;
+
+  // Keep the smaller buffers, they are the most likely to be reused
+  while (statistics_.bytes_idle > idle_limit_) {
+    std::multimap<size_t, void*>::iterator largest = --idle_.end();
+    void *freed = largest->second;
+    idle_.erase(largest);
+    Free(freed);
+  }
+
+  return true;
+}
+
+void BufferPool::Trim() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::multimap<size_t, void*>::iterator i = idle_.begin();
+       i != idle_.end(); ++i) {
+    Free(i->second);
+  }
+  idle_.clear();
+}
+
+void BufferPool::set_huge_pages(bool huge_pages) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  huge_pages_ = huge_pages;
+}
+
+void BufferPool::set_idle_limit(int64_t idle_limit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_limit_ = idle_limit;
+}
+
+BufferPool::Statistics BufferPool::statistics() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return statistics_;
+}
+
+// Frees an idle buffer, mutex_ must be held
+void BufferPool::Free(void *buffer) {
+  std::unordered_map<void*, Buffer>::iterator found = buffers_.find(buffer);
+  statistics_.bytes_idle -= found->second.size;
+
+  if (found->second.mapped) {
+    munmap(buffer, found->second.size);
+  } else {
+    free(buffer);
+  }
+  buffers_.erase(found);
+}
+}
@@ -0,0 +1,131 @@
+//
+// Copyright 0000 <Nobody>
+// @file
+// @author David Matthew Mattli <dmattli@usgs.gov>
+//
+// @section LICENSE
+//
+// This software is in the public domain, furnished "as is", without
+// technical support, and with no warranty, express or implied, as to
+// its usefulness for any purpose.
+//
+// @section DESCRIPTION
+//
+// A pool of aligned pixel buffers that are reused between chunks.
+//
+//
+
+#ifndef SRC_BUFFERPOOL_H_
+#define SRC_BUFFERPOOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+namespace librasterblaster {
+/// Buffer pool class
+/**
+ * Hands out pixel buffers aligned to BufferPool::alignment bytes and keeps
+ * released buffers to hand out again, which avoids repeated large
+ * allocations and the mmap/munmap churn that comes with them. Sizes are
+ * rounded up to one of four sizes per power of two so that buffers of
+ * similar size are reused. Buffers are not zeroed. A pool can be used by
+ * several threads at once.
+ */
+class BufferPool {
+ public:
+  /// Alignment in bytes of every buffer, enough for any SIMD load
+  static const size_t alignment = 64;
+
+  /// Counters of a pool, see BufferPool::statistics()
+  struct Statistics {
+    /** Calls to Acquire() */
+    int64_t acquires;
+    /** Acquire() calls that were given a released buffer */
+    int64_t reuses;
+    /** Buffers allocated from the system */
+    int64_t allocations;
+    /** Bytes of the buffers that are in use */
+    int64_t bytes_in_use;
+    /** Bytes of the released buffers that are kept for reuse */
+    int64_t bytes_idle;
+    /** Largest number of bytes allocated from the system at once */
+    int64_t peak_bytes;
+  };
+
+  /**
+   * @brief Returns the pool shared by all RasterChunks.
+   */
+  static BufferPool& Global();
+
+  BufferPool();
+
+  /**
+   * @brief Destructor, frees the released buffers. Buffers that are still
+   * in use must not be released afterwards.
+   */
+  ~BufferPool();
+
+  /**
+   * @brief Returns a buffer of at least bytes bytes with undefined
+   * contents, or NULL if it can't be allocated.
+   */
+  void *Acquire(size_t bytes);
+
+  /**
+   * @brief Gives buffer back to the pool.
+   *
+   * @return Returns false, and does nothing, if buffer was not acquired
+   * from this pool. The caller still owns such a buffer.
+   */
+  bool Release(void *buffer);
+
+  /**
+   * @brief Frees every released buffer.
+   */
+  void Trim();
+
+  /**
+   * @brief Backs buffers of at least 2 MiB with transparent huge pages,
+   * where the system supports them. The default is false.
+   */
+  void set_huge_pages(bool huge_pages);
+
+  /**
+   * @brief Limits the bytes of released buffers that are kept, released
+   * buffers beyond it are freed, largest first. The default is 512 MiB.
+   */
+  void set_idle_limit(int64_t idle_limit);
+
+  /**
+   * @brief Returns the counters of the pool.
+   */
+  Statistics statistics();
+
+ private:
+  BufferPool(const BufferPool &);
+  BufferPool &operator=(const BufferPool &);
+
+  struct Buffer {
+    size_t size;
+    // Allocated with mmap() rather than posix_memalign()
+    bool mapped;
+    bool in_use;
+  };
+
+  void Free(void *buffer);
+
+  std::mutex mutex_;
+  // Every buffer allocated by the pool
+  std::unordered_map<void*, Buffer> buffers_;
+  // Released buffers by size
+  std::multimap<size_t, void*> idle_;
+  bool huge_pages_;
+  int64_t idle_limit_;
+  Statistics statistics_;
+};
+}
+
+#endif  // SRC_BUFFERPOOL_H_
@@ -31,6 +31,17 @@ struct option longopts[] = {
   {"tile-size", required_argument, NULL, 'x'},
   {"timing-file", required_argument, NULL, 'c'},
   {"output-ratio", required_argument, NULL, 'o'},
+  {"no-decimation", no_argument, NULL, 'd'},
+  {"resampler-log", required_argument, NULL, 'l'},
+  {"threads", required_argument, NULL, 'j'},
+  {"memory-limit", required_argument, NULL, 'm'},
+  {"huge-pages", no_argument, NULL, 'g'},
+  {"mmap-input", no_argument, NULL, 'i'},
+  {"node-cache", required_argument, NULL, 'k'},
+  {"scheduler", required_argument, NULL, 'e'},
+  {"collective-io", no_argument, NULL, 'w'},
+  {"write-cache", required_argument, NULL, 'u'},
+  {"compress", required_argument, NULL, 'z'},
   {0, 0, 0, 0}
 };
 /** \endcode **/
@@ -41,6 +52,16 @@ Configuration::Configuration() {
   tile_size = 1024;
   timing_filename = "";
   cell_dimension_ratio = 1.0;
+  decimate_input = true;
+  thread_count = 0;
+  memory_limit = 0;
+  huge_pages = false;
+  mmap_input = false;
+  node_cache_limit = 0;
+  scheduler = STATIC_SCHEDULER;
+  collective_write = false;
+  write_cache_limit = 0;
+  compression = NO_COMPRESSION;
 }
 
 Configuration::Configuration(int argc, char *argv[]) {
@@ -51,6 +72,16 @@ Configuration::Configuration(int argc, char *argv[]) {
   tile_size = 1024;
   timing_filename = "";
   cell_dimension_ratio = 1.0;
+  decimate_input = true;
+  thread_count = 0;
+  memory_limit = 0;
+  huge_pages = false;
+  mmap_input = false;
+  node_cache_limit = 0;
+  scheduler = STATIC_SCHEDULER;
+  collective_write = false;
+  write_cache_limit = 0;
+  compression = NO_COMPRESSION;
 
   while ((c = getopt_long(argc,
                           argv,
@@ -80,6 +111,8 @@ Configuration::Configuration(int argc, char *argv[]) {
           resampler = BICUBIC;
         } else if (arg == "lanczos") {
           resampler = LANCZOS;
+        } else if (arg == "auto") {
+          resampler = AUTO;
         }
         break;
       case 'f':
@@ -94,6 +127,55 @@ Configuration::Configuration(int argc, char *argv[]) {
       case 'o':
         cell_dimension_ratio = std::stof(optarg);
         break;
+      case 'd':
+        decimate_input = false;
+        break;
+      case 'l':
+        resampler_log_filename = optarg;
+        break;
+      case 'j':
+        thread_count = std::stoi(optarg);
+        break;
+      case 'm':
+        memory_limit = std::stoll(optarg) * 1024 * 1024;
+        break;
+      case 'g':
+        huge_pages = true;
+        break;
+      case 'i':
+        mmap_input = true;
+        break;
+      case 'k':
+        node_cache_limit = std::stoll(optarg) * 1024 * 1024;
+        break;
+      case 'e':
+        arg = optarg;
+        if (arg == "static") {
+          scheduler = STATIC_SCHEDULER;
+        } else if (arg == "hilbert") {
+          scheduler = HILBERT_SCHEDULER;
+        } else if (arg == "dynamic") {
+          scheduler = DYNAMIC_SCHEDULER;
+        }
+        break;
+      case 'w':
+        collective_write = true;
+        break;
+      case 'u':
+        write_cache_limit = std::stoll(optarg) * 1024 * 1024;
+        break;
+      case 'z':
+        arg = optarg;
+        if (arg == "none") {
+          compression = NO_COMPRESSION;
+        } else if (arg == "deflate") {
+          compression = DEFLATE_COMPRESSION;
+        } else if (arg == "lzw") {
+          compression = LZW_COMPRESSION;
+        } else if (arg == "zstd") {
+          compression = ZSTD_COMPRESSION;
+        }
+        break;
       default:
         fprintf(stderr, "%s: option '-%c' is invalid: ignored\n",
                 argv[0], optopt);
@@ -27,6 +27,29 @@
 using std::string;
 
 namespace librasterblaster {
+/**
+ * @brief Ways of sharing the partitions of the output between processes
+ */
+enum PARTITION_SCHEDULER {
+  /** Assigned up front by cost, see AssignPartitions */
+  STATIC_SCHEDULER,
+  /** Assigned up front in contiguous ranges along a Hilbert curve, see
+   *  AssignPartitionRanges */
+  HILBERT_SCHEDULER,
+  /** Claimed in batches while the processes run, see PartitionScheduler */
+  DYNAMIC_SCHEDULER
+};
+
+/**
+ * @brief Compression of the tiles of the output
+ */
+enum OUTPUT_COMPRESSION {
+  NO_COMPRESSION,
+  DEFLATE_COMPRESSION,
+  LZW_COMPRESSION,
+  ZSTD_COMPRESSION
+};
+
 /// Configuration class
 /**
  * This class implements parsing of command-line arguments
@@ -78,6 +101,11 @@ struct Configuration {
    * value is NEAREST.
    */
   RESAMPLER resampler;
+  /**
+   * @brief Name of the file the per-block choices of the AUTO resampler are
+   * logged to. Nothing is logged if empty. The default value is "".
+   */
+  string resampler_log_filename;
   /**
    * @brief This is set to the fill value specified by the user.
    */
@@ -103,6 +131,69 @@ struct Configuration {
    * @brief 
    */
   double cell_dimension_ratio;
+  /**
+   * @brief Read reduced resolution input chunks when the output is much
+   * coarser than the input, see librasterblaster::DecimationFactor. The
+   * default value is true.
+   */
+  bool decimate_input;
+  /**
+   * @brief Number of threads each process reprojects with. The default
+   * value is 0, which lets the program choose: prasterblasterpio uses one
+   * thread per process, prasterblaster-threads one thread per core.
+   */
+  int thread_count;
+  /**
+   * @brief Bytes of input and output chunks each process may hold at once,
+   * set with --memory-limit in megabytes. Partitions are split until they
+   * fit, see librasterblaster::PlanPartitions. The default value is 0,
+   * which does not limit memory.
+   */
+  int64_t memory_limit;
+  /**
+   * @brief Back large pixel buffers with transparent huge pages, see
+   * BufferPool::set_huge_pages. Set with --huge-pages, the default value is
+   * false.
+   */
+  bool huge_pages;
+  /**
+   * @brief Read the input through a memory mapping when it is an
+   * uncompressed, tiled BigTIFF, see MappedRaster. Set with --mmap-input,
+   * the default value is false.
+   */
+  bool mmap_input;
+  /**
+   * @brief Bytes of input tiles the processes of a node may share, set
+   * with --node-cache in megabytes. See NodeInputCache, only
+   * prasterblasterpio uses it. The default value is 0, which disables the
+   * cache.
+   */
+  int64_t node_cache_limit;
+  /**
+   * @brief How partitions are shared between processes, set with
+   * --scheduler static, hilbert or dynamic. Only prasterblasterpio uses it.
+   * The default value is STATIC_SCHEDULER.
+   */
+  PARTITION_SCHEDULER scheduler;
+  /**
+   * @brief Write output tiles with collective MPI-IO, see
+   * sptw::write_tiles_all. Set with --collective-io, only prasterblasterpio
+   * uses it and not with DYNAMIC_SCHEDULER. The default value is false.
+   */
+  bool collective_write;
+  /**
+   * @brief Bytes of partly written output tiles each process may assemble
+   * in memory, set with --write-cache in megabytes. See
+   * sptw::set_tile_cache, only prasterblasterpio uses it. The default value
+   * is 0, which writes the parts straight away.
+   */
+  int64_t write_cache_limit;
+  /**
+   * @brief Compression of the output tiles, set with --compress none,
+   * deflate, lzw or zstd. Only prasterblasterpio uses it and not with
+   * DYNAMIC_SCHEDULER. The default value is NO_COMPRESSION.
+   */
+  OUTPUT_COMPRESSION compression;
 };
 }
 
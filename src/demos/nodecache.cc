@@ -0,0 +1,261 @@
+/*!
+ * Copyright 0000 <Nobody>
+ * @file
+ * @author David Matthew Mattli <dmattli@usgs.gov>
+ *
+ * @section LICENSE
+ *
+ * This software is in the public domain, furnished "as is", without
+ * technical support, and with no warranty, express or implied, as to
+ * its usefulness for any purpose.
+ *
+ * @section DESCRIPTION
+ *
+ * Input tiles shared by the processes of a node through an MPI shared
+ * memory window.
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "nodecache.h"
+
+namespace librasterblaster {
+NodeInputCache::NodeInputCache()
+    : node_comm_(MPI_COMM_NULL), window_(MPI_WIN_NULL), tiles_(NULL),
+      tile_width_(0), tile_height_(0), tiles_across_(0), type_size_(0),
+      band_count_(0), tile_bytes_(0), tile_count_(0) {
+}
+
+NodeInputCache::~NodeInputCache() {
+  if (window_ != MPI_WIN_NULL) {
+    MPI_Win_free(&window_);
+  }
+  if (node_comm_ != MPI_COMM_NULL) {
+    MPI_Comm_free(&node_comm_);
+  }
+}
+
+NodeInputCache *NodeInputCache::Create(MPI_Comm comm,
+                                       GDALDataset *input,
+                                       const std::vector<Area>& input_areas,
+                                       int64_t memory_limit,
+                                       PRB_ERROR *err,
+                                       int min_users) {
+  NodeInputCache *cache = new NodeInputCache();
+  *err = PRB_NOERROR;
+
+  int rank = 0, node_rank = 0, node_size = 1;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL,
+                      &cache->node_comm_);
+  MPI_Comm_rank(cache->node_comm_, &node_rank);
+  MPI_Comm_size(cache->node_comm_, &node_size);
+
+  GDALRasterBand *band = input->GetRasterBand(1);
+  const GDALDataType pixel_type = band->GetRasterDataType();
+  const int64_t x_size = input->GetRasterXSize();
+  const int64_t y_size = input->GetRasterYSize();
+  band->GetBlockSize(&cache->tile_width_, &cache->tile_height_);
+  cache->tiles_across_ = (x_size + cache->tile_width_ - 1)
+      / cache->tile_width_;
+  const int64_t tiles_down = (y_size + cache->tile_height_ - 1)
+      / cache->tile_height_;
+  cache->type_size_ = GDALGetDataTypeSize(pixel_type) / 8;
+  cache->band_count_ = input->GetRasterCount();
+  cache->tile_bytes_ = static_cast<int64_t>(cache->tile_width_)
+      * cache->tile_height_ * cache->type_size_ * cache->band_count_;
+
+  // Count the processes of the node that need each tile
+  const int64_t tile_total = cache->tiles_across_ * tiles_down;
+  std::vector<int> users(tile_total, 0);
+  for (size_t i = 0; i < input_areas.size(); ++i) {
+    const Area& area = input_areas[i];
+    if (area.ul.x == -1.0) {
+      continue;
+    }
+
+    const int64_t last_tile_x = std::min<int64_t>(
+        static_cast<int64_t>(area.lr.x) / cache->tile_width_,
+        cache->tiles_across_ - 1);
+    const int64_t last_tile_y = std::min<int64_t>(
+        static_cast<int64_t>(area.lr.y) / cache->tile_height_,
+        tiles_down - 1);
+    for (int64_t y = static_cast<int64_t>(area.ul.y) / cache->tile_height_;
+         y <= last_tile_y;
+         ++y) {
+      for (int64_t x = static_cast<int64_t>(area.ul.x) / cache->tile_width_;
+           x <= last_tile_x;
+           ++x) {
+        users[y * cache->tiles_across_ + x] = 1;
+      }
+    }
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &users[0], static_cast<int>(tile_total),
+                MPI_INT, MPI_SUM, cache->node_comm_);
+
+  // Share the tiles needed by the most processes that fit in memory_limit,
+  // every process of the node chooses the same tiles
+  std::vector<int64_t> shared;
+  for (int64_t i = 0; i < tile_total; ++i) {
+    if (users[i] >= min_users) {
+      shared.push_back(i);
+    }
+  }
+  std::stable_sort(shared.begin(), shared.end(),
+                   [&users](int64_t a, int64_t b) {
+                     return users[a] > users[b];
+                   });
+  const int64_t max_tiles = memory_limit / cache->tile_bytes_;
+  if (static_cast<int64_t>(shared.size()) > max_tiles) {
+    shared.resize(max_tiles);
+  }
+  std::sort(shared.begin(), shared.end());
+
+  cache->tile_count_ = shared.size();
+  cache->slots_.assign(tile_total, -1);
+  for (size_t i = 0; i < shared.size(); ++i) {
+    cache->slots_[shared[i]] = i;
+  }
+
+  // The first process of the node allocates the whole window
+  void *base = NULL;
+  MPI_Aint window_bytes = (node_rank == 0)
+      ? cache->tile_count_ * cache->tile_bytes_ : 0;
+  int disp_unit = 1;
+  MPI_Win_allocate_shared(window_bytes, disp_unit, MPI_INFO_NULL,
+                          cache->node_comm_, &base, &cache->window_);
+  MPI_Win_shared_query(cache->window_, 0, &window_bytes, &disp_unit, &base);
+  cache->tiles_ = static_cast<uint8_t*>(base);
+
+  // The processes of the node take turns reading the shared tiles
+  int failed = 0;
+  MPI_Win_fence(0, cache->window_);
+  for (int64_t i = node_rank; i < cache->tile_count_; i += node_size) {
+    const int64_t tile_x = shared[i] % cache->tiles_across_;
+    const int64_t tile_y = shared[i] / cache->tiles_across_;
+    const int x = tile_x * cache->tile_width_;
+    const int y = tile_y * cache->tile_height_;
+    const int width = std::min<int64_t>(cache->tile_width_, x_size - x);
+    const int height = std::min<int64_t>(cache->tile_height_, y_size - y);
+
+    if (input->RasterIO(GF_Read,
+                        x,
+                        y,
+                        width,
+                        height,
+                        cache->tiles_ + i * cache->tile_bytes_,
+                        width,
+                        height,
+                        pixel_type,
+                        cache->band_count_,
+                        NULL,
+                        cache->type_size_,
+                        cache->type_size_ * cache->tile_width_,
+                        cache->type_size_ * cache->tile_width_
+                        * cache->tile_height_) != CE_None) {
+      failed = 1;
+      break;
+    }
+  }
+  MPI_Win_fence(0, cache->window_);
+
+  // Every process of comm returns the same error, not only those of the
+  // node, so that no process goes on to collectives the others left
+  MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, comm);
+  if (failed) {
+    *err = PRB_IOERROR;
+  }
+
+  return cache;
+}
+
+PRB_ERROR NodeInputCache::Read(RasterChunk *chunk, GDALDataset *input) const {
+  if (chunk->decimation != 1
+      || chunk->tile_width != 0
+      || chunk->pixels == NULL
+      || chunk->band_count != band_count_
+      || GDALGetDataTypeSize(chunk->pixel_type) / 8 != type_size_) {
+    return chunk->Read(input);
+  }
+
+  const int64_t ul_x = chunk->raster_location.x;
+  const int64_t ul_y = chunk->raster_location.y;
+  const int64_t lr_x = ul_x + chunk->column_count - 1;
+  const int64_t lr_y = ul_y + chunk->row_count - 1;
+  const int64_t first_tile_x = ul_x / tile_width_;
+  const int64_t last_tile_x = lr_x / tile_width_;
+  const int64_t first_tile_y = ul_y / tile_height_;
+  const int64_t last_tile_y = lr_y / tile_height_;
+
+  bool any_shared = false;
+  for (int64_t tile_y = first_tile_y; tile_y <= last_tile_y; ++tile_y) {
+    for (int64_t tile_x = first_tile_x; tile_x <= last_tile_x; ++tile_x) {
+      any_shared |= (slots_[tile_y * tiles_across_ + tile_x] != -1);
+    }
+  }
+  if (!any_shared) {
+    return chunk->Read(input);
+  }
+
+  const int64_t row_bytes = static_cast<int64_t>(chunk->column_count)
+      * type_size_;
+  const int64_t band_bytes = row_bytes * chunk->row_count;
+  const int64_t tile_band_bytes = static_cast<int64_t>(tile_width_)
+      * tile_height_ * type_size_;
+  uint8_t *pixels = static_cast<uint8_t*>(chunk->pixels);
+
+  // Each tile fills the part of the chunk it overlaps, from the window if
+  // it is shared and from input otherwise
+  for (int64_t tile_y = first_tile_y; tile_y <= last_tile_y; ++tile_y) {
+    const int64_t y0 = std::max(ul_y, tile_y * tile_height_);
+    const int64_t y1 = std::min(lr_y, (tile_y + 1) * tile_height_ - 1);
+
+    for (int64_t tile_x = first_tile_x; tile_x <= last_tile_x; ++tile_x) {
+      const int64_t x0 = std::max(ul_x, tile_x * tile_width_);
+      const int64_t x1 = std::min(lr_x, (tile_x + 1) * tile_width_ - 1);
+      const int width = x1 - x0 + 1;
+      const int height = y1 - y0 + 1;
+      const int64_t slot = slots_[tile_y * tiles_across_ + tile_x];
+      uint8_t *target = pixels + (y0 - ul_y) * row_bytes
+          + (x0 - ul_x) * type_size_;
+
+      if (slot == -1) {
+        if (input->RasterIO(GF_Read,
+                            x0,
+                            y0,
+                            width,
+                            height,
+                            target,
+                            width,
+                            height,
+                            chunk->pixel_type,
+                            band_count_,
+                            NULL,
+                            type_size_,
+                            row_bytes,
+                            band_bytes) != CE_None) {
+          return PRB_IOERROR;
+        }
+        continue;
+      }
+
+      const uint8_t *tile = tiles_ + slot * tile_bytes_
+          + ((y0 - tile_y * tile_height_) * tile_width_
+             + (x0 - tile_x * tile_width_)) * type_size_;
+      for (int band = 0; band < band_count_; ++band) {
+        for (int row = 0; row < height; ++row) {
+          memcpy(target + band * band_bytes + row * row_bytes,
+                 tile + band * tile_band_bytes
+                 + static_cast<int64_t>(row) * tile_width_ * type_size_,
+                 static_cast<size_t>(width) * type_size_);
+        }
+      }
+    }
+  }
+
+  return PRB_NOERROR;
+}
+}
@@ -0,0 +1,109 @@
+/*!
+ * Copyright 0000 <Nobody>
+ * @file
+ * @author David Matthew Mattli <dmattli@usgs.gov>
+ *
+ * @section LICENSE
+ *
+ * This software is in the public domain, furnished "as is", without
+ * technical support, and with no warranty, express or implied, as to
+ * its usefulness for any purpose.
+ *
+ * @section DESCRIPTION
+ *
+ * Input tiles shared by the processes of a node through an MPI shared
+ * memory window.
+ *
+ */
+
+#ifndef SRC_DEMOS_NODECACHE_H_
+#define SRC_DEMOS_NODECACHE_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include <gdal_priv.h>
+#include <mpi.h>
+
+#include "../rasterchunk.h"
+#include "../utils.h"
+
+namespace librasterblaster {
+/// Node input cache class
+/**
+ * Neighbouring output partitions need overlapping input areas, so processes
+ * on the same node tend to read the same input tiles. A NodeInputCache
+ * holds the input tiles that more than one process of a node needs in a
+ * window allocated with MPI_Win_allocate_shared. Each of those tiles is
+ * read from the input once, by one of the processes of the node, and the
+ * processes then fill their input chunks from the window. Tiles that only
+ * one process needs are still read by that process.
+ *
+ * Tiles follow the blocks of the input dataset. In the window each tile is
+ * stored band after band, each band row by row with the full tile width.
+ */
+class NodeInputCache {
+ public:
+  /**
+   * @brief Creates the cache of the processes of comm that share a node
+   * and reads its tiles. Collective over comm.
+   *
+   * @param comm Communicator of every process
+   * @param input Input dataset of this process
+   * @param input_areas Input areas of the full resolution chunks this
+   *        process will read, in raster coordinates. Areas whose ul.x is -1
+   *        are ignored.
+   * @param memory_limit Bytes of tiles the node may share. The tiles needed
+   *        by the most processes are kept.
+   * @param err Receives PRB_IOERROR if any process of comm failed to read
+   *        its tiles, PRB_NOERROR otherwise.
+   * @param min_users Tiles needed by at least this many processes of the
+   *        node are shared. With 1 every tile is read through the window.
+   */
+  static NodeInputCache *Create(MPI_Comm comm,
+                                GDALDataset *input,
+                                const std::vector<Area>& input_areas,
+                                int64_t memory_limit,
+                                PRB_ERROR *err,
+                                int min_users = 2);
+
+  /**
+   * @brief Destructor, frees the window. Collective over the processes of
+   * the node.
+   */
+  ~NodeInputCache();
+
+  /**
+   * @brief Fills the pixels of chunk, a chunk of input. Pixels in shared
+   * tiles are copied from the window, the others are read from input.
+   * Decimated and tiled chunks, and chunks without shared tiles, are read
+   * with RasterChunk::Read.
+   */
+  PRB_ERROR Read(RasterChunk *chunk, GDALDataset *input) const;
+
+  /// Number of tiles shared by the node
+  int64_t tile_count() const { return tile_count_; }
+  /// Bytes of the shared tiles
+  int64_t bytes() const { return tile_count_ * tile_bytes_; }
+
+ private:
+  NodeInputCache();
+  NodeInputCache(const NodeInputCache &);
+  NodeInputCache &operator=(const NodeInputCache &);
+
+  MPI_Comm node_comm_;
+  MPI_Win window_;
+  uint8_t *tiles_;
+  int tile_width_;
+  int tile_height_;
+  int64_t tiles_across_;
+  int type_size_;
+  int band_count_;
+  int64_t tile_bytes_;
+  int64_t tile_count_;
+  // Index of each input tile in the window, -1 if it isn't shared
+  std::vector<int64_t> slots_;
+};
+}
+
+#endif  // SRC_DEMOS_NODECACHE_H_
@@ -0,0 +1,257 @@
+///
+/// Copyright 0000 <Nobody>
+/// @file
+/// @author David Matthew Mattli <dmattli@usgs.gov>
+///
+/// @section LICENSE
+///
+/// This software is in the public domain, furnished "as is", without
+/// technical support, and with no warranty, express or implied, as to
+/// its usefulness for any purpose.
+///
+/// @section DESCRIPTION
+///
+/// This file benchmarks the block orders of ReprojectChunk. A synthetic
+/// global raster is reprojected into windows of several projections whose
+/// mappings are rotated or sheared, once with each order, and the time and
+/// the cache misses of each run are reported.
+///
+///
+
+#include <gdal.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../configuration.h"
+#include "../rasterchunk.h"
+#include "../reprojection_tools.h"
+#include "../utils.h"
+
+using librasterblaster::BLOCK_ORDER;
+using librasterblaster::Configuration;
+using librasterblaster::Coordinate;
+using librasterblaster::MORTON_ORDER;
+using librasterblaster::RasterChunk;
+using librasterblaster::ROW_ORDER;
+using librasterblaster::RESAMPLER;
+
+/*! \page prasterblasterbenchmark
+
+\htmlonly
+USAGE:
+\endhtmlonly
+
+\verbatim
+prasterblaster-benchmark [-r resampling_method]
+
+\endverbatim
+
+\section prasterblasterbenchmark_description DESCRIPTION
+
+<p>
+
+The prasterblaster-benchmark program reprojects a synthetic 3600x1800
+geographic raster into 1024x1024 windows of
+gnomonic, polar stereographic, oblique Mercator, Lambert azimuthal and
+sinusoidal projections, with ROW_ORDER and with MORTON_ORDER. It prints the
+run time and, where the kernel exposes hardware counters, the L1 data cache
+and last-level cache misses of each run, and fails if the orders do not
+produce identical output. No files are read or written.
+
+</p>
+ */
+
+/** \cond DOXYHIDE **/
+namespace {
+// A hardware cache counter of this thread, if the kernel provides one
+class CacheCounter {
+ public:
+  CacheCounter(uint32_t type, uint64_t config) : fd_(-1) {
+#ifdef __linux__
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = type;
+    attributes.config = config;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+#endif
+  }
+
+  ~CacheCounter() {
+#ifdef __linux__
+    if (fd_ != -1) {
+      close(fd_);
+    }
+#endif
+  }
+
+  void Start() {
+#ifdef __linux__
+    if (fd_ != -1) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  // Returns the count since Start(), or -1 if there is no counter
+  int64_t Stop() {
+    int64_t count = -1;
+#ifdef __linux__
+    if (fd_ != -1) {
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+        count = -1;
+      }
+    }
+#endif
+    return count;
+  }
+
+ private:
+  int fd_;
+};
+
+struct Projection {
+  const char *name;
+  const char *srs;
+  // Center of the output window, and its width and height, in meters
+  double center_x;
+  double center_y;
+  double extent;
+};
+
+const Projection projections[] = {
+  { "gnomonic", "+proj=gnom +lat_0=90 +lon_0=0 +R=6370997",
+    0.0, 0.0, 12000000.0 },
+  { "polar stereographic", "+proj=stere +lat_0=90 +lon_0=0 +R=6370997",
+    0.0, 0.0, 12000000.0 },
+  { "oblique mercator",
+    "+proj=omerc +lat_0=40 +lonc=-100 +alpha=45 +R=6370997",
+    0.0, 0.0, 10000000.0 },
+  { "lambert azimuthal", "+proj=laea +lat_0=45 +lon_0=-100 +R=6370997",
+    0.0, 0.0, 10000000.0 },
+  { "sinusoidal", "+proj=sinu +lon_0=0 +R=6370997",
+    0.0, 0.0, 20000000.0 },
+};
+
+void PrintCount(int64_t count) {
+  if (count < 0) {
+    printf(" %12s", "n/a");
+  } else {
+    printf(" %12lld", static_cast<long long>(count));
+  }
+}
+}  // namespace
+/** \endcond **/
+
+int main(int argc, char *argv[]) {
+  Configuration conf(argc, argv);
+  const RESAMPLER resampler = conf.resampler;
+  const int output_size = 1024;
+  const int source_columns = 3600;
+  const int source_rows = 1800;
+
+  // A smooth global field with some fine detail, one tenth of a degree per
+  // pixel
+  RasterChunk source;
+  source.projection = "+proj=longlat +R=6370997";
+  source.ul_projected_corner = Coordinate(-180.0, 90.0);
+  source.pixel_size = 360.0 / source_columns;
+  source.row_count = source_rows;
+  source.column_count = source_columns;
+  source.pixel_type = GDT_Float32;
+  source.band_count = 1;
+  source.pixels = calloc(static_cast<size_t>(source_rows) * source_columns,
+                         sizeof(float));
+  if (source.pixels == NULL) {
+    fprintf(stderr, "Allocation error!\n");
+    return 1;
+  }
+
+  float *source_pixels = static_cast<float*>(source.pixels);
+  for (int y = 0; y < source_rows; ++y) {
+    for (int x = 0; x < source_columns; ++x) {
+      source_pixels[static_cast<int64_t>(y) * source_columns + x] =
+          100.0 * sin(x * 0.01) * cos(y * 0.013) + (x * 7 + y * 13) % 17;
+    }
+  }
+
+  CacheCounter l1_misses(PERF_TYPE_HW_CACHE,
+                         PERF_COUNT_HW_CACHE_L1D
+                         | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                         | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  CacheCounter llc_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+  printf("Output: %dx%d, input: %dx%d\n", output_size, output_size,
+         source_columns, source_rows);
+  printf("%-20s %-7s %9s %12s %12s\n", "projection", "order", "seconds",
+         "L1D misses", "LLC misses");
+
+  bool identical = true;
+  for (size_t p = 0; p < sizeof(projections) / sizeof(projections[0]); ++p) {
+    const Projection& projection = projections[p];
+    const BLOCK_ORDER orders[2] = { ROW_ORDER, MORTON_ORDER };
+    const char *order_names[2] = { "rows", "morton" };
+    RasterChunk destinations[2];
+
+    for (int o = 0; o < 2; ++o) {
+      RasterChunk& destination = destinations[o];
+      destination.projection = projection.srs;
+      destination.pixel_size = projection.extent / output_size;
+      destination.ul_projected_corner =
+          Coordinate(projection.center_x - projection.extent / 2,
+                     projection.center_y + projection.extent / 2);
+      destination.row_count = output_size;
+      destination.column_count = output_size;
+      destination.pixel_type = GDT_Float32;
+      destination.band_count = 1;
+      destination.pixels = calloc(static_cast<size_t>(output_size)
+                                  * output_size, sizeof(float));
+      if (destination.pixels == NULL) {
+        fprintf(stderr, "Allocation error!\n");
+        return 1;
+      }
+
+      const std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      l1_misses.Start();
+      llc_misses.Start();
+      librasterblaster::ReprojectChunk(source, destination, "-1", resampler,
+                                       NULL, NULL, orders[o]);
+      const int64_t l1_count = l1_misses.Stop();
+      const int64_t llc_count = llc_misses.Stop();
+      const double seconds = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+
+      printf("%-20s %-7s %9.3f", projection.name, order_names[o], seconds);
+      PrintCount(l1_count);
+      PrintCount(llc_count);
+      printf("\n");
+    }
+
+    if (memcmp(destinations[0].pixels, destinations[1].pixels,
+               static_cast<size_t>(output_size) * output_size
+               * sizeof(float)) != 0) {
+      fprintf(stderr, "Output of %s differs between orders!\n",
+              projection.name);
+      identical = false;
+    }
+  }
+
+  return identical ? 0 : 1;
+}
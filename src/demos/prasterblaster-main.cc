@@ -15,6 +15,8 @@
 //
 //
 
+#include <cstdio>
+
 #include <mpi.h>
 
 #include "../configuration.h"
@@ -48,8 +50,14 @@ prasterblaster-pio.cc.
 </p>
  */
 int main(int argc, char *argv[]) {
-  // Give MPI_Init first run at the command-line arguments
-  MPI_Init(&argc, &argv);
+  // Give MPI_Init first run at the command-line arguments. Only the main
+  // thread makes MPI calls, the --threads workers only reproject chunks.
+  int provided = MPI_THREAD_SINGLE;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  if (provided < MPI_THREAD_FUNNELED) {
+    fprintf(stderr, "The MPI library does not support threads\n");
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
 
   // Initialize Configuration object
   Configuration conf(argc, argv);
@@ -20,11 +20,22 @@
 #include <sys/time.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
 #include <vector>
 
 #include "../configuration.h"
+#include "../mappedraster.h"
+#include "../pipeline.h"
 #include "../reprojection_tools.h"
 
+#include "../demos/nodecache.h"
+#include "../demos/scheduler.h"
 #include "../demos/sptw.h"
 #include "../utils.h"
 
@@ -36,6 +47,7 @@ using librasterblaster::RasterChunk;
 using librasterblaster::Configuration;
 using librasterblaster::PRB_ERROR;
 using librasterblaster::PRB_BADARG;
+using librasterblaster::PRB_IOERROR;
 using librasterblaster::PRB_NOERROR;
 
 using sptw::PTIFF;
@@ -45,6 +57,220 @@ using sptw::SPTW_ERROR;
 void GDALErrorHandler(CPLErr, int, const char *) {
 }
 
+/** \cond DOXYHIDE **/
+// Seconds since an arbitrary point, MPI_Wtime() is only called by the
+// thread that initialized MPI.
+static double Now() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The chunks of one partition as they pass through the pipeline
+struct PartitionChunks {
+  RasterChunk input;
+  RasterChunk output;
+  // The tiles of output when the output is compressed
+  sptw::CompressedTiles compressed;
+};
+
+// Returns the sptw compression of the output
+static sptw::SPTW_COMPRESSION OutputCompression(const Configuration& conf) {
+  switch (conf.compression) {
+    case librasterblaster::DEFLATE_COMPRESSION:
+      return sptw::SP_Deflate;
+    case librasterblaster::LZW_COMPRESSION:
+      return sptw::SP_Lzw;
+    case librasterblaster::ZSTD_COMPRESSION:
+      return sptw::SP_Zstd;
+    default:
+      return sptw::SP_NoCompression;
+  }
+}
+
+// Compresses the tiles of chunk, which must cover whole tiles of ptiff, on
+// the threads of pool
+static PRB_ERROR CompressChunk(const PTIFF *ptiff,
+                               const RasterChunk& chunk,
+                               librasterblaster::ThreadPool *pool,
+                               sptw::CompressedTiles *compressed) {
+  const int64_t ul_x = chunk.raster_location.x;
+  const int64_t ul_y = chunk.raster_location.y;
+  const int64_t tile_width = ptiff->block_x_size;
+  const int64_t tile_height = ptiff->block_y_size;
+  if (ul_x % tile_width != 0
+      || ul_y % tile_height != 0
+      || (chunk.column_count % tile_width != 0
+          && ul_x + chunk.column_count != ptiff->x_size)
+      || (chunk.row_count % tile_height != 0
+          && ul_y + chunk.row_count != ptiff->y_size)
+      || (chunk.tile_width != 0 && chunk.tile_width != tile_width)) {
+    return PRB_BADARG;
+  }
+
+  const int64_t pixel_bytes = static_cast<int64_t>(ptiff->band_type_size)
+      * ptiff->band_count;
+  const int64_t tile_bytes = tile_width * tile_height * pixel_bytes;
+  const int tiles_across = (chunk.column_count + tile_width - 1) / tile_width;
+  const int tiles_down = (chunk.row_count + tile_height - 1) / tile_height;
+  const uint8_t *pixels = static_cast<const uint8_t*>(chunk.pixels);
+
+  // Tiles of a tiled chunk are compressed where they are, those of other
+  // chunks are first copied into a tile of each worker
+  vector<vector<uint8_t> > tiles(tiles_across * tiles_down);
+  vector<vector<uint8_t> > scratch(pool->thread_count());
+  std::atomic<bool> failed(false);
+  pool->ParallelFor(tiles.size(), [&](int worker, int i) {
+      const int tile_x = i % tiles_across;
+      const int tile_y = i / tiles_across;
+      const uint8_t *tile = pixels + i * tile_bytes;
+
+      if (chunk.tile_width == 0) {
+        vector<uint8_t>& copy = scratch[worker];
+        copy.assign(tile_bytes, 0);
+        const int64_t width = std::min<int64_t>(
+            tile_width, chunk.column_count - tile_x * tile_width);
+        const int64_t height = std::min<int64_t>(
+            tile_height, chunk.row_count - tile_y * tile_height);
+        for (int64_t row = 0; row < height; ++row) {
+          memcpy(&copy[row * tile_width * pixel_bytes],
+                 pixels + ((tile_y * tile_height + row) * chunk.column_count
+                           + tile_x * tile_width) * pixel_bytes,
+                 width * pixel_bytes);
+        }
+        tile = &copy[0];
+      }
+
+      if (sptw::compress_tile(ptiff, tile, &tiles[i]) != sptw::SP_None) {
+        failed = true;
+      }
+    });
+  if (failed) {
+    return PRB_IOERROR;
+  }
+
+  compressed->tile_indices.clear();
+  compressed->sizes.clear();
+  compressed->data.clear();
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    compressed->tile_indices.push_back(
+        (ul_y / tile_height + i / tiles_across) * ptiff->tiles_across
+        + ul_x / tile_width + i % tiles_across);
+    compressed->sizes.push_back(tiles[i].size());
+    compressed->data.insert(compressed->data.end(), tiles[i].begin(),
+                            tiles[i].end());
+  }
+  return PRB_NOERROR;
+}
+
+// Every process estimates the cost of its own partitions and finds those
+// outside of the input, then gathers the partitions, costs and flags of all
+// processes, in rank order
+static void GatherPartitions(const vector<Area>& partitions,
+                             GDALDataset *input,
+                             GDALDataset *output,
+                             const Configuration& conf,
+                             int process_count,
+                             vector<Area> *all_partitions,
+                             vector<double> *all_costs,
+                             vector<bool> *all_outside) {
+  const int fields = 6;
+  const vector<double> costs = librasterblaster::PartitionCosts(
+      input, output, partitions, conf.resampler, conf.decimate_input);
+  const vector<bool> outside = librasterblaster::PartitionsOutsideInput(
+      input, output, partitions);
+
+  vector<double> local(partitions.size() * fields);
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    local[i * fields] = partitions[i].ul.x;
+    local[i * fields + 1] = partitions[i].ul.y;
+    local[i * fields + 2] = partitions[i].lr.x;
+    local[i * fields + 3] = partitions[i].lr.y;
+    local[i * fields + 4] = costs[i];
+    local[i * fields + 5] = outside[i] ? 1.0 : 0.0;
+  }
+
+  int local_count = local.size();
+  vector<int> counts(process_count), displacements(process_count, 0);
+  MPI_Allgather(&local_count, 1, MPI_INT, &counts[0], 1, MPI_INT,
+                MPI_COMM_WORLD);
+  for (int i = 1; i < process_count; ++i) {
+    displacements[i] = displacements[i - 1] + counts[i - 1];
+  }
+
+  vector<double> all(displacements.back() + counts.back());
+  MPI_Allgatherv(local.empty() ? NULL : &local[0], local_count, MPI_DOUBLE,
+                 all.empty() ? NULL : &all[0], &counts[0], &displacements[0],
+                 MPI_DOUBLE, MPI_COMM_WORLD);
+
+  all_partitions->resize(all.size() / fields);
+  all_costs->resize(all.size() / fields);
+  all_outside->resize(all.size() / fields);
+  for (size_t i = 0; i < all_partitions->size(); ++i) {
+    (*all_partitions)[i] = Area(all[i * fields], all[i * fields + 1],
+                                all[i * fields + 2], all[i * fields + 3]);
+    (*all_costs)[i] = all[i * fields + 4];
+    (*all_outside)[i] = (all[i * fields + 5] != 0.0);
+  }
+}
+// Clears the entries of tiles for the tiles of output that partition
+// touches
+static void ClearTiles(const Area& partition,
+                       const PTIFF *output,
+                       vector<bool> *tiles) {
+  for (int64_t y = partition.ul.y / output->block_y_size;
+       y <= partition.lr.y / output->block_y_size;
+       ++y) {
+    for (int64_t x = partition.ul.x / output->block_x_size;
+         x <= partition.lr.x / output->block_x_size;
+         ++x) {
+      (*tiles)[y * output->tiles_across + x] = false;
+    }
+  }
+}
+
+// Returns whether every tile of output that partition touches is set in
+// tiles, that is whether the partition only touches left out tiles
+static bool AllTilesSet(const Area& partition,
+                        const PTIFF *output,
+                        const vector<bool>& tiles) {
+  for (int64_t y = partition.ul.y / output->block_y_size;
+       y <= partition.lr.y / output->block_y_size;
+       ++y) {
+    for (int64_t x = partition.ul.x / output->block_x_size;
+         x <= partition.lr.x / output->block_x_size;
+         ++x) {
+      if (!tiles[y * output->tiles_across + x]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Returns whether GDAL reads a missing tile of dataset as fill_value, the
+// value ReprojectChunk writes outside of the input
+static bool FillIsNoData(GDALDataset *dataset, const string& fill_value) {
+  int has_no_data = 0;
+  const double no_data =
+      dataset->GetRasterBand(1)->GetNoDataValue(&has_no_data);
+  const double fill = std::strtod(fill_value.c_str(), NULL);
+
+  if (!has_no_data) {
+    return fill == 0.0;
+  }
+  return fill == no_data || (std::isnan(fill) && std::isnan(no_data));
+}
+
+// Returns whether failed is true on any process. Collective over
+// MPI_COMM_WORLD.
+static bool AnyProcessFailed(bool failed) {
+  int any_failed = failed ? 1 : 0;
+  MPI_Allreduce(MPI_IN_PLACE, &any_failed, 1, MPI_INT, MPI_MAX,
+                MPI_COMM_WORLD);
+  return any_failed != 0;
+}
+/** \endcond **/
+
 /*! \page prasterblasterpio
 
 \htmlonly
@@ -70,18 +296,47 @@ prasterblaster-pio.cc.
 </p>
  */
 namespace librasterblaster {
-PRB_ERROR write_rasterchunk(PTIFF *ptiff, RasterChunk& chunk) {
+PRB_ERROR write_rasterchunk(PTIFF *ptiff, RasterChunk& chunk, bool collective) {
   Area write_area;
   write_area.ul = chunk.ChunkToRaster(librasterblaster::Coordinate(0.0, 0.0));
   write_area.lr = chunk.ChunkToRaster(
       librasterblaster::Coordinate(chunk.column_count-1, chunk.row_count-1));
 
-  sptw::write_area(ptiff,
-                   chunk.pixels,
-                   write_area.ul.x,
-                   write_area.ul.y,
-                   write_area.lr.x,
-                   write_area.lr.y);
+  // Tiled chunks are written straight from their buffer. Other chunks,
+  // such as the strips of a split partition or chunks of several bands, are
+  // written independently and join the collective call with nothing to
+  // write.
+  SPTW_ERROR err;
+  if (collective && chunk.tile_width != 0) {
+    err = sptw::write_tiles_all(ptiff,
+                                chunk.pixels,
+                                write_area.ul.x,
+                                write_area.ul.y,
+                                write_area.lr.x,
+                                write_area.lr.y);
+  } else if (chunk.tile_width != 0) {
+    err = sptw::write_tiles(ptiff,
+                            chunk.pixels,
+                            write_area.ul.x,
+                            write_area.ul.y,
+                            write_area.lr.x,
+                            write_area.lr.y);
+  } else {
+    err = sptw::write_area(ptiff,
+                           chunk.pixels,
+                           write_area.ul.x,
+                           write_area.ul.y,
+                           write_area.lr.x,
+                           write_area.lr.y);
+    if (collective
+        && sptw::write_tiles_all(ptiff, NULL, 0, 0, -1, -1) != sptw::SP_None) {
+      err = sptw::SP_WriteError;
+    }
+  }
+
+  if (err != sptw::SP_None) {
+    return PRB_IOERROR;
+  }
   return PRB_NOERROR;
 }
 
@@ -97,9 +352,12 @@ PRB_ERROR prasterblasterpio(Configuration conf) {
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &process_count);
 
-  // Replace CPLErrorHandler
-  CPLPushErrorHandler(GDALErrorHandler);
+  // Replace CPLErrorHandler. Handlers pushed with CPLPushErrorHandler()
+  // only apply to the calling thread, and the input is read on a thread of
+  // the pipeline.
+  CPLSetErrorHandler(GDALErrorHandler);
   GDALAllRegister();
+  librasterblaster::BufferPool::Global().set_huge_pages(conf.huge_pages);
 
   if (conf.input_filename == "" || conf.output_filename == "") {
     printf("USAGE:\n"
@@ -109,6 +367,17 @@ PRB_ERROR prasterblasterpio(Configuration conf) {
            "               [--timing-file filename]\n"
            "               [--tile-size tile_size_in_pixels]\n"
            "               [--output-ratio output_cell_dimension_ratio]\n"
+           "               [--no-decimation]\n"
+           "               [--resampler-log filename]\n"
+           "               [--threads thread_count]\n"
+           "               [--memory-limit megabytes]\n"
+           "               [--huge-pages]\n"
+           "               [--mmap-input]\n"
+           "               [--node-cache megabytes]\n"
+           "               [--scheduler static|hilbert|dynamic]\n"
+           "               [--collective-io]\n"
+           "               [--write-cache megabytes]\n"
+           "               [--compress none|deflate|lzw|zstd]\n"
            "               source_file destination_file\n");
     return PRB_BADARG;
   }
@@ -125,8 +394,46 @@ PRB_ERROR prasterblasterpio(Configuration conf) {
     return PRB_IOERROR;
   }
 
+  // An uncompressed, tiled BigTIFF can be read straight from a mapping of
+  // the file instead of through the GDAL block cache.
+  std::unique_ptr<librasterblaster::MappedRaster> mapped_input;
+  if (conf.mmap_input) {
+    mapped_input.reset(
+        librasterblaster::MappedRaster::Open(conf.input_filename));
+    // Whether the input is mapped decides which collectives are called
+    // later, so every process falls back to GDAL if any could not map it
+    if (AnyProcessFailed(mapped_input == NULL)) {
+      mapped_input.reset();
+    }
+    if (mapped_input == NULL && rank == 0) {
+      printf("Input is not an uncompressed, tiled BigTIFF, reading it with "
+             "GDAL\n");
+    }
+  }
+
+  // Compressed tiles have no fixed size. They are placed as they are
+  // written, in rounds like collective writes, which need the number of
+  // partitions of each process up front.
+  sptw::SPTW_COMPRESSION compression = OutputCompression(conf);
+  if (compression != sptw::SP_NoCompression
+      && conf.scheduler == librasterblaster::DYNAMIC_SCHEDULER) {
+    if (rank == 0) {
+      printf("--compress needs a static scheduler, writing uncompressed "
+             "tiles\n");
+    }
+    compression = sptw::SP_NoCompression;
+  }
+  if (!sptw::compression_available(compression)) {
+    if (rank == 0) {
+      fprintf(stderr, "This build of sptw can't compress with --compress "
+              "zstd\n");
+    }
+    return PRB_BADARG;
+  }
+
   // If we are the process with rank 0 we are responsible for the creation of
   // the output raster.
+  int created = 1;
   if (rank == 0) {
     printf("prasterblaster-pio: Beginning reprojection task\n");
     printf("\tInput File: %s, Output File: %s\n",
@@ -135,52 +442,66 @@ PRB_ERROR prasterblasterpio(Configuration conf) {
     // Now we have to create the output raster
     printf("Creating output raster...");
 
-    double no_data = NAN;
+    int64_t columns = 0, rows = 0;
+    double pixel_size = 0.0;
+    Area out_area;
+    PRB_ERROR err = librasterblaster::OutputRasterGeometry(
+        input_raster, conf.output_srs, conf.cell_dimension_ratio, &columns,
+        &rows, &pixel_size, &out_area);
+    if (err != PRB_NOERROR) {
+      fprintf(stderr, "Error creating output raster: %d\n", err);
+      created = 0;
+    }
+
+    // The output keeps the color table and nodata value of the input, as
+    // CreateOutputRaster does
+    GDALRasterBand *in_band = input_raster->GetRasterBand(1);
+    double no_data = in_band->GetNoDataValue();
     if (!conf.fill_value.empty()) {
       no_data = std::strtod(conf.fill_value.c_str(), NULL);
     }
+    double geotransform[6] = { out_area.ul.x, pixel_size, 0.0,
+                               out_area.ul.y, 0.0, -pixel_size };
 
-    PRB_ERROR err = librasterblaster::CreateOutputRaster(input_raster,
-                                                         conf.output_filename,
-                                                         conf.output_srs,
-                                                         conf.tile_size,
-                                                         conf.cell_dimension_ratio,
-                                                         no_data);
-    if (err != PRB_NOERROR) {
-      fprintf(stderr, "Error creating output raster: %d\n", err);
-      return PRB_IOERROR;
+    // sptw writes the file directly, with every tile placed, so it needn't
+    // be patched and reopened
+    if (created) {
+      const SPTW_ERROR sperr = sptw::create_tiled_bigtiff(
+          conf.output_filename, columns, rows, input_raster->GetRasterCount(),
+          in_band->GetRasterDataType(), geotransform, conf.output_srs,
+          conf.tile_size, &no_data, in_band->GetColorTable(), compression);
+      if (sperr != sptw::SP_None) {
+        fprintf(stderr, "Error creating output raster: %d\n", sperr);
+        created = 0;
+      }
     }
   }
 
   // Wait for rank 0 to finish creating the file
-  MPI_Barrier(MPI_COMM_WORLD);
+  MPI_Bcast(&created, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (!created) {
+    return PRB_IOERROR;
+  }
   PTIFF* output_raster = open_raster(conf.output_filename);
+  if (output_raster == NULL) {
+    fprintf(stderr, "Could not open output raster\n");
+    return PRB_IOERROR;
+  }
   if (rank == 0) {
-    SPTW_ERROR sperr = populate_tile_offsets(output_raster, conf.tile_size);
-
-    if (sperr != sptw::SP_None) {
-      fprintf(stderr, "\nError populating tile offsets!\n");
-      return PRB_IOERROR;
-    }
     printf("done.\n");
   }
 
-  // Wait for tile offsets to be populated
-  MPI_Barrier(MPI_COMM_WORLD);
-  
-  close_raster(output_raster);
-  output_raster = open_raster(conf.output_filename);
-  MPI_Barrier(MPI_COMM_WORLD);
-
   // Now open the new output file as a ProjectedRaster object. This object will
   // only be used to read metadata. It will _not_ be used to write to the output
   // file.
   GDALDataset *gdal_output_raster =
       static_cast<GDALDataset*>(GDALOpen(conf.output_filename.c_str(),
                                          GA_ReadOnly));
-
-  if (output_raster == NULL) {
-    fprintf(stderr, "Could not open output raster\n");
+  if (gdal_output_raster == NULL) {
+    fprintf(stderr, "Rank %d: Could not read the metadata of the output "
+            "raster\n", rank);
+  }
+  if (AnyProcessFailed(gdal_output_raster == NULL)) {
     return PRB_IOERROR;
   }
 
@@ -193,128 +514,511 @@ PRB_ERROR prasterblasterpio(Configuration conf) {
                               output_raster->block_x_size,
                               conf.partition_size);
 
+  // Up to this many partitions are in the queues of the pipeline, three
+  // more are in its stages.
+  const int pipeline_queue_length = 2;
+
+  // Split partitions whose chunks would not fit in this process's share of
+  // the memory limit. Compressed tiles are compressed whole, so they aren't
+  // streamed in strips.
+  if (conf.memory_limit > 0) {
+    partitions = librasterblaster::PlanPartitions(
+        input_raster, gdal_output_raster, partitions, conf.resampler,
+        conf.decimate_input,
+        conf.memory_limit / (2 * pipeline_queue_length + 3),
+        compression != sptw::SP_NoCompression);
+  }
+
+  // Partitions differ widely in cost, those outside of the input are
+  // nearly free while those near the poles read large input areas, so they
+  // are assigned by estimated cost rather than round-robin
+  vector<Area> all_partitions;
+  vector<double> all_costs;
+  vector<bool> all_outside;
+  GatherPartitions(partitions, input_raster, gdal_output_raster, conf,
+                   process_count, &all_partitions, &all_costs, &all_outside);
+
+  // Partitions with no pixel on the input would only be filled. When GDAL
+  // reads a missing tile as the fill value, the tiles that only such
+  // partitions touch are left out of the file and those partitions are
+  // skipped. A partition that shares a tile with one on the input, as the
+  // strips of a split partition do, still writes its fill.
+  const int64_t tile_count = output_raster->tiles_across
+      * output_raster->tiles_down;
+  vector<bool> sparse_tiles(tile_count, false);
+  if (FillIsNoData(gdal_output_raster, conf.fill_value)) {
+    sparse_tiles.assign(tile_count, true);
+    vector<bool> kept(all_partitions.size(), false);
+    for (size_t i = 0; i < all_partitions.size(); ++i) {
+      if (!all_outside[i]) {
+        kept[i] = true;
+        ClearTiles(all_partitions[i], output_raster, &sparse_tiles);
+      }
+    }
+
+    // A kept partition writes every tile it touches, which may in turn
+    // keep other partitions of those tiles
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t i = 0; i < all_partitions.size(); ++i) {
+        if (!kept[i]
+            && !AllTilesSet(all_partitions[i], output_raster, sparse_tiles)) {
+          kept[i] = true;
+          ClearTiles(all_partitions[i], output_raster, &sparse_tiles);
+          changed = true;
+        }
+      }
+    }
+
+    vector<Area> kept_partitions;
+    vector<double> kept_costs;
+    for (size_t i = 0; i < all_partitions.size(); ++i) {
+      if (kept[i]) {
+        kept_partitions.push_back(all_partitions[i]);
+        kept_costs.push_back(all_costs[i]);
+      }
+    }
+
+    all_partitions.swap(kept_partitions);
+    all_costs.swap(kept_costs);
+  }
+
+  const int64_t sparse_count = std::count(sparse_tiles.begin(),
+                                          sparse_tiles.end(), true);
   if (rank == 0) {
-    printf("Typical process has %lu partitions with base size: %d\n",
+    printf("Leaving out %lld of %lld tiles outside of the input\n",
+           static_cast<long long>(sparse_count),
+           static_cast<long long>(tile_count));
+  }
+  // Compressed tiles that aren't written are left out anyway
+  if (sparse_count > 0
+      && compression == sptw::SP_NoCompression
+      && sptw::leave_out_tiles_all(output_raster,
+                                   sparse_tiles) != sptw::SP_None) {
+    fprintf(stderr, "Error leaving tiles out of the output raster\n");
+    return PRB_IOERROR;
+  }
+
+  // Parts of tiles are assembled in memory and written as whole tiles
+  if (conf.write_cache_limit > 0
+      && compression == sptw::SP_NoCompression
+      && sptw::set_tile_cache(output_raster,
+                              conf.write_cache_limit) != sptw::SP_None
+      && rank == 0) {
+    fprintf(stderr, "Output tiles do not fit in the write cache, parts of "
+            "tiles are written straight away\n");
+  }
+
+  // The Hilbert scheduler lists partitions along a Hilbert curve and gives
+  // each process a contiguous range of the list, a compact region of the
+  // output whose partitions read neighbouring parts of the input. LPT
+  // assignment scatters partitions whatever their order, so the other
+  // schedulers keep theirs.
+  if (conf.scheduler == librasterblaster::HILBERT_SCHEDULER) {
+    const vector<size_t> order = librasterblaster::HilbertOrder(all_partitions);
+    vector<Area> ordered_partitions(order.size());
+    vector<double> ordered_costs(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      ordered_partitions[i] = all_partitions[order[i]];
+      ordered_costs[i] = all_costs[order[i]];
+    }
+    all_partitions.swap(ordered_partitions);
+    all_costs.swap(ordered_costs);
+  }
+
+  // With dynamic scheduling every process works through the list of all
+  // partitions, most costly first, claiming batches of it as it goes
+  std::unique_ptr<librasterblaster::PartitionScheduler> scheduler;
+  if (conf.scheduler == librasterblaster::DYNAMIC_SCHEDULER) {
+    vector<size_t> order(all_partitions.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&all_costs](size_t a, size_t b) {
+                       return all_costs[a] > all_costs[b];
+                     });
+
+    partitions.clear();
+    for (size_t i = 0; i < order.size(); ++i) {
+      partitions.push_back(all_partitions[order[i]]);
+    }
+    scheduler.reset(librasterblaster::PartitionScheduler::Create(
+        MPI_COMM_WORLD, partitions.size()));
+  } else {
+    // The static scheduler balances cost more evenly, the Hilbert one
+    // reads less of the input
+    double rank_cost = 0.0, max_cost = 0.0, total_cost = 0.0;
+    if (conf.scheduler == librasterblaster::HILBERT_SCHEDULER) {
+      partitions = librasterblaster::AssignPartitionRanges(
+          all_partitions, all_costs, rank, process_count, &rank_cost);
+    } else {
+      partitions = librasterblaster::AssignPartitions(
+          all_partitions, all_costs, rank, process_count, &rank_cost);
+    }
+    MPI_Reduce(&rank_cost, &max_cost, 1, MPI_DOUBLE, MPI_MAX, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(&rank_cost, &total_cost, 1, MPI_DOUBLE, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    if (rank == 0 && total_cost > 0.0) {
+      printf("Estimated cost of the most loaded process: %.1f%% of the "
+             "mean\n", 100.0 * max_cost * process_count / total_cost);
+    }
+  }
+
+  if (rank == 0) {
+    printf("%s %lu partitions with base size: %d\n",
+           scheduler ? "Processes share" : "Typical process has",
            partitions.size(),
            conf.partition_size);
   }
 
-  double read_total, misc_start, misc_total;
-  double write_start, write_end, write_total;
-  double resample_start, resample_end, resample_total;
-  double loop_start, prelude_end, minbox_total;
+  // Each process logs the choices of the AUTO resampler to its own file
+  FILE *resampler_log = NULL;
+  if (conf.resampler_log_filename != "") {
+    std::string log_filename = conf.resampler_log_filename;
+    if (process_count > 1) {
+      log_filename += "." + std::to_string(rank);
+    }
 
-  read_total = write_total = resample_total = misc_total = minbox_total = 0.0;
+    resampler_log = fopen(log_filename.c_str(), "w");
+    if (resampler_log == NULL) {
+      fprintf(stderr, "Error creating resampler log file %s\n",
+              log_filename.c_str());
+    }
+  }
+
+  // Chunks are reprojected by the threads of this pool
+  librasterblaster::ThreadPool pool(conf.thread_count);
+
+  double write_start, misc_start, misc_total, minbox_total, read_total;
+  read_total = misc_total = minbox_total = 0.0;
   preloop_time = MPI_Wtime() - start_time;
 
-  // Now we loop through the returned partitions
-  for (size_t i = 0; i < partitions.size(); i++) {
-    auto& partition = partitions[i];
-    loop_start = MPI_Wtime();
+  // Processes on the same node share the input tiles they have in common.
+  // The cache needs the minboxes of every partition of this process up
+  // front, which aren't known with dynamic scheduling, and a mapped input
+  // is already shared through the page cache.
+  vector<Area> input_areas;
+  std::unique_ptr<librasterblaster::NodeInputCache> node_cache;
+  if (conf.node_cache_limit > 0 && mapped_input == NULL && !scheduler) {
+    const double minbox_start = MPI_Wtime();
+    vector<Area> full_resolution_areas;
+    for (size_t i = 0; i < partitions.size(); ++i) {
+      input_areas.push_back(
+          librasterblaster::RasterMinbox(gdal_output_raster, input_raster,
+                                         partitions[i]));
+      if (!conf.decimate_input
+          || librasterblaster::DecimationFactor(input_areas[i],
+                                                partitions[i],
+                                                conf.resampler) == 1) {
+        full_resolution_areas.push_back(input_areas[i]);
+      }
+    }
+    minbox_total += MPI_Wtime() - minbox_start;
+
+    const double read_start = MPI_Wtime();
+    PRB_ERROR cache_err = PRB_NOERROR;
+    node_cache.reset(librasterblaster::NodeInputCache::Create(
+        MPI_COMM_WORLD, input_raster, full_resolution_areas,
+        conf.node_cache_limit, &cache_err));
+    read_total += MPI_Wtime() - read_start;
+    if (cache_err != PRB_NOERROR) {
+      fprintf(stderr, "Rank %d: Error reading shared input tiles!\n", rank);
+      return cache_err;
+    }
+    if (rank == 0) {
+      printf("Node input cache: %lld shared tiles, %.1f MiB\n",
+             static_cast<long long>(node_cache->tile_count()),
+             node_cache->bytes() / (1024.0 * 1024.0));
+    }
+  }
+
+  // Collective writes are made in rounds, one partition of every process
+  // per round. Processes that run out of partitions join the remaining
+  // rounds with empty writes. The number of partitions of a process isn't
+  // known in advance with dynamic scheduling.
+  bool collective_write = conf.collective_write;
+  if (collective_write && scheduler) {
+    if (rank == 0) {
+      printf("--collective-io needs a static scheduler, writing "
+             "independently\n");
+    }
+    collective_write = false;
+  }
+  const bool write_in_rounds = collective_write
+      || compression != sptw::SP_NoCompression;
+  int64_t write_rounds = partitions.size();
+  if (write_in_rounds) {
+    MPI_Allreduce(MPI_IN_PLACE, &write_rounds, 1, MPI_INT64_T, MPI_MAX,
+                  MPI_COMM_WORLD);
+  }
+
+  // A process whose pipeline fails still joins the rounds of the others.
+  // Each round starts with the processes agreeing on whether one of them
+  // has failed, in which case they all stop before the collective write.
+  int64_t rounds_written = 0;
+  bool rounds_failed = false;
+
+  // The partitions pass through a pipeline: the input of the next
+  // partitions is read while one is reprojected and the previous ones are
+  // written. Only the write stage, which runs on this thread, calls MPI.
+
+  // With a mapped input the minbox of the next partition is found one
+  // partition early, so its tiles are paged in while this one is processed.
+  Area next_in_area;
+  int next_in_area_index = -1;
+
+  // The partitions the pipeline works on are batch_first to batch_end - 1
+  int batch_first = 0;
+  int batch_end = partitions.size();
+
+  std::function<PRB_ERROR(int, PartitionChunks*)> read_partition =
+      [&](int item, PartitionChunks *chunks) {
+    const int i = batch_first + item;
+    const Area& partition = partitions[i];
+    const double minbox_start = Now();
 
     // Use the ProjectedRaster object we created for the input file to
     // create a RasterChunk that has the pixel values read into it.
-    Area in_area = librasterblaster::RasterMinbox(gdal_output_raster,
-                              input_raster,
-                              partition);
+    Area in_area = next_in_area;
+    if (!input_areas.empty()) {
+      in_area = input_areas[i];
+    } else if (i != next_in_area_index) {
+      in_area = librasterblaster::RasterMinbox(gdal_output_raster,
+                                               input_raster,
+                                               partition);
+    }
+    if (mapped_input != NULL && i + 1 < batch_end) {
+      next_in_area = librasterblaster::RasterMinbox(gdal_output_raster,
+                                                    input_raster,
+                                                    partitions[i + 1]);
+      next_in_area_index = i + 1;
+      mapped_input->Prefetch(next_in_area);
+    }
+
+    // When the output is much coarser than the input a decimated input chunk
+    // is read and only the residual scale is resampled.
+    int decimation = 1;
+    if (conf.decimate_input) {
+      decimation = librasterblaster::DecimationFactor(in_area,
+                                                      partition,
+                                                      conf.resampler);
+    }
 
-    RasterChunk in_chunk(input_raster, in_area);
-    minbox_total += MPI_Wtime() - loop_start;
+    chunks->input = RasterChunk(input_raster, in_area, decimation);
+    RasterChunk& in_chunk = chunks->input;
+    minbox_total += Now() - minbox_start;
 
-    prelude_end = MPI_Wtime();
-    PRB_ERROR chunk_err = in_chunk.Read(input_raster);
-    if (chunk_err != PRB_NOERROR) {
+    const double read_start = Now();
+    // Decimated chunks are read with GDAL, which can use the overviews
+    PRB_ERROR read_err = PRB_NOERROR;
+    if (node_cache != NULL) {
+      read_err = node_cache->Read(&in_chunk, input_raster);
+    } else if (mapped_input != NULL && in_chunk.decimation == 1) {
+      read_err = mapped_input->Read(&in_chunk);
+    } else {
+      read_err = in_chunk.Read(input_raster);
+    }
+    if (read_err != PRB_NOERROR) {
       fprintf(stderr, "Error reading input chunk!\n");
       return PRB_IOERROR;
     }
-    read_total += MPI_Wtime() - prelude_end;
-
-    misc_start = MPI_Wtime();
-    // We want a RasterChunk for the output area but we area going to generate
-    // the pixel values not read them from the file so we use
-    // CreateRasterChunk
-    RasterChunk out_chunk(gdal_output_raster, partition);
-
-    misc_total += MPI_Wtime() - misc_start;
+    read_total += Now() - read_start;
 
-    // Now we call ReprojectChunk with the RasterChunk pair and the desired
-    // resampler. ReprojectChunk performs the reprojection/resampling and fills
-    // the output RasterChunk with the new values.
+    // We want a RasterChunk for the output area but we area going to
+    // generate the pixel values not read them from the file. Its pixels are
+    // laid out in the tiles of the output file so they can be written
+    // without repacking.
+    const double create_start = Now();
+    chunks->output = RasterChunk(gdal_output_raster, partition, 1, true);
+    misc_total += Now() - create_start;
+    return PRB_NOERROR;
+  };
 
-    resample_start = MPI_Wtime();
-    bool ret = ReprojectChunk(in_chunk,
-                              out_chunk,
-                              conf.fill_value,
-                              conf.resampler);
-    if (ret == false) {
+  // ReprojectChunk performs the reprojection/resampling and fills the
+  // output RasterChunk with the new values.
+  std::function<PRB_ERROR(int, PartitionChunks&)> reproject_partition =
+      [&](int, PartitionChunks& chunks) {
+    if (!ReprojectChunk(chunks.input,
+                        chunks.output,
+                        conf.fill_value,
+                        conf.resampler,
+                        resampler_log,
+                        &pool)) {
       fprintf(stderr, "Error reprojecting chunk!\n");
       return PRB_PROJERROR;
     }
-    resample_end = MPI_Wtime();
-    resample_total += resample_end - resample_start;
 
-    write_start = MPI_Wtime();
-    PRB_ERROR err;
+    // The tiles are compressed here, on the threads of the pool, and only
+    // written by the write stage. The output pixels aren't needed after.
+    if (compression != sptw::SP_NoCompression) {
+      if (CompressChunk(output_raster, chunks.output, &pool,
+                        &chunks.compressed) != PRB_NOERROR) {
+        fprintf(stderr, "Error compressing chunk!\n");
+        return PRB_IOERROR;
+      }
+      chunks.output = RasterChunk();
+    }
+    return PRB_NOERROR;
+  };
+
+  std::function<PRB_ERROR(int, PartitionChunks&)> write_partition =
+      [&](int item, PartitionChunks& chunks) {
+    const int i = batch_first + item;
+    if (write_in_rounds) {
+      if (AnyProcessFailed(false)) {
+        rounds_failed = true;
+        return PRB_IOERROR;
+      }
+      ++rounds_written;
+    }
 
-    err = write_rasterchunk(output_raster,
-                            out_chunk);
+    PRB_ERROR err = PRB_NOERROR;
+    if (compression != sptw::SP_NoCompression) {
+      if (sptw::write_compressed_tiles_all(output_raster, &chunks.compressed)
+          != sptw::SP_None) {
+        err = PRB_IOERROR;
+      }
+    } else {
+      err = write_rasterchunk(output_raster, chunks.output, collective_write);
+    }
     if (err != PRB_NOERROR) {
       fprintf(stderr, "Rank %d: Error writing chunk!\n", rank);
       return PRB_IOERROR;
     }
-    write_end = MPI_Wtime();
-    write_total += write_end - write_start;
-
-    misc_start = MPI_Wtime();
 
     if (rank == 0) {
       printf(" %lu%% ", (i*100) / partitions.size());
       fflush(stdout);
     }
-    misc_total += MPI_Wtime() - misc_start;
+    return PRB_NOERROR;
+  };
+
+  // With dynamic scheduling the pipeline runs once per claimed batch. The
+  // claims are made here, between batches, because only this thread may
+  // call MPI. While rank 0 waits on its own compute stage it keeps serving
+  // the claims of the other processes.
+  librasterblaster::PipelineTimes stage_times;
+  PRB_ERROR pipeline_err = PRB_NOERROR;
+  if (!scheduler) {
+    pipeline_err = librasterblaster::RunPipeline(partitions.size(),
+                                                 pipeline_queue_length,
+                                                 read_partition,
+                                                 reproject_partition,
+                                                 write_partition,
+                                                 &stage_times);
+  } else {
+    std::function<void()> serve_claims;
+    if (rank == 0) {
+      serve_claims = [&scheduler] { scheduler->Serve(); };
+    }
+    int64_t first = 0;
+    int64_t count = 0;
+    while (pipeline_err == PRB_NOERROR
+           && (count = scheduler->Claim(&first)) > 0) {
+      batch_first = first;
+      batch_end = first + count;
+
+      librasterblaster::PipelineTimes batch_times;
+      pipeline_err = librasterblaster::RunPipeline(count,
+                                                   pipeline_queue_length,
+                                                   read_partition,
+                                                   reproject_partition,
+                                                   write_partition,
+                                                   &batch_times,
+                                                   serve_claims);
+      for (int stage = 0; stage < librasterblaster::STAGE_COUNT; ++stage) {
+        stage_times.busy[stage] += batch_times.busy[stage];
+      }
+      stage_times.elapsed += batch_times.elapsed;
+    }
+  }
+  double resample_total = stage_times.busy[librasterblaster::COMPUTE_STAGE];
+  double write_total = stage_times.busy[librasterblaster::WRITE_STAGE];
+
+  // The rounds left, if this process has fewer partitions than others or
+  // stopped early, are joined with empty writes
+  write_start = MPI_Wtime();
+  for (int64_t i = rounds_written;
+       write_in_rounds && i < write_rounds && !rounds_failed;
+       ++i) {
+    if (AnyProcessFailed(pipeline_err != PRB_NOERROR)) {
+      break;
+    }
+    const SPTW_ERROR err = (compression != sptw::SP_NoCompression)
+        ? sptw::write_compressed_tiles_all(output_raster, NULL)
+        : sptw::write_tiles_all(output_raster, NULL, 0, 0, -1, -1);
+    if (err != sptw::SP_None) {
+      fprintf(stderr, "Rank %d: Error writing chunk!\n", rank);
+      pipeline_err = PRB_IOERROR;
+    }
+  }
+  write_total += MPI_Wtime() - write_start;
+
+  // Every process stops if one of them failed, before the collective calls
+  // that close the output
+  if (AnyProcessFailed(pipeline_err != PRB_NOERROR)) {
+    return (pipeline_err != PRB_NOERROR) ? pipeline_err : PRB_IOERROR;
   }
 
   if (rank == 0) {
     printf(" 100%%\n");
   }
 
+  if (resampler_log != NULL) {
+    fclose(resampler_log);
+  }
+
   // Clean up
   write_start = MPI_Wtime();
   close_raster(output_raster);
   write_total += MPI_Wtime() - write_start;
 
   misc_start = MPI_Wtime();
+  node_cache.reset();
+  scheduler.reset();
   output_raster = NULL;
   delete gdal_output_raster;
   delete input_raster;
   misc_total += MPI_Wtime() - misc_start;
 
-  // Report runtimes
+  // Report runtimes. The stages of the pipeline overlap, so the read,
+  // resample and write times can add up to more than the total. The
+  // utilization of a stage is the fraction of the pipeline's run time that
+  // it spent working rather than waiting for the other stages.
   end_time = MPI_Wtime();
-  double runtimes[7] = { end_time - start_time,
-                         preloop_time,
-                         minbox_total,
-                         read_total,
-                         resample_total,
-                         write_total,
-                         misc_total };
-  std::vector<double> process_runtimes(process_count*7);
+  const int timing_count = 10;
+  double runtimes[timing_count] = {
+    end_time - start_time,
+    preloop_time,
+    minbox_total,
+    read_total,
+    resample_total,
+    write_total,
+    misc_total,
+    stage_times.Utilization(librasterblaster::READ_STAGE),
+    stage_times.Utilization(librasterblaster::COMPUTE_STAGE),
+    stage_times.Utilization(librasterblaster::WRITE_STAGE)
+  };
+  std::vector<double> process_runtimes(process_count*timing_count);
   MPI_Gather(runtimes,
-             7,
+             timing_count,
              MPI_DOUBLE,
              &process_runtimes[0],
-             7,
+             timing_count,
              MPI_DOUBLE,
              0,
              MPI_COMM_WORLD);
   
-  double averages[7] = { 0.0 };
+  double averages[timing_count] = { 0.0 };
 
   for (unsigned int i = 0; i < process_runtimes.size(); i++) {
-    averages[i % 7] += process_runtimes[i];
+    averages[i % timing_count] += process_runtimes[i];
   }
 
-  for (unsigned int i = 0; i < 7; i++) {
+  for (unsigned int i = 0; i < timing_count; i++) {
     averages[i] /= process_count;
   }
 
@@ -329,6 +1033,17 @@ PRB_ERROR prasterblasterpio(Configuration conf) {
            averages[4],
            averages[5],
            averages[6]);
+    printf("Stage utilization: read %.0f%%, reproject %.0f%%, write %.0f%%\n",
+           averages[7] * 100,
+           averages[8] * 100,
+           averages[9] * 100);
+
+    const librasterblaster::BufferPool::Statistics buffers =
+        librasterblaster::BufferPool::Global().statistics();
+    printf("Chunk buffers: %lld acquired, %lld reused, peak %.1f MiB\n",
+           static_cast<long long>(buffers.acquires),
+           static_cast<long long>(buffers.reuses),
+           buffers.peak_bytes / (1024.0 * 1024.0));
   }
 
   FILE *timing_file = stdout;
@@ -344,8 +1059,10 @@ PRB_ERROR prasterblasterpio(Configuration conf) {
     struct timeval time;
     gettimeofday(&time, NULL);
     fprintf(timing_file, "finish_time,process_count,total,preloop,minbox,read"
-            ",resample,write,misc\n");
-    fprintf(timing_file, "%lld,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+            ",resample,write,misc,read_utilization,resample_utilization"
+            ",write_utilization\n");
+    fprintf(timing_file, "%lld,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f"
+            ",%.4f,%.4f,%.4f\n",
             static_cast<long long>(time.tv_sec),
             process_count,
             averages[0],
@@ -354,20 +1071,28 @@ PRB_ERROR prasterblasterpio(Configuration conf) {
             averages[3],
             averages[4],
             averages[5],
-            averages[6]);
+            averages[6],
+            averages[7],
+            averages[8],
+            averages[9]);
 
     fprintf(timing_file, "process,total,preloop,minbox,read,resample"
-            ",write,misc\n");
-    for (unsigned int i = 0; i < process_runtimes.size(); i+=7) {
-      fprintf(timing_file, "%u,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
-              i/7,
+            ",write,misc,read_utilization,resample_utilization"
+            ",write_utilization\n");
+    for (unsigned int i = 0; i < process_runtimes.size(); i+=timing_count) {
+      fprintf(timing_file, "%u,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f"
+              ",%.4f,%.4f,%.4f\n",
+              i/timing_count,
               process_runtimes[i],
               process_runtimes[i+1],
               process_runtimes[i+2],
               process_runtimes[i+3],
               process_runtimes[i+4],
               process_runtimes[i+5],
-              process_runtimes[i+6]);
+              process_runtimes[i+6],
+              process_runtimes[i+7],
+              process_runtimes[i+8],
+              process_runtimes[i+9]);
     }
   }
   if (rank == 0 && conf.timing_filename != "") {
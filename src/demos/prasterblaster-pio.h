@@ -29,10 +29,15 @@ namespace librasterblaster {
  *
  * @param ptiff PTIFF target for output
  * @param chunk RasterChunk to be written to file
+ * @param collective Write a tiled chunk with sptw::write_tiles_all, every
+ *        process must then call write_rasterchunk the same number of times.
+ *        Untiled chunks are written independently but still join the
+ *        collective call.
  *
  */
 PRB_ERROR write_rasterchunk(sptw::PTIFF *ptiff,
-                            RasterChunk *chunk);
+                            RasterChunk& chunk,
+                            bool collective = false);
 
 /**
  * @brief prasterblasterpio performs a complete, potentially parallel, raster
@@ -0,0 +1,53 @@
+//
+// Copyright 0000 <Nobody>
+// @file
+// @author David Matthew Mattli <dmattli@usgs.gov>
+//
+// @section LICENSE
+//
+// This software is in the public domain, furnished "as is", without
+// technical support, and with no warranty, express or implied, as to
+// its usefulness for any purpose.
+//
+// @section DESCRIPTION
+//
+// Implements main() function for prasterblaster-threads command-line tool.
+//
+//
+
+#include "../configuration.h"
+#include "../demos/prasterblaster-threads.h"
+
+using librasterblaster::Configuration;
+using librasterblaster::prasterblasterthreads;
+/*! \page prasterblasterthreads
+
+\htmlonly
+USAGE:
+\endhtmlonly
+
+\verbatim
+prasterblaster-threads [--t_srs target_srs] [--s_srs source_srs]
+                       [-r resampling_method] [-n partition_size]
+                       [--dstnodata no_data_value]
+                       [--threads thread_count]
+                       source_file destination_file
+
+\endverbatim
+
+\section prasterblasterthreads_description DESCRIPTION
+
+<p>
+
+The prasterblaster-threads program reprojects a raster on all of the cores of
+a single machine without MPI. It accepts the same options as prasterblasterpio,
+--threads sets the number of threads and defaults to the number of cores. The
+implementation can be found in prasterblaster-threads.cc.
+
+</p>
+ */
+int main(int argc, char *argv[]) {
+  Configuration conf(argc, argv);
+
+  return prasterblasterthreads(conf);
+}
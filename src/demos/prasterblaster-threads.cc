@@ -0,0 +1,368 @@
+///
+/// Copyright 0000 <Nobody>
+/// @file
+/// @author David Matthew Mattli <dmattli@usgs.gov>
+///
+/// @section LICENSE
+///
+/// This software is in the public domain, furnished "as is", without
+/// technical support, and with no warranty, express or implied, as to
+/// its usefulness for any purpose.
+///
+/// @section DESCRIPTION
+///
+/// This file implements raster reprojection on the cores of a single machine
+/// with librasterblaster. Partitions are distributed over a pool of threads
+/// and written to the output tiff through GDAL. It does not use MPI.
+///
+///
+
+#include <gdal.h>
+#include <gdal_priv.h>
+#include <sys/time.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../configuration.h"
+#include "../mappedraster.h"
+#include "../rasterchunk.h"
+#include "../reprojection_tools.h"
+#include "../threadpool.h"
+#include "../utils.h"
+
+#include "../demos/prasterblaster-threads.h"
+
+using std::vector;
+
+using librasterblaster::Area;
+using librasterblaster::BlockPartition;
+using librasterblaster::BufferPool;
+using librasterblaster::Configuration;
+using librasterblaster::MappedRaster;
+using librasterblaster::PRB_BADARG;
+using librasterblaster::PRB_ERROR;
+using librasterblaster::PRB_IOERROR;
+using librasterblaster::PRB_NOERROR;
+using librasterblaster::PRB_PROJERROR;
+using librasterblaster::PlanPartitions;
+using librasterblaster::RasterChunk;
+using librasterblaster::ThreadPool;
+
+/** \cond DOXYHIDE **/
+static void GDALQuietErrorHandler(CPLErr, int, const char *) {
+}
+
+// Seconds since an arbitrary point, for measuring intervals
+static double WallTime() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Timing columns, in the order they are reported
+enum { TOTAL, PRELOOP, MINBOX, READ, RESAMPLE, WRITE, MISC, TIMING_COUNT };
+/** \endcond **/
+
+namespace librasterblaster {
+/** Main function for the prasterblaster-threads program */
+PRB_ERROR prasterblasterthreads(Configuration conf) {
+  const double start_time = WallTime();
+
+  // GDAL error handlers pushed with CPLPushErrorHandler() only apply to the
+  // calling thread
+  CPLSetErrorHandler(GDALQuietErrorHandler);
+  GDALAllRegister();
+  BufferPool::Global().set_huge_pages(conf.huge_pages);
+
+  if (conf.input_filename == "" || conf.output_filename == "") {
+    printf("USAGE:\n"
+           "prasterblaster-threads [--t_srs target_srs] [--s_srs source_srs]\n"
+           "               [-r resampling_method] [-n partition_size]\n"
+           "               [--dstnodata no_data_value]\n"
+           "               [--timing-file filename]\n"
+           "               [--tile-size tile_size_in_pixels]\n"
+           "               [--output-ratio output_cell_dimension_ratio]\n"
+           "               [--no-decimation]\n"
+           "               [--resampler-log filename]\n"
+           "               [--threads thread_count]\n"
+           "               [--memory-limit megabytes]\n"
+           "               [--huge-pages]\n"
+           "               [--mmap-input]\n"
+           "               source_file destination_file\n");
+    return PRB_BADARG;
+  }
+
+  int thread_count = conf.thread_count;
+  if (thread_count < 1) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  GDALDataset *input_raster =
+      static_cast<GDALDataset*>(GDALOpen(conf.input_filename.c_str(),
+                                         GA_ReadOnly));
+  if (input_raster == NULL) {
+    fprintf(stderr, "Error opening input raster!\n");
+    return PRB_IOERROR;
+  }
+
+  // An uncompressed, tiled BigTIFF can be read straight from a mapping of
+  // the file, which every thread shares, instead of through GDAL.
+  std::unique_ptr<MappedRaster> mapped_input;
+  if (conf.mmap_input) {
+    mapped_input.reset(MappedRaster::Open(conf.input_filename));
+    if (mapped_input == NULL) {
+      printf("Input is not an uncompressed, tiled BigTIFF, reading it with "
+             "GDAL\n");
+    }
+  }
+
+  printf("prasterblaster-threads: Beginning reprojection task\n");
+  printf("\tInput File: %s, Output File: %s, Threads: %d\n",
+         conf.input_filename.c_str(), conf.output_filename.c_str(),
+         thread_count);
+  printf("Creating output raster...");
+
+  double no_data = NAN;
+  if (!conf.fill_value.empty()) {
+    no_data = std::strtod(conf.fill_value.c_str(), NULL);
+  }
+
+  PRB_ERROR err = CreateOutputRaster(input_raster,
+                                     conf.output_filename,
+                                     conf.output_srs,
+                                     conf.tile_size,
+                                     conf.cell_dimension_ratio,
+                                     no_data);
+  if (err != PRB_NOERROR) {
+    fprintf(stderr, "Error creating output raster: %d\n", err);
+    GDALClose(input_raster);
+    return PRB_IOERROR;
+  }
+
+  // All chunks are written through this dataset while holding write_mutex,
+  // GDAL datasets can not be used by several threads at once.
+  GDALDataset *output_raster =
+      static_cast<GDALDataset*>(GDALOpen(conf.output_filename.c_str(),
+                                         GA_Update));
+  if (output_raster == NULL) {
+    fprintf(stderr, "Could not open output raster\n");
+    GDALClose(input_raster);
+    return PRB_IOERROR;
+  }
+  std::mutex write_mutex;
+  printf("done.\n");
+
+  // Every thread reads the input, and the metadata of the output, through
+  // its own datasets.
+  vector<GDALDataset*> inputs(thread_count, NULL);
+  vector<GDALDataset*> outputs(thread_count, NULL);
+  inputs[0] = input_raster;
+  for (int i = 0; i < thread_count; ++i) {
+    if (i > 0) {
+      inputs[i] =
+          static_cast<GDALDataset*>(GDALOpen(conf.input_filename.c_str(),
+                                             GA_ReadOnly));
+    }
+    outputs[i] =
+        static_cast<GDALDataset*>(GDALOpen(conf.output_filename.c_str(),
+                                           GA_ReadOnly));
+    if (inputs[i] == NULL || outputs[i] == NULL) {
+      fprintf(stderr, "Error opening rasters for thread %d\n", i);
+      err = PRB_IOERROR;
+      break;
+    }
+  }
+
+  FILE *resampler_log = NULL;
+  if (err == PRB_NOERROR && conf.resampler_log_filename != "") {
+    resampler_log = fopen(conf.resampler_log_filename.c_str(), "w");
+    if (resampler_log == NULL) {
+      fprintf(stderr, "Error creating resampler log file %s\n",
+              conf.resampler_log_filename.c_str());
+    }
+  }
+
+  int tile_size = conf.tile_size;
+  int unused;
+  output_raster->GetRasterBand(1)->GetBlockSize(&tile_size, &unused);
+
+  vector<Area> partitions = BlockPartition(0,
+                                           1,
+                                           output_raster->GetRasterYSize(),
+                                           output_raster->GetRasterXSize(),
+                                           tile_size,
+                                           conf.partition_size);
+  // Every thread holds the chunks of one partition at a time
+  if (conf.memory_limit > 0) {
+    partitions = PlanPartitions(input_raster, output_raster, partitions,
+                                conf.resampler, conf.decimate_input,
+                                conf.memory_limit / thread_count);
+  }
+  printf("%lu partitions with base size: %d\n",
+         partitions.size(),
+         conf.partition_size);
+
+  vector<double> runtimes(thread_count * TIMING_COUNT, 0.0);
+  for (int i = 0; i < thread_count; ++i) {
+    runtimes[i * TIMING_COUNT + PRELOOP] = WallTime() - start_time;
+  }
+
+  std::atomic<int> error(err);
+  size_t partitions_done = 0;
+  ThreadPool pool(thread_count);
+
+  // Neighbouring partitions share input rows, StealingFor() keeps them on
+  // the same thread unless the load is uneven.
+  pool.StealingFor(partitions.size(), [&](int worker, int i) {
+    if (error != PRB_NOERROR) {
+      return;
+    }
+
+    double *times = &runtimes[worker * TIMING_COUNT];
+    const Area& partition = partitions[i];
+    double time = WallTime();
+
+    Area in_area = RasterMinbox(outputs[worker], inputs[worker], partition);
+    int decimation = 1;
+    if (conf.decimate_input) {
+      decimation = DecimationFactor(in_area, partition, conf.resampler);
+    }
+    RasterChunk in_chunk(inputs[worker], in_area, decimation);
+    times[MINBOX] += WallTime() - time;
+
+    time = WallTime();
+    // Decimated chunks are read with GDAL, which can use the overviews
+    const PRB_ERROR read_err =
+        (mapped_input != NULL && in_chunk.decimation == 1)
+        ? mapped_input->Read(&in_chunk) : in_chunk.Read(inputs[worker]);
+    if (read_err != PRB_NOERROR) {
+      fprintf(stderr, "Error reading input chunk!\n");
+      error = PRB_IOERROR;
+      return;
+    }
+    times[READ] += WallTime() - time;
+
+    time = WallTime();
+    RasterChunk out_chunk(outputs[worker], partition, 1, true);
+    times[MISC] += WallTime() - time;
+
+    time = WallTime();
+    if (!ReprojectChunk(in_chunk, out_chunk, conf.fill_value, conf.resampler,
+                        resampler_log)) {
+      fprintf(stderr, "Error reprojecting chunk!\n");
+      error = PRB_PROJERROR;
+      return;
+    }
+    times[RESAMPLE] += WallTime() - time;
+
+    time = WallTime();
+    {
+      std::lock_guard<std::mutex> lock(write_mutex);
+      if (out_chunk.Write(output_raster) != PRB_NOERROR) {
+        error = PRB_IOERROR;
+        return;
+      }
+      ++partitions_done;
+      printf(" %lu%% ", (partitions_done * 100) / partitions.size());
+      fflush(stdout);
+    }
+    times[WRITE] += WallTime() - time;
+  });
+  printf(" 100%%\n");
+
+  if (resampler_log != NULL) {
+    fclose(resampler_log);
+  }
+
+  // Clean up
+  double time = WallTime();
+  GDALClose(output_raster);
+  const double close_time = WallTime() - time;
+  for (int i = 0; i < thread_count; ++i) {
+    if (inputs[i] != NULL) {
+      GDALClose(inputs[i]);
+    }
+    if (outputs[i] != NULL) {
+      GDALClose(outputs[i]);
+    }
+  }
+
+  if (error != PRB_NOERROR) {
+    return static_cast<PRB_ERROR>(error.load());
+  }
+
+  // Report runtimes, closing the output flushes it so it is counted as
+  // writing time.
+  const double end_time = WallTime();
+  double averages[TIMING_COUNT] = { 0.0 };
+  for (int i = 0; i < thread_count; ++i) {
+    runtimes[i * TIMING_COUNT + TOTAL] = end_time - start_time;
+    runtimes[i * TIMING_COUNT + WRITE] += close_time;
+    for (int j = 0; j < TIMING_COUNT; ++j) {
+      averages[j] += runtimes[i * TIMING_COUNT + j] / thread_count;
+    }
+  }
+
+  printf("\nRuntimes in seconds:\n");
+  printf("Total  Pre-loop Minbox Read   Resample Write  Misc\n");
+  printf("%.4f %.4f   %.4f %.4f %.4f   %.4f %.4f\n",
+         averages[TOTAL],
+         averages[PRELOOP],
+         averages[MINBOX],
+         averages[READ],
+         averages[RESAMPLE],
+         averages[WRITE],
+         averages[MISC]);
+
+  const BufferPool::Statistics buffers = BufferPool::Global().statistics();
+  printf("Chunk buffers: %lld acquired, %lld reused, peak %.1f MiB\n",
+         static_cast<long long>(buffers.acquires),
+         static_cast<long long>(buffers.reuses),
+         buffers.peak_bytes / (1024.0 * 1024.0));
+
+  if (conf.timing_filename != "") {
+    FILE *timing_file = fopen(conf.timing_filename.c_str(), "w");
+    if (timing_file == NULL) {
+      fprintf(stderr, "Error creating timing output file");
+      return PRB_NOERROR;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    fprintf(timing_file, "finish_time,thread_count,total,preloop,minbox,read"
+            ",resample,write,misc\n");
+    fprintf(timing_file, "%lld,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+            static_cast<long long>(now.tv_sec),
+            thread_count,
+            averages[TOTAL],
+            averages[PRELOOP],
+            averages[MINBOX],
+            averages[READ],
+            averages[RESAMPLE],
+            averages[WRITE],
+            averages[MISC]);
+
+    fprintf(timing_file, "thread,total,preloop,minbox,read,resample"
+            ",write,misc\n");
+    for (int i = 0; i < thread_count; ++i) {
+      const double *times = &runtimes[i * TIMING_COUNT];
+      fprintf(timing_file, "%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+              i,
+              times[TOTAL],
+              times[PRELOOP],
+              times[MINBOX],
+              times[READ],
+              times[RESAMPLE],
+              times[WRITE],
+              times[MISC]);
+    }
+    fclose(timing_file);
+  }
+
+  return PRB_NOERROR;
+}
+}
@@ -0,0 +1,39 @@
+/*!
+ * Copyright 0000 <Nobody>
+ * @file
+ * @author David Matthew Mattli <dmattli@usgs.gov>
+ *
+ * @section LICENSE
+ *
+ * This software is in the public domain, furnished "as is", without
+ * technical support, and with no warranty, express or implied, as to
+ * its usefulness for any purpose.
+ *
+ * @section DESCRIPTION
+ *
+ * Header for the shared-memory reprojection driver
+ *
+ */
+#ifndef SRC_DEMOS_PRASTERBLASTER_THREADS_H_
+#define SRC_DEMOS_PRASTERBLASTER_THREADS_H_
+
+#include "../configuration.h"
+#include "../utils.h"
+
+namespace librasterblaster {
+/**
+ * @brief prasterblasterthreads performs a complete raster reprojection job
+ * in a single process using the parameters specified by conf.
+ *
+ * The partitions of the output raster are distributed over conf.thread_count
+ * threads (one per core if zero) with ThreadPool::StealingFor(). Every
+ * thread reads the input through its own GDAL dataset, and output chunks are
+ * written through one shared GDAL dataset, one chunk at a time. MPI is not
+ * used.
+ *
+ * @param conf Configuration class that describes the reprojection task
+ */
+PRB_ERROR prasterblasterthreads(librasterblaster::Configuration conf);
+}
+
+#endif  // SRC_DEMOS_PRASTERBLASTER_THREADS_H_
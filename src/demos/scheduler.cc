@@ -0,0 +1,91 @@
+/*!
+ * Copyright 0000 <Nobody>
+ * @file
+ * @author David Matthew Mattli <dmattli@usgs.gov>
+ *
+ * @section LICENSE
+ *
+ * This software is in the public domain, furnished "as is", without
+ * technical support, and with no warranty, express or implied, as to
+ * its usefulness for any purpose.
+ *
+ * @section DESCRIPTION
+ *
+ * Dynamic scheduling of partitions with an atomic counter in an MPI window.
+ *
+ */
+
+#include <algorithm>
+
+#include "scheduler.h"
+
+namespace librasterblaster {
+PartitionScheduler::PartitionScheduler()
+    : comm_(MPI_COMM_NULL), window_(MPI_WIN_NULL), process_count_(1),
+      item_count_(0), next_seen_(0) {
+}
+
+PartitionScheduler::~PartitionScheduler() {
+  if (window_ != MPI_WIN_NULL) {
+    MPI_Win_unlock_all(window_);
+    MPI_Win_free(&window_);
+  }
+}
+
+PartitionScheduler *PartitionScheduler::Create(MPI_Comm comm,
+                                               int64_t item_count) {
+  PartitionScheduler *scheduler = new PartitionScheduler();
+  scheduler->comm_ = comm;
+  scheduler->item_count_ = item_count;
+
+  int rank = 0;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &scheduler->process_count_);
+
+  // Only rank 0 holds the counter
+  int64_t *counter = NULL;
+  MPI_Win_allocate((rank == 0) ? sizeof(int64_t) : 0, sizeof(int64_t),
+                   MPI_INFO_NULL, comm, &counter, &scheduler->window_);
+  if (rank == 0) {
+    *counter = 0;
+  }
+
+  // The counter is set before any process claims from it
+  MPI_Barrier(comm);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, scheduler->window_);
+
+  return scheduler;
+}
+
+int64_t PartitionScheduler::Claim(int64_t *first) {
+  if (next_seen_ >= item_count_) {
+    return 0;
+  }
+
+  // A quarter of an even share of what was left, so that a process that
+  // turns out to be slow holds back little work
+  const int64_t batch = std::max<int64_t>(
+      1, (item_count_ - next_seen_) / (4 * process_count_));
+  int64_t start = 0;
+  MPI_Fetch_and_op(&batch, &start, MPI_INT64_T, 0, 0, MPI_SUM, window_);
+  MPI_Win_flush(0, window_);
+
+  if (start >= item_count_) {
+    next_seen_ = item_count_;
+    return 0;
+  }
+
+  const int64_t count = std::min(batch, item_count_ - start);
+  *first = start;
+  next_seen_ = start + count;
+
+  return count;
+}
+
+void PartitionScheduler::Serve() {
+  // Any call that enters the progress engine will do, a probe that finds
+  // nothing is about the cheapest
+  int flag = 0;
+  MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, comm_, &flag, MPI_STATUS_IGNORE);
+}
+}
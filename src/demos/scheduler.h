@@ -0,0 +1,86 @@
+/*!
+ * Copyright 0000 <Nobody>
+ * @file
+ * @author David Matthew Mattli <dmattli@usgs.gov>
+ *
+ * @section LICENSE
+ *
+ * This software is in the public domain, furnished "as is", without
+ * technical support, and with no warranty, express or implied, as to
+ * its usefulness for any purpose.
+ *
+ * @section DESCRIPTION
+ *
+ * Dynamic scheduling of partitions with an atomic counter in an MPI window.
+ *
+ */
+
+#ifndef SRC_DEMOS_SCHEDULER_H_
+#define SRC_DEMOS_SCHEDULER_H_
+
+#include <stdint.h>
+
+#include <mpi.h>
+
+namespace librasterblaster {
+/// Partition scheduler class
+/**
+ * A PartitionScheduler hands out the items 0 to item_count - 1, in order,
+ * to the processes of a communicator as they ask for them. The next item
+ * to hand out is a counter in a window hosted by rank 0, and Claim()
+ * advances it with MPI_Fetch_and_op, so no process waits for another to
+ * hand it work. MPI libraries without asynchronous progress only complete
+ * a claim while rank 0 is inside an MPI call, though, so rank 0 calls
+ * Serve() while it would otherwise go without calling MPI.
+ *
+ * Batches are guided: each claim takes a share of the items that were left
+ * at the previous claim of the process, so batches start large and shrink
+ * to single items toward the end, where they balance the finishing times.
+ */
+class PartitionScheduler {
+ public:
+  /**
+   * @brief Creates the window of the counter. Collective over comm.
+   *
+   * @param comm Communicator of the processes that share the items
+   * @param item_count Number of items, the same on every process
+   */
+  static PartitionScheduler *Create(MPI_Comm comm, int64_t item_count);
+
+  /**
+   * @brief Destructor, frees the window. Collective over the communicator.
+   */
+  ~PartitionScheduler();
+
+  /**
+   * @brief Claims the next batch of items for this process.
+   *
+   * @param first Receives the first item of the batch
+   *
+   * @return Returns the number of items in the batch, 0 once every item has
+   * been handed out.
+   */
+  int64_t Claim(int64_t *first);
+
+  /**
+   * @brief Lets MPI complete the claims other processes made on the
+   * counter. Only useful on rank 0, and cheap enough to call every
+   * millisecond.
+   */
+  void Serve();
+
+ private:
+  PartitionScheduler();
+  PartitionScheduler(const PartitionScheduler &);
+  PartitionScheduler &operator=(const PartitionScheduler &);
+
+  MPI_Comm comm_;
+  MPI_Win window_;
+  int process_count_;
+  int64_t item_count_;
+  // Value of the counter after the last claim of this process
+  int64_t next_seen_;
+};
+}
+
+#endif  // SRC_DEMOS_SCHEDULER_H_
@@ -16,17 +16,28 @@
  */
 
 #include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 #include <fcntl.h>
+#include <unistd.h>
 #include <gdal_priv.h>
+#include <cpl_conv.h>
 #include <cpl_string.h>
 #include <ogr_api.h>
 #include <ogr_spatialref.h>
 #include <mpi.h>
 #include <tiff.h>
 #include <tiffio.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "sptw.h"
 
@@ -38,6 +49,189 @@ using librasterblaster::RasterChunk;
 using librasterblaster::Area;
 
 namespace sptw {
+/*
+ * Tiles of a PTIFF being assembled from the parts written by write_area.
+ * Each tile keeps its pixels, laid out as in the file, and which of them
+ * have been given.
+ */
+class TileCache {
+ public:
+  TileCache(PTIFF *ptiff, int64_t memory_limit);
+
+  // Bytes one cached tile takes
+  int64_t entry_bytes() const { return tile_bytes_ + pixels_per_tile_; }
+
+  // Copies the part of data, which holds the area buffer_ul to buffer_lr,
+  // inside subset to its tile. subset must lie within one tile.
+  SPTW_ERROR Write(void *data,
+                   int64_t buffer_ul_x,
+                   int64_t buffer_ul_y,
+                   int64_t buffer_lr_x,
+                   Area subset);
+  // Writes every tile held and empties the cache
+  SPTW_ERROR Flush();
+  // Forgets the tile, because it has been written whole
+  void Discard(int64_t tile_index);
+
+ private:
+  struct Tile {
+    std::vector<uint8_t> pixels;
+    std::vector<uint8_t> filled;
+    int64_t filled_count;
+    std::list<int64_t>::iterator lru_position;
+  };
+
+  // Writes the given pixels of a tile, or all of it in one call once it is
+  // complete, and drops it from the cache
+  SPTW_ERROR WriteTile(int64_t tile_index);
+  int64_t ValidPixels(int64_t tile_index) const;
+
+  PTIFF *ptiff_;
+  int64_t memory_limit_;
+  int64_t pixel_bytes_;
+  int64_t pixels_per_tile_;
+  int64_t tile_bytes_;
+  // Most recently written first
+  std::list<int64_t> lru_;
+  std::unordered_map<int64_t, Tile> tiles_;
+
+  TileCache(const TileCache&);
+  TileCache& operator=(const TileCache&);
+};
+
+TileCache::TileCache(PTIFF *ptiff, int64_t memory_limit)
+    : ptiff_(ptiff), memory_limit_(memory_limit) {
+  pixel_bytes_ = static_cast<int64_t>(ptiff->band_type_size)
+      * ptiff->band_count;
+  pixels_per_tile_ = ptiff->block_x_size * ptiff->block_y_size;
+  tile_bytes_ = pixels_per_tile_ * pixel_bytes_;
+}
+
+int64_t TileCache::ValidPixels(int64_t tile_index) const {
+  const int64_t x = (tile_index % ptiff_->tiles_across) * ptiff_->block_x_size;
+  const int64_t y = (tile_index / ptiff_->tiles_across) * ptiff_->block_y_size;
+  return std::min(ptiff_->block_x_size, ptiff_->x_size - x)
+      * std::min(ptiff_->block_y_size, ptiff_->y_size - y);
+}
+
+SPTW_ERROR TileCache::Write(void *data,
+                            int64_t buffer_ul_x,
+                            int64_t buffer_ul_y,
+                            int64_t buffer_lr_x,
+                            Area subset) {
+  const int64_t ul_x = subset.ul.x;
+  const int64_t ul_y = subset.ul.y;
+  const int64_t lr_x = subset.lr.x;
+  const int64_t lr_y = subset.lr.y;
+  const int64_t tile_index = ul_x / ptiff_->block_x_size
+      + (ul_y / ptiff_->block_y_size) * ptiff_->tiles_across;
+  SPTW_ERROR err = SP_None;
+
+  std::unordered_map<int64_t, Tile>::iterator it = tiles_.find(tile_index);
+  if (it == tiles_.end()) {
+    // Make room by writing out the least recently written tiles
+    while (!lru_.empty()
+           && static_cast<int64_t>(tiles_.size() + 1) * entry_bytes()
+           > memory_limit_) {
+      if (WriteTile(lru_.back()) != SP_None) {
+        err = SP_WriteError;
+      }
+    }
+
+    it = tiles_.insert(std::make_pair(tile_index, Tile())).first;
+    it->second.pixels.assign(tile_bytes_, 0);
+    it->second.filled.assign(pixels_per_tile_, 0);
+    it->second.filled_count = 0;
+    lru_.push_front(tile_index);
+    it->second.lru_position = lru_.begin();
+  } else {
+    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+  }
+  Tile& tile = it->second;
+
+  const int64_t width = lr_x - ul_x + 1;
+  const int64_t buffer_width = buffer_lr_x - buffer_ul_x + 1;
+  for (int64_t y = ul_y; y <= lr_y; ++y) {
+    const int64_t first = (y % ptiff_->block_y_size) * ptiff_->block_x_size
+        + ul_x % ptiff_->block_x_size;
+    memcpy(&tile.pixels[first * pixel_bytes_],
+           static_cast<char*>(data)
+           + ((y - buffer_ul_y) * buffer_width + (ul_x - buffer_ul_x))
+           * pixel_bytes_,
+           width * pixel_bytes_);
+    for (int64_t i = first; i < first + width; ++i) {
+      tile.filled_count += (tile.filled[i] == 0);
+      tile.filled[i] = 1;
+    }
+  }
+
+  if (tile.filled_count == ValidPixels(tile_index)
+      && WriteTile(tile_index) != SP_None) {
+    err = SP_WriteError;
+  }
+  return err;
+}
+
+SPTW_ERROR TileCache::WriteTile(int64_t tile_index) {
+  std::unordered_map<int64_t, Tile>::iterator it = tiles_.find(tile_index);
+  const Tile& tile = it->second;
+  const int64_t tile_offset = ptiff_->tile_offsets[tile_index];
+  SPTW_ERROR err = SP_None;
+  MPI_Status status;
+
+  if (tile.filled_count == ValidPixels(tile_index)) {
+    if (MPI_File_write_at(ptiff_->fh, tile_offset,
+                          const_cast<uint8_t*>(&tile.pixels[0]),
+                          tile_bytes_, MPI_BYTE, &status) != MPI_SUCCESS) {
+      err = SP_WriteError;
+    }
+  } else {
+    // Pixels that follow each other in the tile follow each other in the
+    // file, each run of given pixels is one write
+    int64_t i = 0;
+    while (i < pixels_per_tile_) {
+      if (tile.filled[i] == 0) {
+        ++i;
+        continue;
+      }
+      int64_t end = i;
+      while (end < pixels_per_tile_ && tile.filled[end] != 0) {
+        ++end;
+      }
+      if (MPI_File_write_at(ptiff_->fh, tile_offset + i * pixel_bytes_,
+                            const_cast<uint8_t*>(&tile.pixels[i
+                                                              * pixel_bytes_]),
+                            (end - i) * pixel_bytes_, MPI_BYTE,
+                            &status) != MPI_SUCCESS) {
+        err = SP_WriteError;
+      }
+      i = end;
+    }
+  }
+
+  lru_.erase(tile.lru_position);
+  tiles_.erase(it);
+  return err;
+}
+
+SPTW_ERROR TileCache::Flush() {
+  SPTW_ERROR err = SP_None;
+  while (!lru_.empty()) {
+    if (WriteTile(lru_.back()) != SP_None) {
+      err = SP_WriteError;
+    }
+  }
+  return err;
+}
+
+void TileCache::Discard(int64_t tile_index) {
+  std::unordered_map<int64_t, Tile>::iterator it = tiles_.find(tile_index);
+  if (it != tiles_.end()) {
+    lru_.erase(it->second.lru_position);
+    tiles_.erase(it);
+  }
+}
+
 /*
  * Return size of TIFFDataType in bytes
  */
@@ -155,113 +349,318 @@ int64_t read_int64(PTIFF *tiff_file, int64_t offset, bool big_endian) {
   return parse_int64(read_buffer, big_endian);
 }
 
-int write_int64(PTIFF *tiff_file,
-                int64_t offset,
-                int64_t value,
-                bool big_endian) {
-  uint8_t buffer[8];
-  export_int64(value, buffer, big_endian);
-  MPI_File_write_at(tiff_file->fh,
-                    offset, buffer,
-                    sizeof(int64_t),
-                    MPI_BYTE,
-                    MPI_STATUS_IGNORE);
-  return 0;
-}
+/*
+ * An entry of a BigTIFF directory
+ */
+struct DirectoryEntry {
+  int tag;
+  int type;
+  int64_t count;
+  /* Offset of the values, in the entry itself if they fit */
+  int64_t values_offset;
+};
 
-SPTW_ERROR populate_tile_offsets(PTIFF *tiff_file, int64_t tile_size) {
-  bool big_endian = false;   // Is tiff file big endian?
+/*
+ * Reads the first directory of a BigTIFF, all of its entries with a single
+ * read. Returns false if the file isn't a BigTIFF.
+ */
+bool read_directory(PTIFF *tiff_file,
+                    bool *big_endian,
+                    std::vector<DirectoryEntry> *entries) {
+  // Byte order, version, offset size and offset to the first directory
+  uint8_t header[16];
+  MPI_File_read_at(tiff_file->fh, 0, header, 16, MPI_BYTE, MPI_STATUS_IGNORE);
+  *big_endian = (header[0] == 0x4d);
+
+  // Check that we are dealing with a BigTIFF, version 0x002b
+  if (parse_int16(header + 2, *big_endian) != 0x002B) {
+    return false;
+  }
 
-  // Read endianess of file
-  uint8_t endian_flag[2] = { 0x49, 0x49 };
-  MPI_File_read_at(tiff_file->fh, 0, endian_flag, 2, MPI_BYTE, MPI_STATUS_IGNORE);
-  if (endian_flag[0] == 0x4d) {
-    big_endian = true;
+  // The directory starts with the number of entries, 20 bytes each
+  const int64_t doffset = parse_int64(header + 8, *big_endian);
+  const int64_t entry_count = read_int64(tiff_file, doffset, *big_endian);
+  const int64_t entry_offset = doffset + sizeof(int64_t);
+  if (entry_count <= 0 || entry_count * 20 > INT_MAX) {
+    return false;
   }
 
-  // Check tiff version, should be 0x002b for BigTiff
-  uint8_t version_data[2];
-  int16_t version = 0;
-  MPI_File_read_at(tiff_file->fh, 2, version_data, 2, MPI_BYTE, MPI_STATUS_IGNORE);
+  std::vector<uint8_t> directory(entry_count * 20);
+  MPI_File_read_at(tiff_file->fh, entry_offset, &directory[0],
+                   directory.size(), MPI_BYTE, MPI_STATUS_IGNORE);
+
+  entries->resize(entry_count);
+  for (int64_t i = 0; i < entry_count; ++i) {
+    uint8_t *entry = &directory[i * 20];
+    DirectoryEntry& e = (*entries)[i];
+    e.tag = static_cast<uint16_t>(parse_int16(entry, *big_endian));
+    e.type = static_cast<uint16_t>(parse_int16(entry + 2, *big_endian));
+    e.count = parse_int64(entry + 4, *big_endian);
+    if (e.count * get_type_size(static_cast<TIFFDataType>(e.type)) <= 8) {
+      e.values_offset = entry_offset + i * 20 + 12;
+    } else {
+      e.values_offset = parse_int64(entry + 12, *big_endian);
+    }
+  }
+  return true;
+}
 
-  version = parse_int16(version_data, big_endian);
+/*
+ * Finds the entry of tag in entries. Returns false if it isn't there.
+ */
+bool find_directory_entry(const std::vector<DirectoryEntry>& entries,
+                          int tag,
+                          DirectoryEntry *entry) {
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].tag == tag) {
+      *entry = entries[i];
+      return true;
+    }
+  }
+  return false;
+}
 
-  // Check that we are dealing with a BigTIFF
-  if (version != 0x002B) {
+/*
+ * Writes values, as unsigned integers of the type of entry, over the values
+ * of entry with a single write
+ */
+SPTW_ERROR write_directory_array(PTIFF *tiff_file,
+                                 const DirectoryEntry& entry,
+                                 const std::vector<int64_t>& values,
+                                 bool big_endian) {
+  const int64_t size = get_type_size(static_cast<TIFFDataType>(entry.type));
+  if (size == 0
+      || static_cast<int64_t>(values.size()) != entry.count
+      || entry.count * size > INT_MAX) {
     return SP_BadArg;
   }
+  if (values.empty()) {
+    return SP_None;
+  }
 
-  // Read offset to first directory
-  int64_t doffset = 0;
-  doffset = read_int64(tiff_file, 8, big_endian);
+  // The low order bytes come last in a big endian number
+  std::vector<uint8_t> buffer(values.size() * size);
+  uint8_t value_bytes[8];
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (size < 8 && (values[i] >> (8 * size)) != 0) {
+      return SP_BadArg;
+    }
+    export_int64(values[i], value_bytes, big_endian);
+    memcpy(&buffer[i * size], value_bytes + (big_endian ? 8 - size : 0),
+           size);
+  }
 
-  // Read number of directory entries
-  int64_t entry_count = read_int64(tiff_file, doffset, big_endian);
+  if (MPI_File_write_at(tiff_file->fh,
+                        entry.values_offset,
+                        &buffer[0],
+                        buffer.size(),
+                        MPI_BYTE,
+                        MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+    return SP_WriteError;
+  }
+  return SP_None;
+}
 
-  // directory offset + sizeof directory count
-  int64_t entry_offset = doffset + sizeof(int64_t);
+SPTW_ERROR populate_tile_offsets(PTIFF *tiff_file,
+                                 int64_t tile_size,
+                                 const std::vector<bool> *sparse_tiles) {
+  bool big_endian = false;
+  std::vector<DirectoryEntry> entries;
+  DirectoryEntry offsets_entry, counts_entry;
+
+  if (!read_directory(tiff_file, &big_endian, &entries)
+      || !find_directory_entry(entries, TIFFTAG_TILEOFFSETS, &offsets_entry)
+      || !find_directory_entry(entries, TIFFTAG_TILEBYTECOUNTS,
+                               &counts_entry)
+      || offsets_entry.count != counts_entry.count) {
+    return SP_BadArg;
+  }
 
-  int64_t tile_count = 0;
+  // Store the first tile at the end of the file
+  // instead of trusting GDAL to place it.
+  //
+  // The offset appears to be miscalculated when using the
+  // SPARSE_OK GDAL option and data was being corrupted if
+  // there were too many tags present in the TIFF file.
+  MPI_Offset first_tile_offset;
+  MPI_File_get_size(tiff_file->fh, &first_tile_offset);
+
+  // Only the tiles that aren't sparse take up space in the file, the others
+  // keep an offset and byte count of 0
   const int64_t tile_size_bytes = tile_size * tile_size * tiff_file->band_count
       * tiff_file->band_type_size;
-  int64_t first_tile_offset = 0;
+  std::vector<int64_t> offsets(offsets_entry.count, 0);
+  std::vector<int64_t> byte_counts(counts_entry.count, 0);
+  int64_t tile_count = 0;
+  for (int64_t j = 0; j < offsets_entry.count; ++j) {
+    if (sparse_tiles != NULL && (*sparse_tiles)[j]) {
+      continue;
+    }
+    offsets[j] = first_tile_offset + tile_size_bytes * tile_count;
+    byte_counts[j] = tile_size_bytes;
+    ++tile_count;
+  }
 
-  for (int64_t i = 0; i < entry_count; ++i) {
-    // Read identifying tag of directory entry
-    uint8_t tag_buffer[2];
-    MPI_File_read_at(tiff_file->fh,
-                     entry_offset,
-                     tag_buffer,
-                     2,
-                     MPI_BYTE,
-                     MPI_STATUS_IGNORE);
-    int16_t entry_tag = parse_int16(tag_buffer, big_endian);
-
-    // Read count of elements in entry
-    int64_t element_count = read_int64(tiff_file, entry_offset+4, big_endian);
-
-    // Read entry data
-    int64_t entry_data = read_int64(tiff_file, entry_offset+12, big_endian);
-
-    // Check if directory type is TIFFTAG_TILEOFFSETS
-    if (entry_tag == TIFFTAG_TILEOFFSETS) {
-      // Store the first tile at the end of the file
-      // instead of trusting GDAL to place it.
-      //
-      // The offset appears to be miscalculated when using the
-      // SPARSE_OK GDAL option and data was being corrupted if
-      // there were too many tags present in the TIFF file.
-      MPI_Offset first_offset;
-      MPI_File_get_size(tiff_file->fh, &first_offset);
-
-      first_tile_offset = first_offset;
-      tile_count = element_count;
-
-      for (int64_t j = 0; j < element_count; ++j) {
-        write_int64(tiff_file,
-            entry_data+(sizeof(int64_t)*j),
-            first_offset+(tile_size_bytes*j),
-            big_endian);
-      }
-    } else if (entry_tag == TIFFTAG_TILEBYTECOUNTS) {
-      for (int64_t j = 0; j < element_count; ++j) {
-        write_int64(tiff_file,
-                    entry_data+(sizeof(int64_t)*j),
-                    tile_size_bytes,
-                    big_endian);
+  // Each array is written with one call
+  SPTW_ERROR err = write_directory_array(tiff_file, offsets_entry, offsets,
+                                         big_endian);
+  if (err == SP_None) {
+    err = write_directory_array(tiff_file, counts_entry, byte_counts,
+                                big_endian);
+  }
+  if (err != SP_None) {
+    return err;
+  }
+
+  // Calculate end of file and write to it
+  if (tile_count > 0) {
+    uint8_t buffer = 0;
+    int64_t file_size = (tile_count * tile_size_bytes) + first_tile_offset;
+    MPI_File_write_at(tiff_file->fh, file_size-1, &buffer, 1, MPI_BYTE,
+                      MPI_STATUS_IGNORE);
+  }
+
+  return SP_None;
+}
+
+SPTW_ERROR leave_out_tiles_all(PTIFF *ptiff,
+                               const std::vector<bool>& sparse_tiles) {
+  const int64_t tile_count = ptiff->tiles_across * ptiff->tiles_down;
+  if (ptiff->compression != SP_NoCompression
+      || ptiff->tile_offsets == NULL
+      || ptiff->tile_offsets[0] <= 0
+      || static_cast<int64_t>(sparse_tiles.size()) != tile_count) {
+    return SP_BadArg;
+  }
+
+  // Every process moves the tiles that are kept down over those left out,
+  // in the same way, so their offsets need not be read back
+  const int64_t tile_bytes = ptiff->block_x_size * ptiff->block_y_size
+      * ptiff->band_count * ptiff->band_type_size;
+  std::vector<int64_t> offsets(tile_count, 0);
+  std::vector<int64_t> byte_counts(tile_count, 0);
+  int64_t end = ptiff->tile_offsets[0];
+  for (int64_t i = 0; i < tile_count; ++i) {
+    if (!sparse_tiles[i]) {
+      offsets[i] = end;
+      byte_counts[i] = tile_bytes;
+      end += tile_bytes;
+    }
+    ptiff->tile_offsets[i] = offsets[i];
+  }
+
+  int rank = 0;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  int err = SP_None;
+  if (rank == 0) {
+    bool big_endian = false;
+    std::vector<DirectoryEntry> entries;
+    DirectoryEntry offsets_entry, counts_entry;
+    if (!read_directory(ptiff, &big_endian, &entries)
+        || !find_directory_entry(entries, TIFFTAG_TILEOFFSETS, &offsets_entry)
+        || !find_directory_entry(entries, TIFFTAG_TILEBYTECOUNTS,
+                                 &counts_entry)) {
+      err = SP_BadArg;
+    } else {
+      err = write_directory_array(ptiff, offsets_entry, offsets, big_endian);
+      if (err == SP_None) {
+        err = write_directory_array(ptiff, counts_entry, byte_counts,
+                                    big_endian);
       }
     }
-    entry_offset += 20;
+  }
+  MPI_Bcast(&err, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (err != SP_None) {
+    return static_cast<SPTW_ERROR>(err);
   }
 
-  // Calculate end of file and write to it
-  uint8_t buffer = 0;
-  int64_t file_size = (tile_count * tile_size_bytes) + first_tile_offset;
-  MPI_File_write_at(tiff_file->fh, file_size-1, &buffer, 1, MPI_BYTE, MPI_STATUS_IGNORE);
+  // Give back the space preallocated for the tiles left out
+  if (MPI_File_set_size(ptiff->fh, end) != MPI_SUCCESS) {
+    return SP_WriteError;
+  }
+  return SP_None;
+}
 
+SPTW_ERROR set_tile_compression(PTIFF *ptiff, SPTW_COMPRESSION compression) {
+  bool big_endian = false;
+  std::vector<DirectoryEntry> entries;
+  DirectoryEntry entry;
+
+  if (!compression_available(compression)
+      || !read_directory(ptiff, &big_endian, &entries)
+      || !find_directory_entry(entries, TIFFTAG_COMPRESSION, &entry)) {
+    return SP_BadArg;
+  }
+  const SPTW_ERROR err = write_directory_array(
+      ptiff, entry, std::vector<int64_t>(1, compression), big_endian);
+  if (err != SP_None) {
+    return err;
+  }
+
+  ptiff->compression = compression;
   return SP_None;
 }
 
+/*
+ * Gathers the tiles written by write_compressed_tiles_all on the first
+ * process, which writes their offsets and byte counts
+ */
+SPTW_ERROR write_compressed_offsets(PTIFF *ptiff) {
+  int rank = 0, process_count = 1;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &process_count);
+
+  int local_count = ptiff->compressed_tiles.size();
+  std::vector<int> counts(process_count), displacements(process_count);
+  MPI_Gather(&local_count, 1, MPI_INT, &counts[0], 1, MPI_INT, 0,
+             MPI_COMM_WORLD);
+  int total = 0;
+  for (int i = 0; i < process_count; ++i) {
+    displacements[i] = total;
+    total += counts[i];
+  }
+
+  std::vector<int64_t> tiles(std::max(total, 1));
+  MPI_Gatherv(ptiff->compressed_tiles.empty() ? NULL
+              : &ptiff->compressed_tiles[0],
+              local_count, MPI_INT64_T, &tiles[0], &counts[0],
+              &displacements[0], MPI_INT64_T, 0, MPI_COMM_WORLD);
+  if (rank != 0) {
+    return SP_None;
+  }
+
+  bool big_endian = false;
+  std::vector<DirectoryEntry> entries;
+  DirectoryEntry offsets_entry, counts_entry;
+  if (!read_directory(ptiff, &big_endian, &entries)
+      || !find_directory_entry(entries, TIFFTAG_TILEOFFSETS, &offsets_entry)
+      || !find_directory_entry(entries, TIFFTAG_TILEBYTECOUNTS,
+                               &counts_entry)
+      || offsets_entry.count != counts_entry.count) {
+    return SP_BadArg;
+  }
+
+  // Tiles no process wrote keep an offset and byte count of 0
+  std::vector<int64_t> offsets(offsets_entry.count, 0);
+  std::vector<int64_t> byte_counts(counts_entry.count, 0);
+  for (int i = 0; i < total; i += 3) {
+    const int64_t index = tiles[i];
+    if (index < 0 || index >= offsets_entry.count) {
+      return SP_BadArg;
+    }
+    offsets[index] = tiles[i + 1];
+    byte_counts[index] = tiles[i + 2];
+  }
+
+  SPTW_ERROR err = write_directory_array(ptiff, offsets_entry, offsets,
+                                         big_endian);
+  if (err == SP_None) {
+    err = write_directory_array(ptiff, counts_entry, byte_counts,
+                                big_endian);
+  }
+  return err;
+}
+
 SPTW_ERROR create_raster(string filename,
                          int64_t x_size,
                          int64_t y_size,
@@ -364,18 +763,371 @@ SPTW_ERROR create_tiled_raster(string filename,
   return SP_None;
 }
 
-PTIFF* open_raster(string filename) {
-  PTIFF *ptiff = new PTIFF();
-  char *c_filename = strdup(filename.c_str());
+/*
+ * Tags of the GeoTIFF specification and GDAL, which libtiff doesn't define
+ */
+const int kModelPixelScaleTag = 33550;
+const int kModelTiepointTag = 33922;
+const int kGeoKeyDirectoryTag = 34735;
+const int kGeoAsciiParamsTag = 34737;
+const int kGdalNoDataTag = 42113;
+
+/*
+ * An entry of a directory written by create_tiled_bigtiff, with its values
+ * in little endian byte order
+ */
+struct NativeTag {
+  int tag;
+  int type;
+  int64_t count;
+  std::vector<uint8_t> values;
+};
+
+bool compare_tags(const NativeTag& a, const NativeTag& b) {
+  return a.tag < b.tag;
+}
+
+/*
+ * Appends a tag of unsigned integers, or of doubles given by their bits
+ */
+void add_tag(std::vector<NativeTag> *tags,
+             int tag,
+             int type,
+             const std::vector<int64_t>& values) {
+  const int size = get_type_size(static_cast<TIFFDataType>(type));
+  NativeTag t;
+  t.tag = tag;
+  t.type = type;
+  t.count = values.size();
+  t.values.resize(values.size() * size);
+
+  uint8_t value_bytes[8];
+  for (size_t i = 0; i < values.size(); ++i) {
+    export_int64(values[i], value_bytes, false);
+    memcpy(&t.values[i * size], value_bytes, size);
+  }
+  tags->push_back(t);
+}
+
+void add_double_tag(std::vector<NativeTag> *tags,
+                    int tag,
+                    const std::vector<double>& values) {
+  std::vector<int64_t> bits(values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    memcpy(&bits[i], &values[i], sizeof(double));
+  }
+  add_tag(tags, tag, TIFF_DOUBLE, bits);
+}
+
+void add_ascii_tag(std::vector<NativeTag> *tags,
+                   int tag,
+                   const string& text) {
+  NativeTag t;
+  t.tag = tag;
+  t.type = TIFF_ASCII;
+  t.count = text.size() + 1;
+  t.values.assign(text.begin(), text.end());
+  t.values.push_back(0);
+  tags->push_back(t);
+}
+
+/*
+ * Builds the GeoKeyDirectory and GeoAsciiParams of projection_srs. A
+ * coordinate system with an EPSG code is stored as the code, any other as
+ * ESRI WKT in the citation, which GDAL reads back.
+ */
+bool build_geo_keys(string projection_srs,
+                    std::vector<int64_t> *keys,
+                    string *ascii_params) {
+  OGRSpatialReference srs;
+  if (srs.SetFromUserInput(projection_srs.c_str()) != OGRERR_NONE) {
+    return false;
+  }
+
+  const bool projected = srs.IsProjected();
+  const char *node = projected ? "PROJCS" : "GEOGCS";
+  if (srs.GetAuthorityCode(node) == NULL) {
+    srs.AutoIdentifyEPSG();
+  }
+  const char *authority = srs.GetAuthorityName(node);
+  const char *code = srs.GetAuthorityCode(node);
+
+  // Version 1.1.0 and the number of keys, then each key's ID, location,
+  // count and value, sorted by ID. Pixels are areas, as GDAL defaults to.
+  const int64_t header[] = {1, 1, 0, 0};
+  const int64_t model_keys[] = {1024, 0, 1, projected ? 1 : 2,
+                                1025, 0, 1, 1};
+  const int64_t type_key = projected ? 3072 : 2048;
+  keys->assign(header, header + 4);
+  keys->insert(keys->end(), model_keys, model_keys + 8);
+  ascii_params->clear();
+
+  if (authority != NULL && code != NULL && EQUAL(authority, "EPSG")) {
+    const int64_t type_keys[] = {type_key, 0, 1, atoi(code)};
+    keys->insert(keys->end(), type_keys, type_keys + 4);
+  } else {
+    OGRSpatialReference *esri_srs = srs.Clone();
+    char *wkt = NULL;
+    esri_srs->morphToESRI();
+    esri_srs->exportToWkt(&wkt);
+    *ascii_params = string("ESRI PE String = ") + wkt + "|";
+    CPLFree(wkt);
+    OGRSpatialReference::DestroySpatialReference(esri_srs);
+
+    // GTCitationGeoKey holds the WKT and the coordinate system is user
+    // defined
+    const int64_t citation_keys[] = {
+      1026, kGeoAsciiParamsTag, static_cast<int64_t>(ascii_params->size()), 0,
+      type_key, 0, 1, 32767};
+    keys->insert(keys->end(), citation_keys, citation_keys + 8);
+  }
+
+  (*keys)[3] = (keys->size() - 4) / 4;
+  return true;
+}
+
+SPTW_ERROR create_tiled_bigtiff(string filename,
+                                int64_t x_size,
+                                int64_t y_size,
+                                int band_count,
+                                GDALDataType band_type,
+                                double *geotransform,
+                                string projection_srs,
+                                int64_t tile_size,
+                                const double *no_data_value,
+                                GDALColorTable *color_table,
+                                SPTW_COMPRESSION compression) {
+  int sample_format = 0;
+  switch (band_type) {
+    case GDT_Byte:
+    case GDT_UInt16:
+    case GDT_UInt32:
+      sample_format = SAMPLEFORMAT_UINT;
+      break;
+    case GDT_Int16:
+    case GDT_Int32:
+      sample_format = SAMPLEFORMAT_INT;
+      break;
+    case GDT_Float32:
+    case GDT_Float64:
+      sample_format = SAMPLEFORMAT_IEEEFP;
+      break;
+    default:
+      break;
+  }
+
+  // Only north up rasters, tiles of a multiple of 16 pixels, as TIFF
+  // requires
+  if (sample_format == 0
+      || x_size <= 0 || x_size > UINT32_MAX
+      || y_size <= 0 || y_size > UINT32_MAX
+      || band_count <= 0 || band_count > UINT16_MAX
+      || tile_size <= 0 || tile_size % 16 != 0
+      || geotransform[2] != 0.0 || geotransform[4] != 0.0
+      || !compression_available(compression)) {
+    return SP_BadArg;
+  }
 
+  std::vector<int64_t> geo_keys;
+  string geo_ascii_params;
+  if (!build_geo_keys(projection_srs, &geo_keys, &geo_ascii_params)) {
+    return SP_BadArg;
+  }
+
+  const int bits = GDALGetDataTypeSize(band_type);
+  const int64_t tiles_across = (x_size + tile_size - 1) / tile_size;
+  const int64_t tiles_down = (y_size + tile_size - 1) / tile_size;
+  const int64_t tile_count = tiles_across * tiles_down;
+  const int64_t tile_bytes = tile_size * tile_size * band_count * bits / 8;
+  const bool palette = color_table != NULL && band_count == 1
+      && (band_type == GDT_Byte || band_type == GDT_UInt16);
+
+  // The same tags GDAL writes for a tiled, pixel interleaved BigTIFF
+  int photometric = PHOTOMETRIC_MINISBLACK;
+  int color_samples = 1;
+  if (palette) {
+    photometric = PHOTOMETRIC_PALETTE;
+  } else if (band_count >= 3 && band_type == GDT_Byte) {
+    photometric = PHOTOMETRIC_RGB;
+    color_samples = 3;
+  }
+
+  std::vector<NativeTag> tags;
+  add_tag(&tags, TIFFTAG_IMAGEWIDTH, TIFF_LONG,
+          std::vector<int64_t>(1, x_size));
+  add_tag(&tags, TIFFTAG_IMAGELENGTH, TIFF_LONG,
+          std::vector<int64_t>(1, y_size));
+  add_tag(&tags, TIFFTAG_BITSPERSAMPLE, TIFF_SHORT,
+          std::vector<int64_t>(band_count, bits));
+  add_tag(&tags, TIFFTAG_COMPRESSION, TIFF_SHORT,
+          std::vector<int64_t>(1, compression));
+  add_tag(&tags, TIFFTAG_PHOTOMETRIC, TIFF_SHORT,
+          std::vector<int64_t>(1, photometric));
+  add_tag(&tags, TIFFTAG_SAMPLESPERPIXEL, TIFF_SHORT,
+          std::vector<int64_t>(1, band_count));
+  add_tag(&tags, TIFFTAG_PLANARCONFIG, TIFF_SHORT,
+          std::vector<int64_t>(1, PLANARCONFIG_CONTIG));
+  add_tag(&tags, TIFFTAG_TILEWIDTH, TIFF_LONG,
+          std::vector<int64_t>(1, tile_size));
+  add_tag(&tags, TIFFTAG_TILELENGTH, TIFF_LONG,
+          std::vector<int64_t>(1, tile_size));
+  add_tag(&tags, TIFFTAG_TILEOFFSETS, TIFF_LONG8,
+          std::vector<int64_t>(tile_count, 0));
+  add_tag(&tags, TIFFTAG_TILEBYTECOUNTS, TIFF_LONG8,
+          std::vector<int64_t>(tile_count, 0));
+  if (band_count > color_samples) {
+    add_tag(&tags, TIFFTAG_EXTRASAMPLES, TIFF_SHORT,
+            std::vector<int64_t>(band_count - color_samples,
+                                 EXTRASAMPLE_UNSPECIFIED));
+  }
+  add_tag(&tags, TIFFTAG_SAMPLEFORMAT, TIFF_SHORT,
+          std::vector<int64_t>(band_count, sample_format));
+
+  // All reds, then all greens, then all blues, scaled to 16 bits
+  if (palette) {
+    const int64_t color_count = 1 << bits;
+    std::vector<int64_t> color_map(3 * color_count, 0);
+    for (int64_t i = 0;
+         i < std::min<int64_t>(color_count, color_table->GetColorEntryCount());
+         ++i) {
+      const GDALColorEntry *entry = color_table->GetColorEntry(i);
+      color_map[i] = entry->c1 * 257;
+      color_map[color_count + i] = entry->c2 * 257;
+      color_map[2 * color_count + i] = entry->c3 * 257;
+    }
+    add_tag(&tags, TIFFTAG_COLORMAP, TIFF_SHORT, color_map);
+  }
+
+  const double pixel_scale[] = {geotransform[1], -geotransform[5], 0.0};
+  const double tiepoint[] = {0.0, 0.0, 0.0,
+                             geotransform[0], geotransform[3], 0.0};
+  add_double_tag(&tags, kModelPixelScaleTag,
+                 std::vector<double>(pixel_scale, pixel_scale + 3));
+  add_double_tag(&tags, kModelTiepointTag,
+                 std::vector<double>(tiepoint, tiepoint + 6));
+  add_tag(&tags, kGeoKeyDirectoryTag, TIFF_SHORT, geo_keys);
+  if (!geo_ascii_params.empty()) {
+    add_ascii_tag(&tags, kGeoAsciiParamsTag, geo_ascii_params);
+  }
+  if (no_data_value != NULL) {
+    char no_data[64];
+    snprintf(no_data, sizeof(no_data), "%.18g", *no_data_value);
+    add_ascii_tag(&tags, kGdalNoDataTag, no_data);
+  }
+  std::sort(tags.begin(), tags.end(), compare_tags);
+
+  // The directory follows the header, then the values that don't fit in
+  // their entries, each on an 8 byte boundary. The tiles start on a page
+  // boundary, one after the other in the order of the file.
+  const int64_t directory_offset = 16;
+  std::vector<int64_t> values_offsets(tags.size(), 0);
+  int64_t end = directory_offset + 8 + tags.size() * 20 + 8;
+  for (size_t i = 0; i < tags.size(); ++i) {
+    if (tags[i].values.size() > 8) {
+      values_offsets[i] = (end + 7) / 8 * 8;
+      end = values_offsets[i] + tags[i].values.size();
+    }
+  }
+  const int64_t first_tile_offset = (end + 4095) / 4096 * 4096;
+
+  // Compressed tiles are placed as they are written
+  std::vector<int64_t> offsets(tile_count, 0);
+  std::vector<int64_t> byte_counts(tile_count, 0);
+  int64_t file_size = first_tile_offset;
+  if (compression == SP_NoCompression) {
+    for (int64_t i = 0; i < tile_count; ++i) {
+      offsets[i] = file_size;
+      byte_counts[i] = tile_bytes;
+      file_size += tile_bytes;
+    }
+  }
+  for (size_t i = 0; i < tags.size(); ++i) {
+    std::vector<NativeTag> array;
+    if (tags[i].tag == TIFFTAG_TILEOFFSETS) {
+      add_tag(&array, tags[i].tag, tags[i].type, offsets);
+    } else if (tags[i].tag == TIFFTAG_TILEBYTECOUNTS) {
+      add_tag(&array, tags[i].tag, tags[i].type, byte_counts);
+    } else {
+      continue;
+    }
+    tags[i].values.swap(array[0].values);
+  }
+
+  // Little endian BigTIFF: byte order, version 43, offset size 8, then the
+  // offset to the only directory
+  std::vector<uint8_t> header(first_tile_offset, 0);
+  const uint8_t signature[] = {'I', 'I', 43, 0, 8, 0, 0, 0};
+  memcpy(&header[0], signature, sizeof(signature));
+  export_int64(directory_offset, &header[8], false);
+  export_int64(tags.size(), &header[directory_offset], false);
+  for (size_t i = 0; i < tags.size(); ++i) {
+    uint8_t *entry = &header[directory_offset + 8 + i * 20];
+    uint8_t value_bytes[8];
+    export_int64(tags[i].tag, value_bytes, false);
+    memcpy(entry, value_bytes, 2);
+    export_int64(tags[i].type, value_bytes, false);
+    memcpy(entry + 2, value_bytes, 2);
+    export_int64(tags[i].count, entry + 4, false);
+    if (tags[i].values.size() > 8) {
+      export_int64(values_offsets[i], entry + 12, false);
+      memcpy(&header[values_offsets[i]], &tags[i].values[0],
+             tags[i].values.size());
+    } else {
+      memcpy(entry + 12, &tags[i].values[0], tags[i].values.size());
+    }
+  }
+
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "Couldn't create %s\n", filename.c_str());
+    return SP_CreateError;
+  }
+
+  SPTW_ERROR err = SP_None;
+  size_t written = 0;
+  while (written < header.size()) {
+    const ssize_t count = pwrite(fd, &header[written],
+                                 header.size() - written, written);
+    if (count <= 0) {
+      err = SP_WriteError;
+      break;
+    }
+    written += count;
+  }
+
+  // Reserve the blocks of the tiles up front, so that writes to them don't
+  // allocate. Not every file system can, the file is then only extended.
+  if (err == SP_None && file_size > first_tile_offset) {
+    int rc = -1;
+#ifdef __linux__
+    rc = fallocate(fd, 0, 0, file_size);
+#endif
+    if (rc != 0) {
+      rc = ftruncate(fd, file_size);
+    }
+    if (rc != 0) {
+      err = SP_WriteError;
+    }
+  }
+
+  if (close(fd) != 0) {
+    err = SP_WriteError;
+  }
+  return err;
+}
+
+/*
+ * Reads the size, layout, tile offsets and compression of a raster into
+ * ptiff with GDAL and libtiff. Returns false if the file can't be read.
+ */
+bool read_raster_header(const string& filename, PTIFF *ptiff) {
   GDALAllRegister();
 
   GDALDataset *ds = static_cast<GDALDataset*>(GDALOpen(filename.c_str(),
                                                        GA_ReadOnly));
 
   if (ds == NULL) {
-    free(c_filename);
-    return NULL;
+    return false;
   }
 
   ptiff->x_size = ds->GetRasterXSize();
@@ -389,12 +1141,11 @@ PTIFF* open_raster(string filename) {
 
   GDALClose(ds);
 
-  TIFF *tiffds = TIFFOpen(c_filename, "r");
-  free(c_filename);
+  TIFF *tiffds = TIFFOpen(filename.c_str(), "r");
 
   if (tiffds == NULL) {
     fprintf(stderr, "Couldn't open tiff file\n");
-    return NULL;
+    return false;
   }
 
   // Attempt to read TileWidth tag. If not found we assume file to have strips
@@ -415,10 +1166,6 @@ PTIFF* open_raster(string filename) {
                          + ptiff->block_y_size - 1) / ptiff->block_y_size;
     tiles_per_image = ptiff->tiles_across * ptiff->tiles_down;
     ptiff->tile_offsets = new int64_t[tiles_per_image];
-    if (ptiff->tile_offsets == NULL) {
-      //  Allocation Fail!
-      return NULL;
-    }
     ret = TIFFGetField(tiffds, TIFFTAG_TILEOFFSETS, &tiff_offsets);
     memcpy(ptiff->tile_offsets,
            tiff_offsets,
@@ -427,7 +1174,8 @@ PTIFF* open_raster(string filename) {
     ret = TIFFGetField(tiffds, TIFFTAG_STRIPOFFSETS, &offset);
     if (ret != 1) {
       fprintf(stderr, "Error reading strip offsets!\n");
-      return NULL;
+      TIFFClose(tiffds);
+      return false;
     }
     ptiff->first_strip_offset = *offset;
     ptiff->tiles_across = 1;
@@ -437,9 +1185,69 @@ PTIFF* open_raster(string filename) {
 
   ptiff->first_strip_offset = *offset;
 
+  uint16_t compression = COMPRESSION_NONE;
+  TIFFGetField(tiffds, TIFFTAG_COMPRESSION, &compression);
+  ptiff->compression = compression;
+
   TIFFClose(tiffds);
+  return true;
+}
+
+PTIFF* open_raster(string filename) {
+  PTIFF *ptiff = new PTIFF();
+  int rank = 0;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  // Only the first process opens the file with GDAL and libtiff, the others
+  // receive what it read
+  const int header_size = 12;
+  int64_t header[header_size] = { 0 };
+  if (rank == 0 && read_raster_header(filename, ptiff)) {
+    header[0] = 1;
+    header[1] = ptiff->x_size;
+    header[2] = ptiff->y_size;
+    header[3] = ptiff->band_count;
+    header[4] = ptiff->band_type;
+    header[5] = ptiff->band_type_size;
+    header[6] = ptiff->first_strip_offset;
+    header[7] = ptiff->block_x_size;
+    header[8] = ptiff->block_y_size;
+    header[9] = ptiff->tiles_across;
+    header[10] = ptiff->tiles_down;
+    header[11] = ptiff->compression;
+  }
+  MPI_Bcast(header, header_size, MPI_INT64_T, 0, MPI_COMM_WORLD);
+  if (header[0] == 0) {
+    delete[] ptiff->tile_offsets;
+    delete ptiff;
+    return NULL;
+  }
+
+  ptiff->x_size = header[1];
+  ptiff->y_size = header[2];
+  ptiff->band_count = header[3];
+  ptiff->band_type = static_cast<GDALDataType>(header[4]);
+  ptiff->band_type_size = header[5];
+  ptiff->first_strip_offset = header[6];
+  ptiff->block_x_size = header[7];
+  ptiff->block_y_size = header[8];
+  ptiff->tiles_across = header[9];
+  ptiff->tiles_down = header[10];
+  ptiff->compression = header[11];
+
+  // Striped files have no tile offsets
+  int tiled = (ptiff->tile_offsets != NULL) ? 1 : 0;
+  MPI_Bcast(&tiled, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (tiled) {
+    const int64_t tile_count = ptiff->tiles_across * ptiff->tiles_down;
+    if (rank != 0) {
+      ptiff->tile_offsets = new int64_t[tile_count];
+    }
+    MPI_Bcast(ptiff->tile_offsets, tile_count, MPI_INT64_T, 0,
+              MPI_COMM_WORLD);
+  }
 
-  c_filename = strdup(filename.c_str());
+  char *c_filename = strdup(filename.c_str());
   int rc = MPI_File_open(MPI_COMM_WORLD,
                          c_filename,
                          MPI_MODE_RDWR,
@@ -470,9 +1278,242 @@ PTIFF* open_raster(string filename) {
 }
 
 SPTW_ERROR close_raster(PTIFF *ptiff) {
+  SPTW_ERROR err = flush_tile_cache(ptiff);
+  if (ptiff->compressed_end != 0
+      && write_compressed_offsets(ptiff) != SP_None) {
+    err = SP_WriteError;
+  }
+  delete ptiff->tile_cache;
   MPI_File_close(&(ptiff->fh));
   delete ptiff;
-  return SP_None;
+  return err;
+}
+
+SPTW_ERROR set_tile_cache(PTIFF *ptiff, int64_t memory_limit) {
+  const SPTW_ERROR err = flush_tile_cache(ptiff);
+  delete ptiff->tile_cache;
+  ptiff->tile_cache = NULL;
+
+  if (memory_limit == 0) {
+    return err;
+  }
+  if (ptiff->tile_offsets == NULL) {
+    return SP_BadArg;
+  }
+
+  ptiff->tile_cache = new TileCache(ptiff, memory_limit);
+  if (ptiff->tile_cache->entry_bytes() > memory_limit) {
+    // Not even one tile fits
+    delete ptiff->tile_cache;
+    ptiff->tile_cache = NULL;
+    return SP_BadArg;
+  }
+  return err;
+}
+
+SPTW_ERROR flush_tile_cache(PTIFF *ptiff) {
+  if (ptiff->tile_cache == NULL) {
+    return SP_None;
+  }
+  return ptiff->tile_cache->Flush();
+}
+
+/*
+ * Compresses size bytes of data with the LZW variant of the TIFF
+ * specification, the way libtiff does: codes start at 9 bits and grow one
+ * code early, and the table is cleared when it is full.
+ */
+void lzw_encode(const uint8_t *data,
+                int64_t size,
+                std::vector<uint8_t> *compressed) {
+  const int kClear = 256;
+  const int kEndOfInformation = 257;
+  const int kFirstCode = 258;
+  const int kLastCode = 4095;
+  // A prime a bit larger than twice the number of codes
+  const int kHashSize = 9001;
+
+  std::vector<int32_t> hash_keys(kHashSize, -1);
+  std::vector<uint16_t> hash_codes(kHashSize, 0);
+  uint32_t bits = 0;
+  int bit_count = 0;
+  int code_width = 9;
+  int max_code = 511;
+  int next_code = kFirstCode;
+
+  compressed->clear();
+  auto put_code = [&](int code) {
+    bits = (bits << code_width) | code;
+    bit_count += code_width;
+    while (bit_count >= 8) {
+      compressed->push_back(bits >> (bit_count - 8));
+      bit_count -= 8;
+    }
+    bits &= (1u << bit_count) - 1;
+  };
+  auto clear_table = [&]() {
+    put_code(kClear);
+    std::fill(hash_keys.begin(), hash_keys.end(), -1);
+    code_width = 9;
+    max_code = 511;
+    next_code = kFirstCode;
+  };
+
+  put_code(kClear);
+  if (size > 0) {
+    int prefix = data[0];
+    for (int64_t i = 1; i < size; ++i) {
+      const int key = (data[i] << 12) | prefix;
+      int slot = key % kHashSize;
+      while (hash_keys[slot] != -1 && hash_keys[slot] != key) {
+        slot = (slot + 1) % kHashSize;
+      }
+      if (hash_keys[slot] == key) {
+        prefix = hash_codes[slot];
+        continue;
+      }
+
+      put_code(prefix);
+      hash_keys[slot] = key;
+      hash_codes[slot] = next_code++;
+      prefix = data[i];
+      if (next_code == kLastCode - 1) {
+        clear_table();
+      } else if (next_code > max_code) {
+        ++code_width;
+        max_code = (1 << code_width) - 1;
+      }
+    }
+
+    // The decoder adds an entry for the last code too
+    put_code(prefix);
+    ++next_code;
+    if (next_code == kLastCode - 1) {
+      put_code(kClear);
+      code_width = 9;
+    } else if (next_code > max_code) {
+      ++code_width;
+    }
+  }
+  put_code(kEndOfInformation);
+
+  if (bit_count > 0) {
+    compressed->push_back(bits << (8 - bit_count));
+  }
+}
+
+bool compression_available(SPTW_COMPRESSION compression) {
+  switch (compression) {
+    case SP_NoCompression:
+    case SP_Lzw:
+    case SP_Deflate:
+      return true;
+#ifdef HAVE_ZSTD
+    case SP_Zstd:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+SPTW_ERROR compress_tile(const PTIFF *ptiff,
+                         const void *tile,
+                         std::vector<uint8_t> *compressed) {
+  const size_t tile_bytes = ptiff->block_x_size * ptiff->block_y_size
+      * ptiff->band_type_size * ptiff->band_count;
+  size_t size = 0;
+
+  switch (ptiff->compression) {
+    case SP_NoCompression:
+      compressed->assign(static_cast<const uint8_t*>(tile),
+                         static_cast<const uint8_t*>(tile) + tile_bytes);
+      return SP_None;
+    case SP_Lzw:
+      lzw_encode(static_cast<const uint8_t*>(tile), tile_bytes, compressed);
+      return SP_None;
+    case SP_Deflate:
+      // Deflate adds at most 5 bytes per 16 KiB block, and a header
+      compressed->resize(tile_bytes + tile_bytes / 1000 + 64);
+      if (CPLZLibDeflate(tile, tile_bytes, 6, &(*compressed)[0],
+                         compressed->size(), &size) == NULL) {
+        return SP_WriteError;
+      }
+      compressed->resize(size);
+      return SP_None;
+#ifdef HAVE_ZSTD
+    case SP_Zstd:
+      compressed->resize(ZSTD_compressBound(tile_bytes));
+      size = ZSTD_compress(&(*compressed)[0], compressed->size(), tile,
+                           tile_bytes, 9);
+      if (ZSTD_isError(size)) {
+        return SP_WriteError;
+      }
+      compressed->resize(size);
+      return SP_None;
+#endif
+    default:
+      return SP_BadArg;
+  }
+}
+
+SPTW_ERROR write_compressed_tiles_all(PTIFF *ptiff,
+                                      const CompressedTiles *tiles) {
+  int64_t local_bytes = (tiles != NULL) ? tiles->data.size() : 0;
+  SPTW_ERROR result = SP_None;
+  if (local_bytes > INT_MAX) {
+    // Still take part in the collective calls
+    local_bytes = 0;
+    result = SP_BadArg;
+  }
+
+  // Every process finds the end of the file before any of them writes
+  if (ptiff->compressed_end == 0) {
+    MPI_Offset file_size = 0;
+    MPI_File_get_size(ptiff->fh, &file_size);
+    ptiff->compressed_end = file_size;
+  }
+
+  // The tiles of lower ranks come first
+  int rank = 0;
+  int64_t lower_bytes = 0, total_bytes = 0;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Exscan(&local_bytes, &lower_bytes, 1, MPI_INT64_T, MPI_SUM,
+             MPI_COMM_WORLD);
+  if (rank == 0) {
+    lower_bytes = 0;
+  }
+  MPI_Allreduce(&local_bytes, &total_bytes, 1, MPI_INT64_T, MPI_SUM,
+                MPI_COMM_WORLD);
+
+  const int64_t offset = ptiff->compressed_end + lower_bytes;
+  MPI_Status status;
+  if (MPI_File_write_at_all(ptiff->fh,
+                            offset,
+                            local_bytes > 0
+                            ? const_cast<uint8_t*>(&tiles->data[0]) : NULL,
+                            local_bytes,
+                            MPI_BYTE,
+                            &status) != MPI_SUCCESS) {
+    result = SP_WriteError;
+  }
+
+  if (local_bytes > 0) {
+    int64_t tile_offset = offset;
+    for (size_t i = 0; i < tiles->tile_indices.size(); ++i) {
+      ptiff->compressed_tiles.push_back(tiles->tile_indices[i]);
+      ptiff->compressed_tiles.push_back(tile_offset);
+      ptiff->compressed_tiles.push_back(tiles->sizes[i]);
+      tile_offset += tiles->sizes[i];
+    }
+  }
+  ptiff->compressed_end += total_bytes;
+
+  // Every process returns the error of any of them, so they stop together
+  int error = result;
+  MPI_Allreduce(MPI_IN_PLACE, &error, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+  return static_cast<SPTW_ERROR>(error);
 }
 
 int64_t chunk_to_file_offset(PTIFF *tiff_file,
@@ -620,10 +1661,15 @@ SPTW_ERROR write_area(PTIFF *ptiff,
                       int64_t lr_x,
                       int64_t lr_y) {
 
+  if (ptiff->compression > SP_NoCompression) {
+    return SP_BadArg;
+  }
+
   std::vector<Area> write_stack;
   Area write_area;
   write_area.ul = librasterblaster::Coordinate(ul_x, ul_y);
   write_area.lr = librasterblaster::Coordinate(lr_x, lr_y);
+  SPTW_ERROR err = SP_None;
 
   write_stack.push_back(write_area);
 
@@ -638,6 +1684,29 @@ SPTW_ERROR write_area(PTIFF *ptiff,
     // Fill the stack with any leftover areas
     fill_stack(&write_stack, top, subset);
 
+    // A subset covering a whole tile is written with a single call anyway,
+    // others are assembled into whole tiles when the cache is enabled
+    const bool whole_tile = (subset.lr.x - subset.ul.x + 1
+                             == ptiff->block_x_size
+                             && static_cast<int64_t>(subset.ul.y)
+                             % ptiff->block_y_size == 0
+                             && (subset.lr.y - subset.ul.y + 1
+                                 == ptiff->block_y_size
+                                 || subset.lr.y == ptiff->y_size - 1));
+    if (ptiff->tile_cache != NULL && !whole_tile) {
+      if (ptiff->tile_cache->Write(data, ul_x, ul_y, lr_x,
+                                   subset) != SP_None) {
+        err = SP_WriteError;
+      }
+      continue;
+    }
+    if (ptiff->tile_cache != NULL) {
+      ptiff->tile_cache->Discard(
+          static_cast<int64_t>(subset.ul.x) / ptiff->block_x_size
+          + static_cast<int64_t>(subset.ul.y) / ptiff->block_y_size
+          * ptiff->tiles_across);
+    }
+
     // Finally write the tile-bound subset
     write_subset(ptiff,
                  data,
@@ -650,6 +1719,162 @@ SPTW_ERROR write_area(PTIFF *ptiff,
                  subset.lr.x,
                  subset.lr.y);
   }
+  return err;
+}
+
+SPTW_ERROR write_tiles(PTIFF *ptiff,
+                       void *data,
+                       int64_t ul_x,
+                       int64_t ul_y,
+                       int64_t lr_x,
+                       int64_t lr_y) {
+  if (ptiff->tile_offsets == NULL
+      || ptiff->compression > SP_NoCompression
+      || ul_x % ptiff->block_x_size != 0
+      || ul_y % ptiff->block_y_size != 0
+      || ((lr_x + 1) % ptiff->block_x_size != 0 && lr_x != ptiff->x_size - 1)
+      || ((lr_y + 1) % ptiff->block_y_size != 0
+          && lr_y != ptiff->y_size - 1)) {
+    return SP_BadArg;
+  }
+
+  const int64_t tile_bytes = ptiff->block_x_size * ptiff->block_y_size
+      * ptiff->band_type_size * ptiff->band_count;
+  const int64_t first_tile_x = ul_x / ptiff->block_x_size;
+  const int64_t last_tile_x = lr_x / ptiff->block_x_size;
+  char *tile = static_cast<char*>(data);
+  MPI_Status status;
+
+  for (int64_t tile_y = ul_y / ptiff->block_y_size;
+       tile_y <= lr_y / ptiff->block_y_size;
+       ++tile_y) {
+    const int64_t *offsets = ptiff->tile_offsets
+        + tile_y * ptiff->tiles_across;
+    int64_t tile_x = first_tile_x;
+
+    if (ptiff->tile_cache != NULL) {
+      for (int64_t x = first_tile_x; x <= last_tile_x; ++x) {
+        ptiff->tile_cache->Discard(tile_y * ptiff->tiles_across + x);
+      }
+    }
+
+    while (tile_x <= last_tile_x) {
+      // Extend the run while the next tile follows in the file
+      int64_t run = 1;
+      while (tile_x + run <= last_tile_x
+             && offsets[tile_x + run] == offsets[tile_x] + run * tile_bytes
+             && (run + 1) * tile_bytes <= INT_MAX) {
+        ++run;
+      }
+
+      if (MPI_File_write_at(ptiff->fh,
+                            offsets[tile_x],
+                            tile,
+                            run * tile_bytes,
+                            MPI_BYTE,
+                            &status) != MPI_SUCCESS) {
+        return SP_WriteError;
+      }
+
+      tile += run * tile_bytes;
+      tile_x += run;
+    }
+  }
+
   return SP_None;
 }
+
+SPTW_ERROR write_tiles_all(PTIFF *ptiff,
+                           void *data,
+                           int64_t ul_x,
+                           int64_t ul_y,
+                           int64_t lr_x,
+                           int64_t lr_y) {
+  bool empty = (lr_x < ul_x || lr_y < ul_y);
+  SPTW_ERROR result = SP_None;
+  if (ptiff->tile_offsets == NULL
+      || ptiff->compression > SP_NoCompression
+      || (!empty
+          && (ul_x % ptiff->block_x_size != 0
+              || ul_y % ptiff->block_y_size != 0
+              || ((lr_x + 1) % ptiff->block_x_size != 0
+                  && lr_x != ptiff->x_size - 1)
+              || ((lr_y + 1) % ptiff->block_y_size != 0
+                  && lr_y != ptiff->y_size - 1)))) {
+    // Still take part in the collective calls, with nothing to write
+    result = SP_BadArg;
+    empty = true;
+  }
+
+  const int64_t tile_bytes = ptiff->block_x_size * ptiff->block_y_size
+      * ptiff->band_type_size * ptiff->band_count;
+
+  // The file regions are runs of tiles that follow each other in the file,
+  // in the order of the buffer. Tiles are placed in the file row by row,
+  // so the displacements increase as a file view requires.
+  std::vector<int> run_lengths;
+  std::vector<MPI_Aint> displacements;
+  int tile_count = 0;
+  if (!empty) {
+    for (int64_t tile_y = ul_y / ptiff->block_y_size;
+         tile_y <= lr_y / ptiff->block_y_size;
+         ++tile_y) {
+      const int64_t *offsets = ptiff->tile_offsets
+          + tile_y * ptiff->tiles_across;
+
+      for (int64_t tile_x = ul_x / ptiff->block_x_size;
+           tile_x <= lr_x / ptiff->block_x_size;
+           ++tile_x) {
+        if (ptiff->tile_cache != NULL) {
+          ptiff->tile_cache->Discard(tile_y * ptiff->tiles_across + tile_x);
+        }
+        if (!displacements.empty()
+            && offsets[tile_x] == displacements.back()
+            + run_lengths.back() * tile_bytes) {
+          ++run_lengths.back();
+        } else {
+          run_lengths.push_back(1);
+          displacements.push_back(offsets[tile_x]);
+        }
+        ++tile_count;
+      }
+    }
+  }
+
+  MPI_Datatype tile_type, file_type;
+  MPI_Type_contiguous(tile_bytes, MPI_BYTE, &tile_type);
+  MPI_Type_commit(&tile_type);
+  MPI_Type_create_hindexed(run_lengths.size(),
+                           run_lengths.empty() ? NULL : &run_lengths[0],
+                           displacements.empty() ? NULL : &displacements[0],
+                           tile_type,
+                           &file_type);
+  MPI_Type_commit(&file_type);
+
+  // Ask ROMIO for two-phase collective buffering
+  MPI_Info info;
+  MPI_Info_create(&info);
+  MPI_Info_set(info, const_cast<char*>("romio_cb_write"),
+               const_cast<char*>("enable"));
+
+  MPI_Status status;
+  if (MPI_File_set_view(ptiff->fh, 0, MPI_BYTE, file_type,
+                        const_cast<char*>("native"), info) != MPI_SUCCESS
+      || MPI_File_write_all(ptiff->fh, data, tile_count, tile_type,
+                            &status) != MPI_SUCCESS) {
+    result = SP_WriteError;
+  }
+  MPI_File_set_view(ptiff->fh, 0, MPI_BYTE, MPI_BYTE,
+                    const_cast<char*>("native"), MPI_INFO_NULL);
+
+  MPI_Info_free(&info);
+  MPI_Type_free(&file_type);
+  MPI_Type_free(&tile_type);
+
+  // Every process returns the error of any of them, so they stop together
+  int error = result;
+  MPI_Allreduce(MPI_IN_PLACE, &error, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+  return static_cast<SPTW_ERROR>(error);
+}
 }
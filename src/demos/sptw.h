@@ -21,6 +21,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include <gdal_priv.h>
 #include <mpi.h>
 
@@ -56,6 +57,19 @@ enum SPTW_ERROR {
   SP_BadArg, /*!< A bad argument was provided */
 };
 
+/*!
+ * Compression of the tiles of a PTIFF, the values are the TIFF compression
+ * codes.
+ */
+enum SPTW_COMPRESSION {
+  SP_NoCompression = 1, /*!< Tiles are stored as they are */
+  SP_Lzw = 5, /*!< LZW */
+  SP_Deflate = 8, /*!< Deflate, as zlib streams */
+  SP_Zstd = 50000, /*!< Zstandard, only available when built with libzstd */
+};
+
+class TileCache;
+
 /**
  * @struct PTIFF sptw.h
  * @brief PTIFF struct represents an open parallel tiff file
@@ -88,9 +102,47 @@ struct PTIFF {
   int64_t tiles_across;
   /* Number of tiles down raster */
   int64_t tiles_down;
+  /*! Partly written tiles held back by write_area, NULL unless enabled with
+   *  set_tile_cache */
+  TileCache *tile_cache;
+  /*! Compression of the tiles, an SPTW_COMPRESSION value */
+  int compression;
+  /*! End of the tiles written by write_compressed_tiles_all, 0 before the
+   *  first call */
+  int64_t compressed_end;
+  /*! Index, offset and byte count of each tile this process has written
+   *  with write_compressed_tiles_all */
+  std::vector<int64_t> compressed_tiles;
 };
 
-SPTW_ERROR populate_tile_offsets(PTIFF *tiff_file, int64_t tile_size);
+/**
+ * @struct CompressedTiles sptw.h
+ * @brief Tiles compressed by compress_tile, to be written together by
+ * write_compressed_tiles_all
+ */
+struct CompressedTiles {
+  /*! Index of each tile in the file, rows of tiles from the top */
+  std::vector<int64_t> tile_indices;
+  /*! Byte count of each compressed tile */
+  std::vector<int64_t> sizes;
+  /*! The compressed tiles, one after the other */
+  std::vector<uint8_t> data;
+};
+
+/**
+ * @brief Places the tiles of a tiled BigTIFF created with SPARSE_OK one
+ * after the other at the end of the file and writes their offsets and byte
+ * counts.
+ *
+ * @param tiff_file The open PTIFF file
+ * @param tile_size Width and height of the tiles
+ * @param sparse_tiles If not NULL, the tiles, in the order of the file,
+ * that are left out of it. They keep an offset and byte count of 0, and
+ * GDAL reads them as the nodata value, so they must not be written.
+ */
+SPTW_ERROR populate_tile_offsets(PTIFF *tiff_file,
+                                 int64_t tile_size,
+                                 const std::vector<bool> *sparse_tiles = NULL);
 
 SPTW_ERROR create_raster(string filename,
                          int64_t x_size,
@@ -108,9 +160,141 @@ SPTW_ERROR create_tiled_raster(string filename,
                                double *geotransform,
                                string projection_srs,
                                int64_t tile_size);
+/**
+ * @brief Creates a tiled, pixel interleaved BigTIFF without GDAL, writing
+ * its header, directory, GeoTIFF keys, nodata and the offsets and byte
+ * counts of its tiles with a single write.
+ *
+ * The tiles of an uncompressed file are placed one after the other and
+ * preallocated with fallocate, so every process can open the file with
+ * open_raster and write them straight away. A compressed file has no tiles
+ * placed, they are written with write_compressed_tiles_all.
+ *
+ * Only one process calls this function.
+ *
+ * @param filename Path of the new file
+ * @param x_size Width of the raster
+ * @param y_size Height of the raster
+ * @param band_count Number of bands
+ * @param band_type Type of the band values, complex types are not supported
+ * @param geotransform GDAL geotransform of the raster, which must be north up
+ * @param projection_srs Coordinate system, in any form
+ *        OGRSpatialReference::SetFromUserInput accepts
+ * @param tile_size Width and height of the tiles, a multiple of 16
+ * @param no_data_value If not NULL, the nodata value GDAL reads
+ * @param color_table If not NULL, the color map of a single band Byte or
+ *        UInt16 raster
+ * @param compression Compression of the tiles
+ */
+SPTW_ERROR create_tiled_bigtiff(string filename,
+                                int64_t x_size,
+                                int64_t y_size,
+                                int band_count,
+                                GDALDataType band_type,
+                                double *geotransform,
+                                string projection_srs,
+                                int64_t tile_size,
+                                const double *no_data_value = NULL,
+                                GDALColorTable *color_table = NULL,
+                                SPTW_COMPRESSION compression =
+                                SP_NoCompression);
+
 PTIFF* open_raster(string filename);
+/**
+ * @brief Writes any tiles held by the tile cache and closes the file.
+ *
+ * For a compressed PTIFF the first process then writes the offsets and
+ * byte counts of the tiles written by every process with
+ * write_compressed_tiles_all.
+ */
 SPTW_ERROR close_raster(PTIFF *ptiff);
 
+/**
+ * @brief Returns true if tiles can be compressed with compression.
+ */
+bool compression_available(SPTW_COMPRESSION compression);
+
+/**
+ * @brief Leaves tiles out of an uncompressed file whose tiles were placed
+ * one after the other, by create_tiled_bigtiff or populate_tile_offsets.
+ *
+ * The tiles that are kept are moved down over those left out, which get an
+ * offset and byte count of 0 and must not be written, and the file is cut
+ * to the end of the last tile. Every process that opened ptiff must call
+ * this function, with the same sparse_tiles, before writing any tile.
+ *
+ * @param ptiff The open, tiled PTIFF file
+ * @param sparse_tiles The tiles, in the order of the file, to leave out
+ */
+SPTW_ERROR leave_out_tiles_all(PTIFF *ptiff,
+                               const std::vector<bool>& sparse_tiles);
+
+/**
+ * @brief Marks the tiles of a tiled BigTIFF whose tiles have not been
+ * placed, see populate_tile_offsets, as compressed with compression.
+ *
+ * Only one process calls this function, and every process must then
+ * reopen the file. The tiles of the reopened PTIFF can only be written with
+ * write_compressed_tiles_all.
+ */
+SPTW_ERROR set_tile_compression(PTIFF *ptiff, SPTW_COMPRESSION compression);
+
+/**
+ * @brief Compresses one tile of ptiff. This function does not use MPI and
+ * can be called from several threads at once.
+ *
+ * @param ptiff The open PTIFF file the tile belongs to
+ * @param tile The pixels of a whole tile, laid out as in an uncompressed
+ *        file, including any padding past the edge of the raster
+ * @param compressed Set to the compressed tile
+ */
+SPTW_ERROR compress_tile(const PTIFF *ptiff,
+                         const void *tile,
+                         std::vector<uint8_t> *compressed);
+
+/**
+ * @brief
+ * Appends compressed tiles to the file. The offset of each process's tiles
+ * is the sum of the sizes of the tiles of the lower ranks, found with
+ * MPI_Exscan, and all of them are written with one collective call. The
+ * offsets and byte counts are written by close_raster.
+ *
+ * Every process that opened ptiff must call this function the same number
+ * of times, with NULL tiles when it has nothing to write. Each tile may be
+ * written only once. Every process returns the error of any of them.
+ *
+ * @param ptiff The open PTIFF file, compressed with set_tile_compression
+ * @param tiles The tiles this process writes, or NULL
+ */
+SPTW_ERROR write_compressed_tiles_all(PTIFF *ptiff,
+                                      const CompressedTiles *tiles);
+
+/**
+ * @brief Lets write_area assemble the tiles of a tiled PTIFF in memory.
+ *
+ * Parts of tiles written by write_area are copied to the cache instead of
+ * being written row by row. A tile is written with a single MPI-IO call
+ * once all of its pixels inside the raster have been given. When the cached
+ * tiles would take more than memory_limit bytes, the least recently written
+ * ones are written out, only the pixels they hold. Every tile left is
+ * written by flush_tile_cache or close_raster.
+ *
+ * A tile may be assembled by only one process at a time, and whole tiles
+ * written by write_tiles or write_tiles_all replace what the cache holds
+ * for them.
+ *
+ * @param ptiff The open, tiled PTIFF file
+ * @param memory_limit Bytes of tiles the cache may hold, 0 disables the
+ *        cache after flushing it
+ */
+SPTW_ERROR set_tile_cache(PTIFF *ptiff, int64_t memory_limit);
+
+/**
+ * @brief Writes the pixels of every tile held by the tile cache of ptiff and
+ * empties it.
+ */
+SPTW_ERROR flush_tile_cache(PTIFF *ptiff);
+
 /**
  * @brief
  * This function writes the given buffer to the open PTIFF. The
@@ -137,6 +321,69 @@ SPTW_ERROR write_area(PTIFF *ptiff,
                       int64_t ul_y,
                       int64_t lr_x,
                       int64_t lr_y);
+
+/**
+ * @brief
+ * This function writes a buffer that is already laid out in the tiles of
+ * the open PTIFF, as in a RasterChunk with tile_width set, without copying
+ * it. Each run of tiles that are adjacent both in the buffer and in the
+ * file is written with a single MPI-IO call.
+ *
+ * The area must start on a tile boundary and end on a tile boundary or at
+ * the edge of the raster, whole tiles are written.
+ *
+ * @param ptiff The open, tiled PTIFF file to be written to
+ * @param data buffer containing the tiles of the area, rows of tiles from
+ *        the top, each tile padded to the full tile size
+ * @param ul_x Upper-left, inclusive, y-down, x coordinate of the area to be
+ *             written
+ * @param ul_y Upper-left, inclusive, y-down, y coordinate of the area to be
+ *             written
+ * @param lr_x Lower-right, inclusive, y-down, x coordinate of the area to be
+ *             written
+ * @param lr_y Lower-right, inclusive, y-down, y coordinate of the area to be
+ *             written
+ *
+ */
+SPTW_ERROR write_tiles(PTIFF *ptiff,
+                       void *data,
+                       int64_t ul_x,
+                       int64_t ul_y,
+                       int64_t lr_x,
+                       int64_t lr_y);
+
+/**
+ * @brief
+ * Collective version of write_tiles. The runs of tiles of each process are
+ * described by a file view and written with MPI_File_write_all, so the
+ * MPI-IO library can gather the small writes of many processes into large
+ * contiguous writes to the file system.
+ *
+ * Every process that opened ptiff must call this function the same number
+ * of times. A process with nothing to write passes NULL data and an empty
+ * area, with lr_x < ul_x. The view is reset afterwards, so the independent
+ * functions can still be used between calls. A process whose area isn't
+ * made of whole tiles writes nothing but still joins the collective call,
+ * and every process returns the error of any of them.
+ *
+ * @param ptiff The open, tiled PTIFF file to be written to
+ * @param data buffer containing the tiles of the area, as in write_tiles
+ * @param ul_x Upper-left, inclusive, y-down, x coordinate of the area to be
+ *             written
+ * @param ul_y Upper-left, inclusive, y-down, y coordinate of the area to be
+ *             written
+ * @param lr_x Lower-right, inclusive, y-down, x coordinate of the area to be
+ *             written
+ * @param lr_y Lower-right, inclusive, y-down, y coordinate of the area to be
+ *             written
+ *
+ */
+SPTW_ERROR write_tiles_all(PTIFF *ptiff,
+                           void *data,
+                           int64_t ul_x,
+                           int64_t ul_y,
+                           int64_t lr_x,
+                           int64_t lr_y);
 }
 
 #endif  // SRC_DEMOS_SPTW_H_
@@ -0,0 +1,364 @@
+//
+// Copyright 0000 <Nobody>
+// @file
+// @author David Matthew Mattli <dmattli@usgs.gov>
+//
+// @section LICENSE
+//
+// This software is in the public domain, furnished "as is", without
+// technical support, and with no warranty, express or implied, as to
+// its usefulness for any purpose.
+//
+// @section DESCRIPTION
+//
+// Reads the tiles of an uncompressed, tiled BigTIFF straight from a memory
+// mapping of the file.
+//
+//
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tiff.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "mappedraster.h"
+
+namespace librasterblaster {
+/** \cond DOXYHIDE **/
+// Returns the little-endian unsigned integer of size bytes at buffer
+static uint64_t ParseUnsigned(const uint8_t *buffer, int size) {
+  uint64_t result = 0;
+
+  for (int i = size - 1; i >= 0; --i) {
+    result = (result << 8) | buffer[i];
+  }
+
+  return result;
+}
+
+// Reads the values of the directory entry at entry into values. Only the
+// integer types used by the tags we need are handled.
+static bool EntryValues(const uint8_t *data,
+                        size_t size,
+                        const uint8_t *entry,
+                        std::vector<int64_t> *values) {
+  const int type = ParseUnsigned(entry + 2, 2);
+  const uint64_t count = ParseUnsigned(entry + 4, 8);
+  int type_size = 0;
+
+  switch (type) {
+    case TIFF_SHORT:
+      type_size = 2;
+      break;
+    case TIFF_LONG:
+      type_size = 4;
+      break;
+    case TIFF_LONG8:
+      type_size = 8;
+      break;
+    default:
+      return false;
+  }
+
+  if (count > size / type_size) {
+    return false;
+  }
+
+  // Values that fit in the entry are stored in it, the others at an offset
+  const uint8_t *value = entry + 12;
+  if (count * type_size > 8) {
+    const uint64_t offset = ParseUnsigned(entry + 12, 8);
+    if (offset > size || count * type_size > size - offset) {
+      return false;
+    }
+    value = data + offset;
+  }
+
+  values->resize(count);
+  for (uint64_t i = 0; i < count; ++i) {
+    (*values)[i] = ParseUnsigned(value + i * type_size, type_size);
+  }
+
+  return true;
+}
+/** \endcond **/
+
+MappedRaster::MappedRaster()
+    : data_(NULL), size_(0), x_size_(0), y_size_(0), band_count_(0),
+      sample_size_(0), tile_width_(0), tile_height_(0), tiles_across_(0),
+      tiles_down_(0) {
+}
+
+MappedRaster::~MappedRaster() {
+  if (data_ != NULL) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+}
+
+MappedRaster *MappedRaster::Open(const std::string& filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size < 16) {
+    close(fd);
+    return NULL;
+  }
+
+  void *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping keeps the file open
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  MappedRaster *raster = new MappedRaster();
+  raster->data_ = static_cast<const uint8_t*>(data);
+  raster->size_ = file_stat.st_size;
+
+  if (!raster->ParseDirectory()) {
+    delete raster;
+    return NULL;
+  }
+
+  return raster;
+}
+
+bool MappedRaster::ParseDirectory() {
+  // Views of the tiles need the pixels in the byte order of this machine
+  const uint16_t byte_order_mark = 1;
+  const bool little_endian =
+      *reinterpret_cast<const uint8_t*>(&byte_order_mark) == 1;
+
+  if (!little_endian || data_[0] != 0x49 || data_[1] != 0x49) {
+    return false;
+  }
+
+  // Check that we are dealing with a BigTIFF
+  if (ParseUnsigned(data_ + 2, 2) != 0x002B) {
+    return false;
+  }
+
+  // Read offset to first directory and number of directory entries
+  const uint64_t directory_offset = ParseUnsigned(data_ + 8, 8);
+  if (directory_offset > size_ - 8) {
+    return false;
+  }
+  const uint64_t entry_count = ParseUnsigned(data_ + directory_offset, 8);
+  if (entry_count > (size_ - directory_offset - 8) / 20) {
+    return false;
+  }
+
+  int64_t compression = COMPRESSION_NONE;
+  int64_t planar_config = PLANARCONFIG_CONTIG;
+  std::vector<int64_t> bits_per_sample, tile_byte_counts, values;
+
+  for (uint64_t i = 0; i < entry_count; ++i) {
+    const uint8_t *entry = data_ + directory_offset + 8 + i * 20;
+    const int tag = ParseUnsigned(entry, 2);
+
+    switch (tag) {
+      case TIFFTAG_IMAGEWIDTH:
+      case TIFFTAG_IMAGELENGTH:
+      case TIFFTAG_COMPRESSION:
+      case TIFFTAG_SAMPLESPERPIXEL:
+      case TIFFTAG_PLANARCONFIG:
+      case TIFFTAG_TILEWIDTH:
+      case TIFFTAG_TILELENGTH:
+        if (!EntryValues(data_, size_, entry, &values) || values.size() != 1) {
+          return false;
+        }
+        break;
+      case TIFFTAG_BITSPERSAMPLE:
+        if (!EntryValues(data_, size_, entry, &bits_per_sample)) {
+          return false;
+        }
+        continue;
+      case TIFFTAG_TILEOFFSETS:
+        if (!EntryValues(data_, size_, entry, &tile_offsets_)) {
+          return false;
+        }
+        continue;
+      case TIFFTAG_TILEBYTECOUNTS:
+        if (!EntryValues(data_, size_, entry, &tile_byte_counts)) {
+          return false;
+        }
+        continue;
+      default:
+        continue;
+    }
+
+    switch (tag) {
+      case TIFFTAG_IMAGEWIDTH:
+        x_size_ = values[0];
+        break;
+      case TIFFTAG_IMAGELENGTH:
+        y_size_ = values[0];
+        break;
+      case TIFFTAG_COMPRESSION:
+        compression = values[0];
+        break;
+      case TIFFTAG_SAMPLESPERPIXEL:
+        band_count_ = values[0];
+        break;
+      case TIFFTAG_PLANARCONFIG:
+        planar_config = values[0];
+        break;
+      case TIFFTAG_TILEWIDTH:
+        tile_width_ = values[0];
+        break;
+      case TIFFTAG_TILELENGTH:
+        tile_height_ = values[0];
+        break;
+    }
+  }
+
+  if (band_count_ == 0) {
+    band_count_ = 1;
+  }
+
+  if (compression != COMPRESSION_NONE
+      || (planar_config != PLANARCONFIG_CONTIG && band_count_ > 1)
+      || x_size_ <= 0 || y_size_ <= 0
+      || tile_width_ <= 0 || tile_height_ <= 0
+      || bits_per_sample.empty()
+      || bits_per_sample[0] % 8 != 0) {
+    return false;
+  }
+
+  for (size_t i = 1; i < bits_per_sample.size(); ++i) {
+    if (bits_per_sample[i] != bits_per_sample[0]) {
+      return false;
+    }
+  }
+  sample_size_ = bits_per_sample[0] / 8;
+
+  tiles_across_ = (x_size_ + tile_width_ - 1) / tile_width_;
+  tiles_down_ = (y_size_ + tile_height_ - 1) / tile_height_;
+  const int64_t tile_count = tiles_across_ * tiles_down_;
+  const uint64_t tile_bytes = static_cast<uint64_t>(tile_width_)
+      * tile_height_ * band_count_ * sample_size_;
+
+  if (static_cast<int64_t>(tile_offsets_.size()) != tile_count
+      || static_cast<int64_t>(tile_byte_counts.size()) != tile_count) {
+    return false;
+  }
+
+  // Sparse tiles, which have no data in the file, are left to GDAL
+  for (int64_t i = 0; i < tile_count; ++i) {
+    const uint64_t offset = tile_offsets_[i];
+    if (offset == 0
+        || static_cast<uint64_t>(tile_byte_counts[i]) != tile_bytes
+        || offset > size_ || tile_bytes > size_ - offset) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void MappedRaster::Prefetch(Area area) const {
+  // Chunks outside of the projected area don't read the raster
+  if (area.ul.x < 0.0 || area.ul.y < 0.0) {
+    return;
+  }
+
+  const int64_t page_size = sysconf(_SC_PAGESIZE);
+  const int64_t tile_bytes = static_cast<int64_t>(tile_width_) * tile_height_
+      * band_count_ * sample_size_;
+  const int64_t first_tile_x = static_cast<int64_t>(area.ul.x) / tile_width_;
+  const int64_t last_tile_x = std::min<int64_t>(
+      static_cast<int64_t>(area.lr.x) / tile_width_, tiles_across_ - 1);
+  const int64_t last_tile_y = std::min<int64_t>(
+      static_cast<int64_t>(area.lr.y) / tile_height_, tiles_down_ - 1);
+
+  for (int64_t tile_y = static_cast<int64_t>(area.ul.y) / tile_height_;
+       tile_y <= last_tile_y;
+       ++tile_y) {
+    const int64_t *offsets = &tile_offsets_[tile_y * tiles_across_];
+    int64_t tile_x = first_tile_x;
+
+    while (tile_x <= last_tile_x) {
+      // Extend the run while the next tile follows in the file
+      int64_t run = 1;
+      while (tile_x + run <= last_tile_x
+             && offsets[tile_x + run] == offsets[tile_x] + run * tile_bytes) {
+        ++run;
+      }
+
+      const int64_t start = offsets[tile_x] / page_size * page_size;
+      madvise(const_cast<uint8_t*>(data_) + start,
+              offsets[tile_x] + run * tile_bytes - start,
+              MADV_WILLNEED);
+      tile_x += run;
+    }
+  }
+}
+
+PRB_ERROR MappedRaster::Read(RasterChunk *chunk) const {
+  const int64_t ul_x = chunk->raster_location.x;
+  const int64_t ul_y = chunk->raster_location.y;
+
+  if (chunk->pixels == NULL
+      || chunk->decimation != 1
+      || chunk->tile_width != 0
+      || chunk->band_count != band_count_
+      || GDALGetDataTypeSize(chunk->pixel_type) / 8 != sample_size_
+      || ul_x < 0 || ul_y < 0
+      || ul_x + chunk->column_count > x_size_
+      || ul_y + chunk->row_count > y_size_) {
+    return PRB_BADARG;
+  }
+
+  const int64_t pixel_bytes = static_cast<int64_t>(band_count_)
+      * sample_size_;
+  const int64_t band_bytes = static_cast<int64_t>(chunk->row_count)
+      * chunk->column_count * sample_size_;
+  uint8_t *pixels = static_cast<uint8_t*>(chunk->pixels);
+
+  // Each row of the chunk is copied from the rows of the tiles it crosses.
+  // The bands of the chunk are stored one after the other, those of the
+  // tiles are interleaved by pixel.
+  for (int y = 0; y < chunk->row_count; ++y) {
+    const int64_t raster_y = ul_y + y;
+    const int64_t tile_y = raster_y / tile_height_;
+    const int64_t tile_row = raster_y % tile_height_;
+    uint8_t *row = pixels + static_cast<int64_t>(y) * chunk->column_count
+        * sample_size_;
+    int x = 0;
+
+    while (x < chunk->column_count) {
+      const int64_t raster_x = ul_x + x;
+      const int64_t tile_x = raster_x / tile_width_;
+      const int run = std::min<int64_t>(chunk->column_count - x,
+                                        (tile_x + 1) * tile_width_ - raster_x);
+      const uint8_t *source = TileData(tile_x, tile_y)
+          + (tile_row * tile_width_ + raster_x % tile_width_) * pixel_bytes;
+
+      if (band_count_ == 1) {
+        memcpy(row + static_cast<int64_t>(x) * sample_size_, source,
+               static_cast<size_t>(run) * sample_size_);
+      } else {
+        for (int i = 0; i < run; ++i) {
+          for (int band = 0; band < band_count_; ++band) {
+            memcpy(row + band * band_bytes
+                   + static_cast<int64_t>(x + i) * sample_size_,
+                   source + i * pixel_bytes + band * sample_size_,
+                   sample_size_);
+          }
+        }
+      }
+
+      x += run;
+    }
+  }
+
+  return PRB_NOERROR;
+}
+}
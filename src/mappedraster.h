@@ -0,0 +1,130 @@
+//
+// Copyright 0000 <Nobody>
+// @file
+// @author David Matthew Mattli <dmattli@usgs.gov>
+//
+// @section LICENSE
+//
+// This software is in the public domain, furnished "as is", without
+// technical support, and with no warranty, express or implied, as to
+// its usefulness for any purpose.
+//
+// @section DESCRIPTION
+//
+// Reads the tiles of an uncompressed, tiled BigTIFF straight from a memory
+// mapping of the file.
+//
+//
+
+#ifndef SRC_MAPPEDRASTER_H_
+#define SRC_MAPPEDRASTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "rasterchunk.h"
+#include "rasterview.h"
+#include "utils.h"
+
+namespace librasterblaster {
+/// Memory-mapped raster class
+/**
+ * A MappedRaster maps an uncompressed, tiled, pixel-interleaved BigTIFF
+ * in the byte order of this machine, such as the files written by
+ * sptw::create_tiled_raster, and finds its tiles by walking the first
+ * image file directory the way sptw::populate_tile_offsets does. Tiles are
+ * then available as views of the mapping, without going through the GDAL
+ * block cache, and Read() fills chunks directly from the mapped tiles.
+ */
+class MappedRaster {
+ public:
+  /**
+   * @brief Maps the file at filename.
+   *
+   * @return Returns NULL if the file can't be mapped or isn't an
+   * uncompressed, tiled, pixel-interleaved BigTIFF in the byte order of
+   * this machine with every tile present. Such files should be read with
+   * GDAL instead.
+   */
+  static MappedRaster *Open(const std::string& filename);
+
+  /**
+   * @brief Destructor, unmaps the file. Views of its tiles are no longer
+   * valid afterwards.
+   */
+  ~MappedRaster();
+
+  /**
+   * @brief Returns the tile in column tile_x of row tile_y of tiles of a
+   * single band raster. Tiles on the right and bottom edges include their
+   * padding.
+   */
+  template <class T>
+  RasterView<const T> Tile(int64_t tile_x, int64_t tile_y) const {
+    return RasterView<const T>(
+        reinterpret_cast<const T*>(TileData(tile_x, tile_y)),
+        tile_width_, tile_height_, tile_width_);
+  }
+
+  /**
+   * @brief Returns the first byte of the tile in column tile_x of row
+   * tile_y, its bands are interleaved by pixel.
+   */
+  const uint8_t *TileData(int64_t tile_x, int64_t tile_y) const {
+    return data_ + tile_offsets_[tile_y * tiles_across_ + tile_x];
+  }
+
+  /**
+   * @brief Asks the system to start reading the tiles of area, an
+   * inclusive area in raster coordinates, into memory in the background.
+   */
+  void Prefetch(Area area) const;
+
+  /**
+   * @brief Fills the pixels of a full resolution, row-major chunk of this
+   * raster, created from its GDALDataset, from the mapped tiles.
+   *
+   * @return Returns PRB_BADARG if chunk is decimated, tiled, or doesn't
+   * match the bands and pixel size of the raster.
+   */
+  PRB_ERROR Read(RasterChunk *chunk) const;
+
+  /// Number of columns
+  int64_t x_size() const { return x_size_; }
+  /// Number of rows
+  int64_t y_size() const { return y_size_; }
+  /// Number of bands
+  int band_count() const { return band_count_; }
+  /// Size in bytes of one band of one pixel
+  int sample_size() const { return sample_size_; }
+  /// Width of the tiles
+  int tile_width() const { return tile_width_; }
+  /// Height of the tiles
+  int tile_height() const { return tile_height_; }
+
+ private:
+  MappedRaster();
+  MappedRaster(const MappedRaster &);
+  MappedRaster &operator=(const MappedRaster &);
+
+  // Reads the tags of the first directory, returns false if the file isn't
+  // supported
+  bool ParseDirectory();
+
+  const uint8_t *data_;
+  size_t size_;
+  int64_t x_size_;
+  int64_t y_size_;
+  int band_count_;
+  int sample_size_;
+  int tile_width_;
+  int tile_height_;
+  int64_t tiles_across_;
+  int64_t tiles_down_;
+  std::vector<int64_t> tile_offsets_;
+};
+}
+
+#endif  // SRC_MAPPEDRASTER_H_
@@ -0,0 +1,290 @@
+//
+// Copyright 0000 <Nobody>
+// @file
+// @author David Matthew Mattli <dmattli@usgs.gov>
+//
+// @section LICENSE
+//
+// This software is in the public domain, furnished "as is", without
+// technical support, and with no warranty, express or implied, as to
+// its usefulness for any purpose.
+//
+// @section DESCRIPTION
+//
+// A read, compute and write pipeline whose stages run on their own threads
+// and are connected by bounded queues.
+//
+//
+
+#ifndef SRC_PIPELINE_H_
+#define SRC_PIPELINE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "utils.h"
+
+namespace librasterblaster {
+/// Bounded queue class
+/**
+ * A first-in first-out queue that holds at most capacity items and can be
+ * used by several threads at once. Push() waits while the queue is full
+ * and Pop() waits while it is empty.
+ */
+template <class T>
+class BoundedQueue {
+ public:
+  /**
+   * @brief Constructor
+   *
+   * @param capacity Largest number of items in the queue, values below one
+   * are treated as one.
+   */
+  explicit BoundedQueue(size_t capacity)
+      : capacity_(std::max<size_t>(capacity, 1)), closed_(false) {
+  }
+
+  /**
+   * @brief Appends item, waiting for room if the queue is full.
+   *
+   * @return Returns false, and drops item, if the queue has been closed.
+   */
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] {
+        return closed_ || items_.size() < capacity_;
+      });
+    if (closed_) {
+      return false;
+    }
+
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /**
+   * @brief Removes the first item into item, waiting for one if the queue
+   * is empty.
+   *
+   * @return Returns false if the queue is empty and has been closed.
+   */
+  bool Pop(T *item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    return TakeFront(item);
+  }
+
+  /**
+   * @brief Like Pop(), but calls idle, without holding the queue, each time
+   * interval passes while the queue is empty.
+   */
+  bool Pop(T *item, std::chrono::milliseconds interval,
+           const std::function<void()>& idle) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!not_empty_.wait_for(lock, interval, [this] {
+          return closed_ || !items_.empty();
+        })) {
+      lock.unlock();
+      idle();
+      lock.lock();
+    }
+    return TakeFront(item);
+  }
+
+  /**
+   * @brief Closes the queue. Later calls to Push() fail, Pop() returns the
+   * items that are left and then fails.
+   */
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+ private:
+  BoundedQueue(const BoundedQueue &);
+  BoundedQueue &operator=(const BoundedQueue &);
+
+  // Removes the first item into item, with mutex_ held. Returns false if
+  // the queue is empty.
+  bool TakeFront(T *item) {
+    if (items_.empty()) {
+      return false;
+    }
+
+    *item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  const size_t capacity_;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  bool closed_;
+};
+
+/**
+ * @brief Stages of RunPipeline(), in the order items pass through them
+ */
+enum PIPELINE_STAGE { READ_STAGE, COMPUTE_STAGE, WRITE_STAGE, STAGE_COUNT };
+
+/**
+ * @brief Time spent by RunPipeline() and by each of its stages
+ */
+struct PipelineTimes {
+  PipelineTimes() : elapsed(0.0) {
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+      busy[i] = 0.0;
+    }
+  }
+
+  /**
+   * @brief Returns the fraction of the elapsed time that stage spent
+   * working rather than waiting on the queues.
+   */
+  double Utilization(PIPELINE_STAGE stage) const {
+    return (elapsed > 0.0) ? busy[stage] / elapsed : 0.0;
+  }
+
+  /** Seconds spent in the functions of each stage */
+  double busy[STAGE_COUNT];
+  /** Seconds from the start to the end of RunPipeline() */
+  double elapsed;
+};
+
+/**
+ * @brief Runs read, compute and write for items 0 to item_count - 1, with
+ * the three stages working on different items at the same time.
+ *
+ * read(i, &item) creates item i, compute(i, item) works on it and
+ * write(i, item) stores the result. Items are passed from stage to stage,
+ * in order, through queues of queue_length items. The read and compute
+ * stages run on threads of their own, the write stage runs on the calling
+ * thread so that a caller limited to MPI_THREAD_FUNNELED may write with
+ * MPI. The first stage function that fails stops the pipeline.
+ *
+ * @param item_count Number of items
+ * @param queue_length Capacity of each of the two queues. At most
+ * 2 * queue_length + 3 items exist at once.
+ * @param read Function that creates an item
+ * @param compute Function that processes an item
+ * @param write Function that stores an item
+ * @param times If not NULL, receives the busy time of each stage and the
+ * elapsed time.
+ * @param idle If not empty, called on the calling thread every millisecond
+ * that the write stage waits for an item, for instance to let MPI make
+ * progress.
+ *
+ * @return Returns PRB_NOERROR, or the error of the first stage function
+ * that failed.
+ */
+template <class T>
+PRB_ERROR RunPipeline(int item_count,
+                      int queue_length,
+                      std::function<PRB_ERROR(int, T*)> read,
+                      std::function<PRB_ERROR(int, T&)> compute,
+                      std::function<PRB_ERROR(int, T&)> write,
+                      PipelineTimes *times,
+                      std::function<void()> idle = std::function<void()>()) {
+  typedef std::chrono::steady_clock Clock;
+  typedef std::pair<int, T> Item;
+
+  const Clock::time_point start = Clock::now();
+  BoundedQueue<Item> read_items(queue_length);
+  BoundedQueue<Item> computed_items(queue_length);
+  std::mutex error_mutex;
+  PRB_ERROR error = PRB_NOERROR;
+  double busy[STAGE_COUNT] = { 0.0 };
+
+  // Records the first error and stops every stage
+  auto fail = [&](PRB_ERROR err) {
+    {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (error == PRB_NOERROR) {
+        error = err;
+      }
+    }
+    read_items.Close();
+    computed_items.Close();
+  };
+
+  std::thread reader([&] {
+      for (int i = 0; i < item_count; ++i) {
+        Item item(i, T());
+        const Clock::time_point stage_start = Clock::now();
+        const PRB_ERROR err = read(i, &item.second);
+        busy[READ_STAGE] += std::chrono::duration<double>(
+            Clock::now() - stage_start).count();
+
+        if (err != PRB_NOERROR) {
+          fail(err);
+          return;
+        }
+        if (!read_items.Push(std::move(item))) {
+          return;
+        }
+      }
+      read_items.Close();
+    });
+
+  std::thread computer([&] {
+      Item item;
+      while (read_items.Pop(&item)) {
+        const Clock::time_point stage_start = Clock::now();
+        const PRB_ERROR err = compute(item.first, item.second);
+        busy[COMPUTE_STAGE] += std::chrono::duration<double>(
+            Clock::now() - stage_start).count();
+
+        if (err != PRB_NOERROR) {
+          fail(err);
+          return;
+        }
+        if (!computed_items.Push(std::move(item))) {
+          return;
+        }
+      }
+      computed_items.Close();
+    });
+
+  Item item;
+  while (idle ? computed_items.Pop(&item, std::chrono::milliseconds(1), idle)
+         : computed_items.Pop(&item)) {
+    const Clock::time_point stage_start = Clock::now();
+    const PRB_ERROR err = write(item.first, item.second);
+    busy[WRITE_STAGE] += std::chrono::duration<double>(
+        Clock::now() - stage_start).count();
+    item.second = T();
+
+    if (err != PRB_NOERROR) {
+      fail(err);
+      break;
+    }
+  }
+
+  reader.join();
+  computer.join();
+
+  if (times != NULL) {
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+      times->busy[i] = busy[i];
+    }
+    times->elapsed = std::chrono::duration<double>(
+        Clock::now() - start).count();
+  }
+
+  return error;
+}
+}
+
+#endif  // SRC_PIPELINE_H_
@@ -19,12 +19,19 @@
 #include <cstring>
 #include <gdal.h>
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
 #include "reprojection_tools.h"
 #include "rasterchunk.h"
 #include "utils.h"
 
 namespace librasterblaster {
-RasterChunk::RasterChunk(GDALDataset *ds, Area chunk_area) {
+RasterChunk::RasterChunk(GDALDataset *ds,
+                         Area chunk_area,
+                         int decimation_factor,
+                         bool tiled) {
   double gt[6];
 
   if (chunk_area.ul.x == -1.0) {  // Create a chunk with a single value for
@@ -34,8 +41,20 @@ RasterChunk::RasterChunk(GDALDataset *ds, Area chunk_area) {
               = chunk_area.lr.x
               = chunk_area.lr.y
               = 0.0;
+          decimation_factor = 1;
+  }
+
+  if (decimation_factor < 1) {
+    decimation_factor = 1;
   }
 
+  // Align the upper-left corner to the decimation grid so decimated pixels
+  // line up with the pixels of a matching overview.
+  chunk_area.ul.x = floor(chunk_area.ul.x / decimation_factor)
+      * decimation_factor;
+  chunk_area.ul.y = floor(chunk_area.ul.y / decimation_factor)
+      * decimation_factor;
+
   ds->GetGeoTransform(gt);
   ds->GetGeoTransform(geotransform);
 
@@ -44,21 +63,85 @@ RasterChunk::RasterChunk(GDALDataset *ds, Area chunk_area) {
   ul_projected_corner = Coordinate(gt[0]+(chunk_area.ul.x*gt[1]),
                                           gt[3]-(chunk_area.ul.y*gt[1]));
 
-  pixel_size = gt[1];
-  row_count = chunk_area.lr.y - chunk_area.ul.y + 1;
-  column_count = chunk_area.lr.x - chunk_area.ul.x + 1;
+  decimation = decimation_factor;
+  pixel_size = gt[1] * decimation;
+  geotransform[1] *= decimation;
+  geotransform[5] *= decimation;
+  row_count = (chunk_area.lr.y - chunk_area.ul.y + decimation) / decimation;
+  column_count = (chunk_area.lr.x - chunk_area.ul.x + decimation) / decimation;
   pixel_type = ds->GetRasterBand(1)->GetRasterDataType();
   band_count = ds->GetRasterCount();
 
-  size_t buffer_size = row_count * column_count;
-  pixels = static_cast<uint8_t*>
-      (calloc(buffer_size, GDALGetDataTypeSize(pixel_type)/8));
+  tile_width = 0;
+  tile_height = 0;
+  if (tiled && decimation == 1 && band_count == 1) {
+    int block_width, block_height;
+    ds->GetRasterBand(1)->GetBlockSize(&block_width, &block_height);
+
+    // Tiles must line up with the blocks of the dataset, a chunk that ends
+    // inside of a block, such as a row strip, is not tiled
+    const int64_t end_x = static_cast<int64_t>(chunk_area.lr.x) + 1;
+    const int64_t end_y = static_cast<int64_t>(chunk_area.lr.y) + 1;
+    if (static_cast<int64_t>(chunk_area.ul.x) % block_width == 0
+        && static_cast<int64_t>(chunk_area.ul.y) % block_height == 0
+        && (end_x % block_width == 0 || end_x >= ds->GetRasterXSize())
+        && (end_y % block_height == 0 || end_y >= ds->GetRasterYSize())) {
+      tile_width = block_width;
+      tile_height = block_height;
+    }
+  }
+
+  size_t buffer_size = static_cast<size_t>(row_count) * column_count
+      * band_count;
+  if (tile_width != 0) {
+    buffer_size = static_cast<size_t>((row_count + tile_height - 1)
+                                      / tile_height) * tile_height
+        * ((column_count + tile_width - 1) / tile_width) * tile_width
+        * band_count;
+  }
+  // Every pixel of the chunk is read or reprojected, so the buffer is only
+  // zeroed when it has padding that would otherwise be written out
+  // uninitialized.
+  const size_t buffer_bytes = buffer_size
+      * (GDALGetDataTypeSize(pixel_type)/8);
+  pixels = BufferPool::Global().Acquire(buffer_bytes);
 
   if (pixels == NULL) {
     fprintf(stderr, "Allocation error!\n");
+  } else if (tile_width != 0 && (row_count % tile_height != 0
+                                 || column_count % tile_width != 0)) {
+    memset(pixels, 0, buffer_bytes);
   }
 }
 
+RasterChunk::RasterChunk(RasterChunk &&s) : pixels(NULL) {
+  *this = std::move(s);
+}
+
+RasterChunk &RasterChunk::operator=(RasterChunk &&s) {
+  if (this == &s) {
+    return *this;
+  }
+
+  FreePixels();
+  projection = std::move(s.projection);
+  raster_location = s.raster_location;
+  ul_projected_corner = s.ul_projected_corner;
+  pixel_size = s.pixel_size;
+  row_count = s.row_count;
+  column_count = s.column_count;
+  pixel_type = s.pixel_type;
+  band_count = s.band_count;
+  decimation = s.decimation;
+  tile_width = s.tile_width;
+  tile_height = s.tile_height;
+  std::copy(s.geotransform, s.geotransform + 6, geotransform);
+  pixels = s.pixels;
+  s.pixels = NULL;
+
+  return *this;
+}
+
 bool RasterChunk::operator==(const RasterChunk &s) {
 
   // Maybe do some sort of normalization with the projections before
@@ -125,6 +208,169 @@ bool RasterChunk::operator>=(const RasterChunk &s) {
   return *this > s;
 }
 
+/** \cond DOXYHIDE **/
+// Reads a decimated chunk from an overview of ds whose size matches the
+// chunk's decimation factor. found is set to false, and nothing is read, if
+// ds has no such overview.
+static PRB_ERROR ReadOverview(RasterChunk *chunk, GDALDataset *ds, bool *found) {
+  const int overview_columns = (ds->GetRasterXSize() + chunk->decimation - 1)
+      / chunk->decimation;
+  const int overview_rows = (ds->GetRasterYSize() + chunk->decimation - 1)
+      / chunk->decimation;
+  const int64_t band_size = static_cast<int64_t>(chunk->row_count)
+      * chunk->column_count * (GDALGetDataTypeSize(chunk->pixel_type)/8);
+
+  *found = false;
+
+  int level = -1;
+  GDALRasterBand *first_band = ds->GetRasterBand(1);
+  for (int i = 0; i < first_band->GetOverviewCount(); ++i) {
+    GDALRasterBand *overview = first_band->GetOverview(i);
+    if (overview != NULL
+        && overview->GetXSize() == overview_columns
+        && overview->GetYSize() == overview_rows) {
+      level = i;
+      break;
+    }
+  }
+
+  if (level == -1) {
+    return PRB_NOERROR;
+  }
+
+  *found = true;
+
+  for (int band = 0; band < chunk->band_count; ++band) {
+    GDALRasterBand *overview = ds->GetRasterBand(band+1)->GetOverview(level);
+
+    if (overview == NULL) {
+      return PRB_IOERROR;
+    }
+
+    if (overview->RasterIO(GF_Read,
+                           chunk->raster_location.x / chunk->decimation,
+                           chunk->raster_location.y / chunk->decimation,
+                           chunk->column_count,
+                           chunk->row_count,
+                           static_cast<uint8_t*>(chunk->pixels)
+                           + band * band_size,
+                           chunk->column_count,
+                           chunk->row_count,
+                           chunk->pixel_type,
+                           0, 0) != CE_None) {
+      return PRB_IOERROR;
+    }
+  }
+
+  return PRB_NOERROR;
+}
+
+// Reads a decimated chunk by averaging each decimation x decimation block of
+// full resolution pixels. Only decimation rows of the full resolution window
+// are held in memory at a time.
+static PRB_ERROR ReadBoxFiltered(RasterChunk *chunk, GDALDataset *ds) {
+  const int decimation = chunk->decimation;
+  const int window_columns = std::min(
+      chunk->column_count * decimation,
+      ds->GetRasterXSize() - static_cast<int>(chunk->raster_location.x));
+  const int window_rows = std::min(
+      chunk->row_count * decimation,
+      ds->GetRasterYSize() - static_cast<int>(chunk->raster_location.y));
+  const int type_size = GDALGetDataTypeSize(chunk->pixel_type)/8;
+
+  std::vector<double> strip(static_cast<size_t>(window_columns) * decimation);
+  std::vector<double> means(chunk->column_count);
+
+  for (int band = 0; band < chunk->band_count; ++band) {
+    GDALRasterBand *raster_band = ds->GetRasterBand(band+1);
+    uint8_t *band_pixels = static_cast<uint8_t*>(chunk->pixels)
+        + static_cast<int64_t>(band) * chunk->row_count * chunk->column_count
+        * type_size;
+
+    for (int y = 0; y < chunk->row_count; ++y) {
+      const int strip_rows = std::min(decimation, window_rows - y * decimation);
+
+      if (raster_band->RasterIO(GF_Read,
+                                chunk->raster_location.x,
+                                chunk->raster_location.y + y * decimation,
+                                window_columns,
+                                strip_rows,
+                                &strip[0],
+                                window_columns,
+                                strip_rows,
+                                GDT_Float64,
+                                0, 0) != CE_None) {
+        return PRB_IOERROR;
+      }
+
+      for (int x = 0; x < chunk->column_count; ++x) {
+        const int first_column = x * decimation;
+        const int last_column = std::min(first_column + decimation,
+                                         window_columns);
+        double sum = 0.0;
+
+        for (int row = 0; row < strip_rows; ++row) {
+          const double *strip_row = &strip[static_cast<size_t>(row)
+                                           * window_columns];
+          for (int column = first_column; column < last_column; ++column) {
+            sum += strip_row[column];
+          }
+        }
+
+        means[x] = sum / ((last_column - first_column) * strip_rows);
+      }
+
+      GDALCopyWords(&means[0],
+                    GDT_Float64,
+                    sizeof(double),
+                    band_pixels + static_cast<int64_t>(y) * chunk->column_count
+                    * type_size,
+                    chunk->pixel_type,
+                    type_size,
+                    chunk->column_count);
+    }
+  }
+
+  return PRB_NOERROR;
+}
+
+// Reads or writes a tiled chunk one tile at a time. Pixels of the padded
+// edge tiles that are outside of the chunk are skipped.
+static PRB_ERROR TileIO(RasterChunk *chunk, GDALDataset *ds, GDALRWFlag flag) {
+  const int type_size = GDALGetDataTypeSize(chunk->pixel_type)/8;
+  const int64_t tile_bytes = static_cast<int64_t>(chunk->tile_width)
+      * chunk->tile_height * chunk->band_count * type_size;
+  uint8_t *tile = static_cast<uint8_t*>(chunk->pixels);
+
+  for (int y = 0; y < chunk->row_count; y += chunk->tile_height) {
+    for (int x = 0; x < chunk->column_count; x += chunk->tile_width) {
+      const int width = std::min(chunk->tile_width, chunk->column_count - x);
+      const int height = std::min(chunk->tile_height, chunk->row_count - y);
+
+      if (ds->RasterIO(flag,
+                       chunk->raster_location.x + x,
+                       chunk->raster_location.y + y,
+                       width,
+                       height,
+                       tile,
+                       width,
+                       height,
+                       chunk->pixel_type,
+                       chunk->band_count,
+                       NULL,
+                       type_size * chunk->band_count,
+                       type_size * chunk->band_count * chunk->tile_width,
+                       type_size) != CE_None) {
+        return PRB_IOERROR;
+      }
+      tile += tile_bytes;
+    }
+  }
+
+  return PRB_NOERROR;
+}
+/** \endcond **/
+
 PRB_ERROR RasterChunk::Read(GDALDataset *ds) {
   // Read area of raster
 
@@ -132,6 +378,21 @@ PRB_ERROR RasterChunk::Read(GDALDataset *ds) {
     return PRB_BADARG;
   }
 
+  if (decimation > 1) {
+    bool found = false;
+    PRB_ERROR err = ReadOverview(this, ds, &found);
+
+    if (err != PRB_NOERROR || found) {
+      return err;
+    }
+
+    return ReadBoxFiltered(this, ds);
+  }
+
+  if (tile_width != 0) {
+    return TileIO(this, ds, GF_Read);
+  }
+
   if (ds->RasterIO(GF_Read,
                    raster_location.x,
                    raster_location.y,
@@ -151,17 +412,25 @@ PRB_ERROR RasterChunk::Read(GDALDataset *ds) {
 }
 
 PRB_ERROR RasterChunk::Write(GDALDataset *ds) {
-  if (ds->RasterIO(GF_Write,
-                   raster_location.x,
-                   raster_location.y,
-                   column_count,
-                   row_count,
-                   pixels,
-                   column_count,
-                   row_count,
-                   pixel_type,
-                   band_count,
-                   NULL, 0, 0, 0) != CE_None) {
+  PRB_ERROR err = PRB_NOERROR;
+
+  if (tile_width != 0) {
+    err = TileIO(this, ds, GF_Write);
+  } else if (ds->RasterIO(GF_Write,
+                          raster_location.x,
+                          raster_location.y,
+                          column_count,
+                          row_count,
+                          pixels,
+                          column_count,
+                          row_count,
+                          pixel_type,
+                          band_count,
+                          NULL, 0, 0, 0) != CE_None) {
+    err = PRB_IOERROR;
+  }
+
+  if (err != PRB_NOERROR) {
     fprintf(stderr, "Error while writing RasterChunk %p\n", pixels);
     return PRB_IOERROR;
   }
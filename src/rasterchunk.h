@@ -21,6 +21,8 @@
 
 #include <string>
 #include <gdal_priv.h>
+#include "bufferpool.h"
+#include "rasterview.h"
 #include "utils.h"
 
 namespace librasterblaster {
@@ -30,6 +32,9 @@ class RasterChunk {
 
   RasterChunk() {
     pixels = NULL;
+    decimation = 1;
+    tile_width = 0;
+    tile_height = 0;
   }
   /**
    * @brief
@@ -37,26 +42,42 @@ class RasterChunk {
    *
    * @param ds Dataset to create chunk from
    * @param chunk_area The inclusive area that the chunk should represent.
+   * @param decimation_factor Number of dataset pixels, along each axis, that
+   *        one chunk pixel covers. Values greater than one create a reduced
+   *        resolution chunk, see RasterChunk::decimation.
+   * @param tiled If true, and the chunk is a full resolution, single band
+   *        chunk that starts and ends on block boundaries (or the edges)
+   *        of ds, the pixels are stored in the blocks of ds, see
+   *        RasterChunk::tile_width.
    *
    */
-  RasterChunk(GDALDataset *ds, Area chunk_area);
+  RasterChunk(GDALDataset *ds,
+              Area chunk_area,
+              int decimation_factor = 1,
+              bool tiled = false);
 
   /**
    * @brief
-   * Copy constructor
+   * Move constructor, takes the pixels of s. RasterChunks can't be copied.
    *
-   * @param s Source RasterChunk to be copied
+   * @param s Source RasterChunk, left without pixels
    */
-  RasterChunk(const RasterChunk &s);
+  RasterChunk(RasterChunk &&s);
+
+  /**
+   * @brief
+   * Move assignment, frees the pixels of this chunk and takes those of s.
+   *
+   * @param s Source RasterChunk, left without pixels
+   */
+  RasterChunk &operator=(RasterChunk &&s);
 
   /// RasterChunk destructor
   /**
    * This destructor frees the memory, if any, allocated at pixels_.
    */
   ~RasterChunk() {
-    if (this->pixels != NULL) {
-      free(this->pixels);
-    }
+    FreePixels();
   }
 
   /**
@@ -97,11 +118,58 @@ class RasterChunk {
   Coordinate ChunkToRaster(Coordinate chunk_coordinate);
   Coordinate RasterToChunk(Coordinate raster_coordinate);
 
+  /**
+   * @brief Returns the offset of chunk pixel (x, y) in the first band of
+   * pixels, counted in pixel values.
+   */
+  int64_t PixelIndex(int x, int y) const {
+    if (tile_width == 0) {
+      return x + static_cast<int64_t>(y) * column_count;
+    }
+
+    const int64_t tiles_across = (column_count + tile_width - 1) / tile_width;
+    const int64_t tile = (y / tile_height) * tiles_across + x / tile_width;
+
+    return tile * tile_width * tile_height
+        + static_cast<int64_t>(y % tile_height) * tile_width
+        + x % tile_width;
+  }
+
+  /**
+   * @brief Returns the distance, in pixels, between a pixel and the one
+   * below it, for pixels that are not on the last row of a tile.
+   */
+  int64_t RowStride() const {
+    return (tile_width == 0) ? column_count : tile_width;
+  }
+
+  /**
+   * @brief Returns a view of the column_count x row_count pixels of the
+   * first band whose upper-left pixel is chunk pixel (x, y). The pixels
+   * are shared with the chunk. In a tiled chunk the window must not cross
+   * the edge of a tile.
+   */
+  template <class T>
+  RasterView<T> Window(int x, int y, int column_count, int row_count) const {
+    return RasterView<T>(static_cast<T*>(pixels) + PixelIndex(x, y),
+                         column_count, row_count, RowStride());
+  }
+
+  /**
+   * @brief Returns a view of the whole first band of a row-major chunk, see
+   * Window().
+   */
+  template <class T>
+  RasterView<T> View() const {
+    return Window<T>(0, 0, column_count, row_count);
+  }
+
   std::string projection;
   /// Location of the chunk, in raster coordinates
   /** 
    * This variable represents the upper-left location of the raster chunk, in
-   * the raster coordinates.
+   * the raster coordinates. For decimated chunks this is still the
+   * location in the full resolution raster.
    */
   Coordinate raster_location;
   /// Upper-left corner, in projected coordinates
@@ -123,10 +191,51 @@ class RasterChunk {
   GDALDataType pixel_type;
   /// Number of bands
   int band_count;
+  /// Decimation factor
+  /**
+   * Each pixel of the chunk covers decimation x decimation pixels of the
+   * dataset it was created from. When greater than one, Read() takes the
+   * pixel values from a matching overview of the dataset if one exists and
+   * box filters the full resolution pixels otherwise. pixel_size and
+   * geotransform describe the decimated grid.
+   */
+  int decimation;
+  /// Width of the tiles the pixels are stored in, zero if row-major
+  /**
+   * Pixels are normally stored row by row, one band after the other. When
+   * tile_width is non-zero they are stored the way a tiled TIFF stores them:
+   * tile by tile, rows of tiles from the top, every tile tile_width x
+   * tile_height pixels with its rows stored one after the other and the
+   * bands interleaved by pixel. Tiles on the right and bottom edges are
+   * padded to full size, so each tile is one contiguous, file-ready block.
+   * Use PixelIndex() to find a pixel in either layout. Only single band
+   * chunks are created with tiles.
+   */
+  int tile_width;
+  /// Height of the tiles the pixels are stored in
+  int tile_height;
   /// GDAL geotransform
   double geotransform[6];
   /// Pointer to pixel values
+  /**
+   * The constructor takes the buffer from BufferPool::Global(), aligned to
+   * BufferPool::alignment bytes, and the destructor gives it back. A buffer
+   * allocated with malloc() may be assigned instead, it is freed.
+   */
   void *pixels;
+
+ private:
+  RasterChunk(const RasterChunk &);
+  RasterChunk &operator=(const RasterChunk &);
+
+  // Gives pixels back to the pool, or frees them
+  void FreePixels() {
+    // Buffers that were not allocated by the constructor are freed
+    if (pixels != NULL && !BufferPool::Global().Release(pixels)) {
+      free(pixels);
+    }
+    pixels = NULL;
+  }
 };
 }
 
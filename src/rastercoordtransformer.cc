@@ -81,9 +81,8 @@ void RasterCoordTransformer::init(string source_projection,
   free(source_wkt);
   free(dest_wkt);
 
-  if (t != NULL) {
-    ctrans = t;
-  } else {
+  ctrans = t;
+  if (ctrans == NULL) {
     printf("Could not create coordinate transformation!\n\n");
     return;
   }
@@ -101,6 +100,18 @@ void RasterCoordTransformer::init(string source_projection,
   return;
 }
 
+RasterCoordTransformer::~RasterCoordTransformer() {
+  OGRCoordinateTransformation *transformations[] = {
+    ctrans, src_to_geo, geo_to_src };
+
+  for (size_t i = 0; i < sizeof(transformations) / sizeof(*transformations);
+       ++i) {
+    if (transformations[i] != NULL) {
+      OCTDestroyCoordinateTransformation(transformations[i]);
+    }
+  }
+}
+
 Area RasterCoordTransformer::
 Transform(Coordinate source, int support, bool area_check) {
   Area value;
@@ -116,16 +127,7 @@ Transform(Coordinate source, int support, bool area_check) {
   value.ul = temp1;
   value.lr = temp1;
 
-  temp1.x = (source.x * source_pixel_size_) + source_ul_.x;
-  temp1.y = source_ul_.y - (source.y * source_pixel_size_);
-  temp2 = temp1;
-
-  src_to_geo->TransformEx(1, &temp2.x, &temp2.y, &unused);
-  geo_to_src->TransformEx(1, &temp2.x, &temp2.y, &unused);
-
-  // FIXME: epsilon
-  if ((area_check && (fabs(temp1.y - temp2.y) > 0.01))
-      || fabs(temp1.x - temp2.x) > 0.01) {
+  if (!ToGeographic(source, area_check, &temp2)) {
     // Point is outside defined projection area, return no-value
     value.ul.x = -1.0;
     value.lr.x = -1.0;
@@ -199,4 +201,62 @@ Transform(Coordinate source, int support, bool area_check) {
 
   return value;
 }
+
+bool RasterCoordTransformer::InProjectedArea(Coordinate source) {
+  Coordinate geographic;
+
+  return ToGeographic(source, true, &geographic);
+}
+
+bool RasterCoordTransformer::ToGeographic(Coordinate source,
+                                          bool area_check,
+                                          Coordinate *geographic) {
+  Coordinate projected, check;
+  double unused;
+
+  projected.x = (source.x * source_pixel_size_) + source_ul_.x;
+  projected.y = source_ul_.y - (source.y * source_pixel_size_);
+  *geographic = projected;
+
+  src_to_geo->TransformEx(1, &geographic->x, &geographic->y, &unused);
+  check = *geographic;
+  geo_to_src->TransformEx(1, &check.x, &check.y, &unused);
+
+  // FIXME: epsilon
+  if ((area_check && (fabs(projected.y - check.y) > 0.01))
+      || fabs(projected.x - check.x) > 0.01) {
+    return false;
+  }
+
+  return true;
+}
+
+Coordinate RasterCoordTransformer::TransformNearest(Coordinate source) {
+  Coordinate projected, geographic;
+  double unused;
+
+  if (!ToGeographic(source, true, &geographic)) {
+    // Point is outside defined projection area, return no-value
+    return Coordinate(-1.0, -1.0);
+  }
+
+  // Project the point the way Transform() projects the upper-left of its
+  // area, going through geographic coordinates could round differently
+  projected.x = (source.x * source_pixel_size_) + source_ul_.x;
+  projected.y = source_ul_.y - (source.y * source_pixel_size_);
+  ctrans->TransformEx(1, &projected.x, &projected.y, &unused);
+
+  // Convert to a point in the raster coordinate space
+  Coordinate value((projected.x - destination_ul_.x) / destination_pixel_size_,
+                   (destination_ul_.y - projected.y) / destination_pixel_size_);
+
+  if (value.x < 0.0 || value.y < 0.0) {
+    return Coordinate(-1.0, -1.0);
+  }
+
+  value.x = floor(fabs(value.x));
+  value.y = floor(fabs(value.y));
+
+  return value;
+}
 }
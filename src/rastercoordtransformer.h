@@ -53,6 +53,15 @@ class RasterCoordTransformer {
                          Coordinate destination_ul,
                          double destination_pixel_size);
 
+  /*
+
+    The destructor releases the coordinate transformations. The OGR
+    transformations are not thread-safe, so each thread that
+    transforms coordinates needs its own RasterCoordTransformer.
+
+  */
+  ~RasterCoordTransformer();
+
   /*
 
     This function takes a coordinate in the source raster space
@@ -66,7 +75,41 @@ class RasterCoordTransformer {
   */
   Area Transform(Coordinate source, int support = 0, bool area_check = true);
 
+  /*
+
+    This function maps a coordinate in the source raster space to the
+    pixel of the destination raster space that contains it, for
+    nearest-neighbor sampling. It samples the same point as
+    Transform(), performs the same validity check and projects the
+    point with the same transformation, so it returns the upper-left
+    of Transform()'s area, but only the point itself is projected,
+    which takes half of the PROJ calls. Returns (-1, -1) if the point
+    is outside of the projected area.
+
+    \param source a Coordinate struct that specifies the point in the source raster space to map to the destination raster space.
+  */
+  Coordinate TransformNearest(Coordinate source);
+
+  /*
+
+    This function returns true if the coordinate in the source raster
+    space is inside of the projected area, the same check Transform()
+    and TransformNearest() start with. It takes two PROJ calls.
+
+    \param source a Coordinate struct that specifies the point in the source raster space.
+  */
+  bool InProjectedArea(Coordinate source);
+
  private:
+  // Copies would share and double-free the transformations
+  RasterCoordTransformer(const RasterCoordTransformer &);
+  RasterCoordTransformer &operator=(const RasterCoordTransformer &);
+
+  // Maps source to geographic coordinates. Returns false if mapping the
+  // result back doesn't give source, i.e. source is outside of the
+  // projected area.
+  bool ToGeographic(Coordinate source, bool area_check, Coordinate *geographic);
+
   void init(string source_projection,
             Coordinate source_ul,
             double source_pixel_size,
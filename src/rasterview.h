@@ -0,0 +1,104 @@
+//
+// Copyright 0000 <Nobody>
+// @file
+// @author David Matthew Mattli <dmattli@usgs.gov>
+//
+// @section LICENSE
+//
+// This software is in the public domain, furnished "as is", without
+// technical support, and with no warranty, express or implied, as to
+// its usefulness for any purpose.
+//
+// @section DESCRIPTION
+//
+// A typed, non-owning view of a rectangle of pixels in memory.
+//
+//
+
+#ifndef SRC_RASTERVIEW_H_
+#define SRC_RASTERVIEW_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace librasterblaster {
+/// Raster view class
+/**
+ * A RasterView refers to column_count x row_count pixels of type T whose
+ * rows are row_stride pixels apart, such as a RasterChunk, a block of one
+ * or a tile of a tiled chunk. It does not own the pixels, so views are
+ * cheap to copy and a sub-window of a view shares its pixels. A
+ * RasterView<T> converts to a RasterView<const T>.
+ */
+template <class T>
+class RasterView {
+ public:
+  RasterView() : data_(NULL), column_count_(0), row_count_(0),
+                 row_stride_(0) {
+  }
+
+  /**
+   * @brief Constructor
+   *
+   * @param data Location of the upper-left pixel
+   * @param column_count Number of columns
+   * @param row_count Number of rows
+   * @param row_stride Number of pixels from the start of one row to the
+   * start of the next
+   */
+  RasterView(T *data, int column_count, int row_count, int64_t row_stride)
+      : data_(data), column_count_(column_count), row_count_(row_count),
+        row_stride_(row_stride) {
+  }
+
+  /** @cond DOXYHIDE */
+  template <class U>
+  RasterView(const RasterView<U>& view)  // NOLINT
+      : data_(view.data()), column_count_(view.column_count()),
+        row_count_(view.row_count()), row_stride_(view.row_stride()) {
+  }
+  /** @endcond */
+
+  /**
+   * @brief Returns the pixel in column x of row y
+   */
+  T& operator()(int x, int y) const {
+    return data_[x + static_cast<int64_t>(y) * row_stride_];
+  }
+
+  /**
+   * @brief Returns the first pixel of row y, the pixels of a row are
+   * contiguous.
+   */
+  T *Row(int y) const {
+    return data_ + static_cast<int64_t>(y) * row_stride_;
+  }
+
+  /**
+   * @brief Returns the view of the column_count x row_count pixels whose
+   * upper-left pixel is (x, y) in this view. The window must lie within
+   * this view.
+   */
+  RasterView<T> Window(int x, int y, int column_count, int row_count) const {
+    return RasterView<T>(&(*this)(x, y), column_count, row_count,
+                         row_stride_);
+  }
+
+  /// Location of the upper-left pixel
+  T *data() const { return data_; }
+  /// Number of columns
+  int column_count() const { return column_count_; }
+  /// Number of rows
+  int row_count() const { return row_count_; }
+  /// Number of pixels between the starts of two rows
+  int64_t row_stride() const { return row_stride_; }
+
+ private:
+  T *data_;
+  int column_count_;
+  int row_count_;
+  int64_t row_stride_;
+};
+}
+
+#endif  // SRC_RASTERVIEW_H_
@@ -22,8 +22,13 @@
 #include <gdal.h>
 #include <gdal_priv.h>
 #include <tiffio.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <utility>
 #include <vector>
 #include <ctime>
 #include <cstdlib>
@@ -33,15 +38,17 @@
 #include "reprojection_tools.h"
 #include "rastercoordtransformer.h"
 #include "resampler.h"
+#include "threadpool.h"
 #include "utils.h"
 
 namespace librasterblaster {
-PRB_ERROR CreateOutputRaster(GDALDataset *in,
-                             string output_filename,
-                             string output_srs,
-                             int output_tile_size,
-                             double output_ratio,
-                             double output_no_data_value) {
+PRB_ERROR OutputRasterGeometry(GDALDataset *in,
+                               string output_srs,
+                               double output_ratio,
+                               int64_t *output_columns,
+                               int64_t *output_rows,
+                               double *output_pixel_size,
+                               Area *output_projected_area) {
   OGRSpatialReference in_srs;
   OGRSpatialReference out_srs;
   OGRErr err;
@@ -80,23 +87,49 @@ PRB_ERROR CreateOutputRaster(GDALDataset *in,
   // Use this distance to compute a pixel size
   const double in_x_size = in->GetRasterBand(1)->GetXSize();
   const double in_y_size = in->GetRasterBand(1)->GetYSize();
-  const double output_pixel_size = output_ratio * diagonal_dist
+  const double pixel_size = output_ratio * diagonal_dist
       / sqrt(in_x_size * in_x_size + in_y_size * in_y_size);
 
-  const int64_t num_cols = static_cast<int64_t>(
-      0.5 + ((out_area.lr.x - out_area.ul.x) / output_pixel_size));
-  const int64_t num_rows = static_cast<int64_t>(
-      0.5 + ((out_area.ul.y - out_area.lr.y) / output_pixel_size));
+  *output_columns = static_cast<int64_t>(
+      0.5 + ((out_area.lr.x - out_area.ul.x) / pixel_size));
+  *output_rows = static_cast<int64_t>(
+      0.5 + ((out_area.ul.y - out_area.lr.y) / pixel_size));
+  *output_pixel_size = pixel_size;
+  *output_projected_area = out_area;
 
-  PRB_ERROR result = CreateOutputRasterFile(in,
-                                            output_filename,
-                                            output_srs,
-                                            num_cols,
-                                            num_rows,
-                                            output_pixel_size,
-                                            out_area,
-                                            output_tile_size,
-                                            output_no_data_value);
+  return PRB_NOERROR;
+}
+
+PRB_ERROR CreateOutputRaster(GDALDataset *in,
+                             string output_filename,
+                             string output_srs,
+                             int output_tile_size,
+                             double output_ratio,
+                             double output_no_data_value) {
+  int64_t num_cols = 0;
+  int64_t num_rows = 0;
+  double output_pixel_size = 0.0;
+  Area out_area;
+  PRB_ERROR result = OutputRasterGeometry(in,
+                                          output_srs,
+                                          output_ratio,
+                                          &num_cols,
+                                          &num_rows,
+                                          &output_pixel_size,
+                                          &out_area);
+  if (result != PRB_NOERROR) {
+    return result;
+  }
+
+  result = CreateOutputRasterFile(in,
+                                  output_filename,
+                                  output_srs,
+                                  num_cols,
+                                  num_rows,
+                                  output_pixel_size,
+                                  out_area,
+                                  output_tile_size,
+                                  output_no_data_value);
   return result;
 }
 
@@ -276,10 +309,8 @@ std::vector<Area> BlockPartition(int rank,
     }
   }
 
-  // Now we shuffle the partitions for load balancing.
-  // All processes should generate the same shuffle.
-  std::srand(42);
-
+  // Partitions are dealt round-robin, see AssignPartitions for an
+  // assignment that balances their cost
   std::vector<Area> partitions;
   for (size_t i = 0; i < blocks.size(); ++i) {
     if (i % process_count == (size_t) rank) {
@@ -601,6 +632,557 @@ Area RasterMinbox2(string source_projection,
   return source_area;
 }
 
+int DecimationFactor(Area input_area, Area output_area, RESAMPLER resampler) {
+  if (resampler != MEAN
+      && resampler != BILINEAR
+      && resampler != BICUBIC
+      && resampler != LANCZOS
+      && resampler != AUTO) {
+    return 1;
+  }
+
+  // Fully out of the projected space, see RasterMinbox2
+  if (input_area.ul.x == -1.0) {
+    return 1;
+  }
+
+  const double x_scale = (input_area.lr.x - input_area.ul.x + 1)
+      / (output_area.lr.x - output_area.ul.x + 1);
+  const double y_scale = (input_area.lr.y - input_area.ul.y + 1)
+      / (output_area.lr.y - output_area.ul.y + 1);
+  const double scale = std::min(x_scale, y_scale);
+
+  int factor = 1;
+  while (factor * 2 <= scale) {
+    factor *= 2;
+  }
+
+  return factor;
+}
+
+// Returns whether footprint, the footprint of an output pixel returned by
+// RasterCoordTransformer::Transform, overlaps the input raster
+static bool FootprintOnInput(const Area& footprint, const RasterChunk& input) {
+  return footprint.ul.x != -1.0
+      && footprint.lr.x >= 0.0 && footprint.ul.x < input.column_count
+      && footprint.lr.y >= 0.0 && footprint.ul.y < input.row_count;
+}
+
+// Estimates the minbox of partition in the input raster from a grid of
+// pixels, see PartitionMemory(). If valid_fraction isn't NULL it receives
+// the fraction of the grid that falls on the input raster.
+static Area EstimateRasterMinbox(RasterCoordTransformer& rt,
+                                 const RasterChunk& input,
+                                 Area partition,
+                                 double *valid_fraction = NULL) {
+  const int grid_steps = 32;
+  const double width = partition.lr.x - partition.ul.x;
+  const double height = partition.lr.y - partition.ul.y;
+  const int x_steps = std::min<double>(grid_steps, width);
+  const int y_steps = std::min<double>(grid_steps, height);
+
+  Area minbox(DBL_MAX, DBL_MAX, -DBL_MAX, -DBL_MAX);
+  int valid = 0;
+  for (int j = 0; j <= y_steps; ++j) {
+    for (int i = 0; i <= x_steps; ++i) {
+      const Coordinate pixel(
+          floor(partition.ul.x + (x_steps ? width * i / x_steps : 0.0)),
+          floor(partition.ul.y + (y_steps ? height * j / y_steps : 0.0)));
+      const Area footprint = rt.Transform(pixel);
+      if (footprint.ul.x == -1.0) {
+        continue;
+      }
+      if (FootprintOnInput(footprint, input)) {
+        ++valid;
+      }
+
+      minbox.ul.x = std::min(minbox.ul.x, footprint.ul.x);
+      minbox.ul.y = std::min(minbox.ul.y, footprint.ul.y);
+      minbox.lr.x = std::max(minbox.lr.x, footprint.lr.x);
+      minbox.lr.y = std::max(minbox.lr.y, footprint.lr.y);
+    }
+  }
+
+  if (valid_fraction != NULL) {
+    *valid_fraction = static_cast<double>(valid)
+        / ((x_steps + 1) * (y_steps + 1));
+  }
+
+  if (minbox.ul.x == DBL_MAX) {
+    return Area(-1.0, -1.0, -1.0, -1.0);
+  }
+
+  // Pixels between the grid points can reach a little further
+  const double x_margin = (minbox.lr.x - minbox.ul.x) / (x_steps + 1);
+  const double y_margin = (minbox.lr.y - minbox.ul.y) / (y_steps + 1);
+  minbox.ul.x = std::max(0.0, floor(minbox.ul.x - x_margin));
+  minbox.ul.y = std::max(0.0, floor(minbox.ul.y - y_margin));
+  minbox.lr.x = std::min(input.column_count - 1.0,
+                         ceil(minbox.lr.x + x_margin));
+  minbox.lr.y = std::min(input.row_count - 1.0,
+                         ceil(minbox.lr.y + y_margin));
+
+  return minbox;
+}
+
+static int64_t PartitionMemory(RasterCoordTransformer& rt,
+                               const RasterChunk& input,
+                               const RasterChunk& output,
+                               Area partition,
+                               RESAMPLER resampler,
+                               bool decimate_input) {
+  int64_t output_columns = partition.lr.x - partition.ul.x + 1;
+  int64_t output_rows = partition.lr.y - partition.ul.y + 1;
+  if (output.tile_width != 0) {
+    output_columns = (output_columns + output.tile_width - 1)
+        / output.tile_width * output.tile_width;
+    output_rows = (output_rows + output.tile_height - 1)
+        / output.tile_height * output.tile_height;
+  }
+  const int64_t output_bytes = output_columns * output_rows
+      * output.band_count * (GDALGetDataTypeSize(output.pixel_type) / 8);
+
+  const Area minbox = EstimateRasterMinbox(rt, input, partition);
+  if (minbox.ul.x == -1.0) {
+    return output_bytes;
+  }
+
+  const int decimation = decimate_input
+      ? DecimationFactor(minbox, partition, resampler) : 1;
+  const int64_t input_columns =
+      (minbox.lr.x - minbox.ul.x + decimation) / decimation;
+  const int64_t input_rows =
+      (minbox.lr.y - minbox.ul.y + decimation) / decimation;
+
+  return output_bytes + input_columns * input_rows * input.band_count
+      * (GDALGetDataTypeSize(input.pixel_type) / 8);
+}
+
+int64_t PartitionMemory(const RasterChunk& input,
+                        const RasterChunk& output,
+                        Area partition,
+                        RESAMPLER resampler,
+                        bool decimate_input) {
+  RasterCoordTransformer rt(output.projection,
+                            output.ul_projected_corner,
+                            output.pixel_size,
+                            output.row_count,
+                            output.column_count,
+                            input.projection,
+                            input.ul_projected_corner,
+                            input.pixel_size);
+
+  return PartitionMemory(rt, input, output, partition, resampler,
+                         decimate_input);
+}
+
+// Appends partition, or the pieces it is split into, to planned. Pieces
+// that still don't fit are counted in oversized.
+static void SplitPartition(RasterCoordTransformer& rt,
+                           const RasterChunk& input,
+                           const RasterChunk& output,
+                           Area partition,
+                           RESAMPLER resampler,
+                           bool decimate_input,
+                           int64_t partition_memory,
+                           bool whole_tiles,
+                           std::vector<Area> *planned,
+                           int *oversized) {
+  const int64_t bytes = PartitionMemory(rt, input, output, partition,
+                                        resampler, decimate_input);
+  if (bytes <= partition_memory) {
+    planned->push_back(partition);
+    return;
+  }
+
+  const int tile_width = std::max(output.tile_width, 1);
+  const int tile_height = std::max(output.tile_height, 1);
+  const int64_t tiles_across =
+      (partition.lr.x - partition.ul.x + tile_width) / tile_width;
+  const int64_t tiles_down =
+      (partition.lr.y - partition.ul.y + tile_height) / tile_height;
+  const int64_t rows = partition.lr.y - partition.ul.y + 1;
+
+  Area first = partition;
+  Area second = partition;
+  if (tiles_across > 1 && tiles_across >= tiles_down) {
+    first.lr.x = partition.ul.x + tiles_across / 2 * tile_width - 1;
+    second.ul.x = first.lr.x + 1;
+  } else if (tiles_down > 1) {
+    first.lr.y = partition.ul.y + tiles_down / 2 * tile_height - 1;
+    second.ul.y = first.lr.y + 1;
+  } else if (rows > 1 && !whole_tiles) {
+    // A single tile, stream it in row strips
+    first.lr.y = partition.ul.y + rows / 2 - 1;
+    second.ul.y = first.lr.y + 1;
+  } else {
+    // A single row of a tile, or a tile that must stay whole, can't be
+    // split any further
+    ++*oversized;
+    planned->push_back(partition);
+    return;
+  }
+
+  SplitPartition(rt, input, output, first, resampler, decimate_input,
+                 partition_memory, whole_tiles, planned, oversized);
+  SplitPartition(rt, input, output, second, resampler, decimate_input,
+                 partition_memory, whole_tiles, planned, oversized);
+}
+
+std::vector<Area> PlanPartitions(const RasterChunk& input,
+                                 const RasterChunk& output,
+                                 const std::vector<Area>& partitions,
+                                 RESAMPLER resampler,
+                                 bool decimate_input,
+                                 int64_t partition_memory,
+                                 bool whole_tiles) {
+  if (partition_memory < 1) {
+    return partitions;
+  }
+
+  RasterCoordTransformer rt(output.projection,
+                            output.ul_projected_corner,
+                            output.pixel_size,
+                            output.row_count,
+                            output.column_count,
+                            input.projection,
+                            input.ul_projected_corner,
+                            input.pixel_size);
+  std::vector<Area> planned;
+  int oversized = 0;
+
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    SplitPartition(rt, input, output, partitions[i], resampler,
+                   decimate_input, partition_memory, whole_tiles, &planned,
+                   &oversized);
+  }
+
+  if (oversized > 0) {
+    fprintf(stderr, "%d partitions that can't be split need more than %lld "
+            "bytes\n", oversized, static_cast<long long>(partition_memory));
+  }
+
+  return planned;
+}
+
+static double PartitionCost(RasterCoordTransformer& rt,
+                            const RasterChunk& input,
+                            Area partition,
+                            RESAMPLER resampler,
+                            bool decimate_input) {
+  // Every output pixel is at least filled and written, valid pixels are
+  // also transformed and resampled
+  const double fill_cost = 0.1;
+  const double output_pixels = (partition.lr.x - partition.ul.x + 1.0)
+      * (partition.lr.y - partition.ul.y + 1.0);
+
+  double valid_fraction = 0.0;
+  const Area minbox = EstimateRasterMinbox(rt, input, partition,
+                                           &valid_fraction);
+  if (minbox.ul.x == -1.0) {
+    return output_pixels * fill_cost;
+  }
+
+  const int decimation = decimate_input
+      ? DecimationFactor(minbox, partition, resampler) : 1;
+  const double input_pixels =
+      floor((minbox.lr.x - minbox.ul.x + decimation) / decimation)
+      * floor((minbox.lr.y - minbox.ul.y + decimation) / decimation);
+
+  return output_pixels * (fill_cost + valid_fraction) + input_pixels;
+}
+
+double PartitionCost(const RasterChunk& input,
+                     const RasterChunk& output,
+                     Area partition,
+                     RESAMPLER resampler,
+                     bool decimate_input) {
+  RasterCoordTransformer rt(output.projection,
+                            output.ul_projected_corner,
+                            output.pixel_size,
+                            output.row_count,
+                            output.column_count,
+                            input.projection,
+                            input.ul_projected_corner,
+                            input.pixel_size);
+
+  return PartitionCost(rt, input, partition, resampler, decimate_input);
+}
+
+std::vector<double> PartitionCosts(const RasterChunk& input,
+                                   const RasterChunk& output,
+                                   const std::vector<Area>& partitions,
+                                   RESAMPLER resampler,
+                                   bool decimate_input) {
+  RasterCoordTransformer rt(output.projection,
+                            output.ul_projected_corner,
+                            output.pixel_size,
+                            output.row_count,
+                            output.column_count,
+                            input.projection,
+                            input.ul_projected_corner,
+                            input.pixel_size);
+  std::vector<double> costs(partitions.size());
+
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    costs[i] = PartitionCost(rt, input, partitions[i], resampler,
+                             decimate_input);
+  }
+
+  return costs;
+}
+
+std::vector<Area> AssignPartitions(const std::vector<Area>& partitions,
+                                   const std::vector<double>& costs,
+                                   int rank,
+                                   int process_count,
+                                   double *rank_cost) {
+  // Most expensive first, ties in partition order so that every process
+  // makes the same assignment
+  std::vector<size_t> order(partitions.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&costs](size_t a, size_t b) {
+                     return costs[a] > costs[b];
+                   });
+
+  // Each partition goes to the least loaded process, the lowest rank of
+  // those equally loaded
+  typedef std::pair<double, int> Load;
+  std::priority_queue<Load, std::vector<Load>, std::greater<Load> > loads;
+  for (int i = 0; i < process_count; ++i) {
+    loads.push(Load(0.0, i));
+  }
+
+  std::vector<bool> mine(partitions.size(), false);
+  for (size_t i = 0; i < order.size(); ++i) {
+    Load load = loads.top();
+    loads.pop();
+    mine[order[i]] = (load.second == rank);
+    load.first += costs[order[i]];
+    loads.push(load);
+  }
+
+  if (rank_cost != NULL) {
+    *rank_cost = 0.0;
+  }
+
+  // Keep the partitions of this process in their original order
+  std::vector<Area> assigned;
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    if (mine[i]) {
+      assigned.push_back(partitions[i]);
+      if (rank_cost != NULL) {
+        *rank_cost += costs[i];
+      }
+    }
+  }
+
+  return assigned;
+}
+
+// Returns whether no pixel of partition falls on the input raster. The
+// edges and the grid of EstimateRasterMinbox() find most partitions that
+// touch the input quickly, the others are only reported outside once every
+// pixel has been checked, so no island of the input is missed.
+static bool PartitionOutsideInput(RasterCoordTransformer& rt,
+                                  const RasterChunk& input,
+                                  Area partition) {
+  const int64_t ul_x = partition.ul.x;
+  const int64_t ul_y = partition.ul.y;
+  const int64_t lr_x = partition.lr.x;
+  const int64_t lr_y = partition.lr.y;
+
+  for (int64_t x = ul_x; x <= lr_x; ++x) {
+    if (FootprintOnInput(rt.Transform(Coordinate(x, ul_y)), input)
+        || FootprintOnInput(rt.Transform(Coordinate(x, lr_y)), input)) {
+      return false;
+    }
+  }
+  for (int64_t y = ul_y + 1; y < lr_y; ++y) {
+    if (FootprintOnInput(rt.Transform(Coordinate(ul_x, y)), input)
+        || FootprintOnInput(rt.Transform(Coordinate(lr_x, y)), input)) {
+      return false;
+    }
+  }
+
+  double valid_fraction = 0.0;
+  EstimateRasterMinbox(rt, input, partition, &valid_fraction);
+  if (valid_fraction > 0.0) {
+    return false;
+  }
+
+  for (int64_t y = ul_y + 1; y < lr_y; ++y) {
+    for (int64_t x = ul_x + 1; x < lr_x; ++x) {
+      if (FootprintOnInput(rt.Transform(Coordinate(x, y)), input)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+std::vector<bool> PartitionsOutsideInput(const RasterChunk& input,
+                                         const RasterChunk& output,
+                                         const std::vector<Area>& partitions) {
+  RasterCoordTransformer rt(output.projection,
+                            output.ul_projected_corner,
+                            output.pixel_size,
+                            output.row_count,
+                            output.column_count,
+                            input.projection,
+                            input.ul_projected_corner,
+                            input.pixel_size);
+  std::vector<bool> outside(partitions.size());
+
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    outside[i] = PartitionOutsideInput(rt, input, partitions[i]);
+  }
+
+  return outside;
+}
+
+uint64_t HilbertIndex(uint32_t x, uint32_t y) {
+  uint64_t index = 0;
+
+  for (uint32_t side = 1u << 31; side > 0; side >>= 1) {
+    const uint32_t rx = (x & side) ? 1 : 0;
+    const uint32_t ry = (y & side) ? 1 : 0;
+    index += static_cast<uint64_t>(side) * side * ((3 * rx) ^ ry);
+
+    // Rotate the quadrant so that the curve inside it starts and ends next
+    // to its neighbours
+    if (ry == 0) {
+      if (rx == 1) {
+        x = ~x;
+        y = ~y;
+      }
+      std::swap(x, y);
+    }
+  }
+
+  return index;
+}
+
+std::vector<size_t> HilbertOrder(const std::vector<Area>& partitions) {
+  std::vector<uint64_t> keys(partitions.size());
+  std::vector<size_t> order(partitions.size());
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    const Area& p = partitions[i];
+    keys[i] = HilbertIndex(static_cast<uint32_t>((p.ul.x + p.lr.x) / 2),
+                           static_cast<uint32_t>((p.ul.y + p.lr.y) / 2));
+    order[i] = i;
+  }
+
+  std::stable_sort(order.begin(), order.end(),
+                   [&keys](size_t a, size_t b) {
+                     return keys[a] < keys[b];
+                   });
+
+  return order;
+}
+
+std::vector<Area> AssignPartitionRanges(const std::vector<Area>& partitions,
+                                        const std::vector<double>& costs,
+                                        int rank,
+                                        int process_count,
+                                        double *rank_cost) {
+  double total = 0.0;
+  for (size_t i = 0; i < costs.size(); ++i) {
+    total += costs[i];
+  }
+
+  if (rank_cost != NULL) {
+    *rank_cost = 0.0;
+  }
+
+  // Without costs the partitions are cut into ranges of equal length
+  std::vector<Area> assigned;
+  double before = 0.0;
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    const double middle = (total > 0.0)
+        ? (before + costs[i] / 2) / total
+        : (i + 0.5) / partitions.size();
+    const int owner = std::min<int>(middle * process_count,
+                                    process_count - 1);
+    before += costs[i];
+
+    if (owner == rank) {
+      assigned.push_back(partitions[i]);
+      if (rank_cost != NULL) {
+        *rank_cost += costs[i];
+      }
+    }
+  }
+
+  return assigned;
+}
+
+// Fills the metadata of chunk that describes the whole of dataset, without
+// allocating its pixels
+static void DescribeRaster(GDALDataset *dataset, RasterChunk *chunk) {
+  double gt[6];
+  dataset->GetGeoTransform(gt);
+
+  chunk->projection = dataset->GetProjectionRef();
+  chunk->ul_projected_corner = Coordinate(gt[0], gt[3]);
+  chunk->pixel_size = gt[1];
+  chunk->row_count = dataset->GetRasterYSize();
+  chunk->column_count = dataset->GetRasterXSize();
+  chunk->pixel_type = dataset->GetRasterBand(1)->GetRasterDataType();
+  chunk->band_count = dataset->GetRasterCount();
+  if (chunk->band_count == 1) {
+    dataset->GetRasterBand(1)->GetBlockSize(&chunk->tile_width,
+                                            &chunk->tile_height);
+  }
+}
+
+std::vector<Area> PlanPartitions(GDALDataset *input,
+                                 GDALDataset *output,
+                                 const std::vector<Area>& partitions,
+                                 RESAMPLER resampler,
+                                 bool decimate_input,
+                                 int64_t partition_memory,
+                                 bool whole_tiles) {
+  RasterChunk input_description;
+  RasterChunk output_description;
+  DescribeRaster(input, &input_description);
+  DescribeRaster(output, &output_description);
+
+  return PlanPartitions(input_description, output_description, partitions,
+                        resampler, decimate_input, partition_memory,
+                        whole_tiles);
+}
+
+std::vector<double> PartitionCosts(GDALDataset *input,
+                                   GDALDataset *output,
+                                   const std::vector<Area>& partitions,
+                                   RESAMPLER resampler,
+                                   bool decimate_input) {
+  RasterChunk input_description;
+  RasterChunk output_description;
+  DescribeRaster(input, &input_description);
+  DescribeRaster(output, &output_description);
+
+  return PartitionCosts(input_description, output_description, partitions,
+                        resampler, decimate_input);
+}
+
+std::vector<bool> PartitionsOutsideInput(GDALDataset *input,
+                                         GDALDataset *output,
+                                         const std::vector<Area>& partitions) {
+  RasterChunk input_description;
+  RasterChunk output_description;
+  DescribeRaster(input, &input_description);
+  DescribeRaster(output, &output_description);
+
+  return PartitionsOutsideInput(input_description, output_description,
+                                partitions);
+}
+
 /**
  * \brief This function takes two RasterChunk pointers and performs
  *        reprojection and resampling
@@ -608,13 +1190,18 @@ Area RasterMinbox2(string source_projection,
  * \param destination Pointer to the RasterChunk to reproject to
  * \param fillvalue std::string with the fillvalue
  * \param resampler The resampler that should be used
+ * \param resampler_log File the per-block resampler choices of AUTO are
+ *        written to, or NULL
  *
  * @return Returns a bool indicating success or failure.
  */
 bool ReprojectChunk(RasterChunk& source,
     RasterChunk& destination,
     string fillvalue,
-    RESAMPLER resampler) {
+    RESAMPLER resampler,
+    FILE *resampler_log,
+    ThreadPool *pool,
+    BLOCK_ORDER order) {
   if (source.pixel_type != destination.pixel_type) {
     fprintf(stderr, "Source and destination chunks have different types!\n");
     return false;
@@ -623,30 +1210,35 @@ bool ReprojectChunk(RasterChunk& source,
   // FIXME: proper conversion to pixel type
   double fvalue = strtod(fillvalue.c_str(), NULL);
 
-  int support = 0;
-
-  switch (resampler) {
-    case BILINEAR: support = 1; break;
-    case BICUBIC: support = 2; break;
-    case LANCZOS: support = 3; break;
-    default: break;
-  }
-
   switch (source.pixel_type) {
     case GDT_Byte:
-      return ReprojectChunkType<uint8_t>(source, destination, fvalue, GetResampler<uint8_t>(resampler), support);
+      return ReprojectChunkType<uint8_t>(source, destination, fvalue,
+                                         resampler, resampler_log, pool,
+                                         order);
     case GDT_UInt16:
-      return ReprojectChunkType<uint16_t>(source, destination, fvalue, GetResampler<uint16_t>(resampler), support);
+      return ReprojectChunkType<uint16_t>(source, destination, fvalue,
+                                          resampler, resampler_log, pool,
+                                          order);
     case GDT_Int16:
-      return ReprojectChunkType<int16_t>(source, destination, fvalue, GetResampler<int16_t>(resampler), support);
+      return ReprojectChunkType<int16_t>(source, destination, fvalue,
+                                         resampler, resampler_log, pool,
+                                         order);
     case GDT_UInt32:
-      return ReprojectChunkType<uint32_t>(source, destination, fvalue, GetResampler<uint32_t>(resampler), support);
+      return ReprojectChunkType<uint32_t>(source, destination, fvalue,
+                                          resampler, resampler_log, pool,
+                                          order);
     case GDT_Int32:
-      return ReprojectChunkType<int32_t>(source, destination, fvalue, GetResampler<int32_t>(resampler), support);
+      return ReprojectChunkType<int32_t>(source, destination, fvalue,
+                                         resampler, resampler_log, pool,
+                                         order);
     case GDT_Float32:
-      return ReprojectChunkType<float>(source, destination, fvalue, GetResampler<float>(resampler), support);
+      return ReprojectChunkType<float>(source, destination, fvalue,
+                                       resampler, resampler_log, pool,
+                                       order);
     case GDT_Float64:
-      return ReprojectChunkType<double>(source, destination, fvalue, GetResampler<double>(resampler), support);
+      return ReprojectChunkType<double>(source, destination, fvalue,
+                                        resampler, resampler_log, pool,
+                                        order);
     case GDT_CInt16:
     case GDT_CInt32:
     case GDT_CFloat32:
@@ -657,6 +1249,20 @@ bool ReprojectChunk(RasterChunk& source,
   }
 }
 
+const char *ResamplerName(RESAMPLER resampler) {
+  switch (resampler) {
+    case NEAREST: return "nearest";
+    case MIN: return "min";
+    case MAX: return "max";
+    case MEAN: return "mean";
+    case BILINEAR: return "bilinear";
+    case BICUBIC: return "bicubic";
+    case LANCZOS: return "lanczos";
+    case AUTO: return "auto";
+    default: return "unknown";
+  }
+}
+
 template <typename pixelType>
 std::function<pixelType(RasterChunk&, Area, float)> GetResampler(RESAMPLER type) {
   switch (type) {
@@ -680,98 +1286,664 @@ std::function<pixelType(RasterChunk&, Area, float)> GetResampler(RESAMPLER type)
   }
 }
 
-template <class pixelType>
-bool ReprojectChunkType(RasterChunk& source,
-                        RasterChunk& destination,
-                        pixelType fill_value,
-                        std::function<pixelType(RasterChunk&, Area, float)> resampler,
-                        int filter_support) {
-  Coordinate temp1, temp2;
-  Area pixelArea;
+template <typename pixelType>
+BlockResampler<pixelType> GetBlockResampler(RESAMPLER type) {
+  switch (type) {
+    case MIN:
+      return &BlockMin<pixelType>;
+    case MAX:
+      return &BlockMax<pixelType>;
+    case MEAN:
+      return &BlockMean<pixelType>;
+    case BILINEAR:
+      return &BlockBilinear<pixelType>;
+    case BICUBIC:
+      return &BlockBicubic<pixelType>;
+    case LANCZOS:
+      return &BlockLanczos<pixelType>;
+    default:
+      return NULL;
+  }
+}
+
+/** \cond DOXYHIDE **/
+// Computes the area of source that the destination pixel (chunk_x, chunk_y)
+// maps to, clamped to the extent of source. Returns false if the pixel is
+// outside of the projected area.
+static bool SourceFootprint(RasterCoordTransformer& rt,
+                            const RasterChunk& source,
+                            int chunk_x,
+                            int chunk_y,
+                            int filter_support,
+                            Area *footprint) {
+  Area pixelArea = rt.Transform(Coordinate(chunk_x, chunk_y), filter_support);
+
+  if (pixelArea.ul.x == -1.0 || (pixelArea.ul.x > source.column_count - 1)
+      || (pixelArea.lr.y > source.row_count - 1)) {
+    footprint->ul.x = -1.0;
+    footprint->lr.x = -1.0;
+    return false;
+  }
+
+  int64_t ul_x = static_cast<int64_t>(pixelArea.ul.x);
+  int64_t ul_y = static_cast<int64_t>(pixelArea.ul.y);
+  int64_t lr_x = static_cast<int64_t>(pixelArea.lr.x);
+  int64_t lr_y = static_cast<int64_t>(pixelArea.lr.y);
+
+  if (ul_x < 0) {
+    ul_x = 0;
+  }
+
+  if (ul_y < 0) {
+    ul_y = 0;
+  }
+
+  if (lr_x > (source.column_count - 1)) {
+    lr_x = source.column_count - 1;
+  }
+
+  if (ul_y > (source.row_count - 1)) {
+    ul_y = source.row_count - 1;
+  }
+
+  *footprint = Area(ul_x, ul_y, lr_x, lr_y);
+  return true;
+}
 
-  RasterCoordTransformer rt(destination.projection,
-                            destination.ul_projected_corner,
-                            destination.pixel_size,
-                            destination.row_count,
-                            destination.column_count,
-                            source.projection,
-                            source.ul_projected_corner,
-                            source.pixel_size);
+// Measures the scale between source and destination pixels over a block of
+// destination from the distance, in source pixels, between the mapped
+// corners of the block. Returns -1.0 if no pair of corners could be mapped.
+static float LocalScale(RasterCoordTransformer& rt,
+                        int block_x,
+                        int block_y,
+                        int block_width,
+                        int block_height) {
+  const Coordinate corners[4] = {
+    Coordinate(block_x, block_y),
+    Coordinate(block_x + block_width - 1, block_y),
+    Coordinate(block_x, block_y + block_height - 1),
+    Coordinate(block_x + block_width - 1, block_y + block_height - 1) };
+  // Pairs of corners along the top, bottom, left and right edges
+  const int pairs[4][3] = { { 0, 1, block_width - 1 },
+                            { 2, 3, block_width - 1 },
+                            { 0, 2, block_height - 1 },
+                            { 1, 3, block_height - 1 } };
+  Area mapped[4];
+
+  for (int i = 0; i < 4; ++i) {
+    mapped[i] = rt.Transform(corners[i]);
+  }
+
+  float scale = -1.0;
+  for (int i = 0; i < 4; ++i) {
+    const Area& a = mapped[pairs[i][0]];
+    const Area& b = mapped[pairs[i][1]];
 
-  double scale_factor = destination.pixel_size / source.pixel_size;
+    if (pairs[i][2] < 1 || a.ul.x == -1.0 || b.ul.x == -1.0) {
+      continue;
+    }
+
+    const double dx = b.ul.x - a.ul.x;
+    const double dy = b.ul.y - a.ul.y;
+    scale = std::max(scale,
+                     static_cast<float>(sqrt(dx * dx + dy * dy) / pairs[i][2]));
+  }
 
-  for (int chunk_y = 0; chunk_y < destination.row_count; ++chunk_y)  {
-    for (int chunk_x = 0; chunk_x < destination.column_count; ++chunk_x) {
-      temp1.x = chunk_x;
-      temp1.y = chunk_y;
+  return scale;
+}
 
-      pixelArea = rt.Transform(temp1, filter_support);
+// Resamples a block of destination with NEAREST. Only the sampled point of
+// each pixel is projected (see RasterCoordTransformer::TransformNearest).
+// Transform() also rejects pixels whose lower-right corner falls outside of
+// the source, which can only happen for pixels that sample within reach of
+// that corner from the edge of the chunk, so those pixels and blocks whose
+// scale can't be measured go through the full transform to produce the
+// same output. Pixels that are not marked in valid are skipped.
+template <class pixelType>
+static void NearestBlock(RasterCoordTransformer& rt,
+                         const RasterChunk& source,
+                         int block_x,
+                         int block_y,
+                         pixelType fill_value,
+                         const std::vector<char>& valid,
+                         RasterView<pixelType> block) {
+  const RasterView<const pixelType> source_pixels =
+      source.View<const pixelType>();
+  const int block_width = block.column_count();
+  const int block_height = block.row_count();
+  const float local_scale = LocalScale(rt, block_x, block_y,
+                                       block_width, block_height);
+  // The lower-right corner is sqrt(2) destination pixels away
+  const int margin = (local_scale > 0.0)
+      ? static_cast<int>(ceil(1.5 * local_scale)) + 2 : -1;
+
+  for (int y = 0; y < block_height; ++y) {
+    for (int x = 0; x < block_width; ++x) {
+      if (!valid[y * block_width + x]) {
+        continue;
+      }
 
-      int64_t dest_offset = chunk_x + chunk_y * destination.column_count;
+      Coordinate sample(-1.0, -1.0);
+      bool full_transform = (margin < 0);
 
-      if (pixelArea.ul.x == -1.0 || (pixelArea.ul.x > source.column_count - 1)
-          || (pixelArea.lr.y > source.row_count - 1)) {
+      if (!full_transform) {
+        sample = rt.TransformNearest(Coordinate(block_x + x, block_y + y));
+        full_transform = (sample.x != -1.0)
+            && (sample.x < margin
+                || sample.y < margin
+                || sample.x > source.column_count - 1 - margin
+                || sample.y > source.row_count - 1 - margin);
+      }
+
+      if (full_transform) {
+        Area footprint;
+        SourceFootprint(rt, source, block_x + x, block_y + y, 0, &footprint);
+        sample = footprint.ul;
+      }
+
+      pixelType *destination_pixel = &block(x, y);
+
+      if (sample.x == -1.0
+          || sample.x > source.column_count - 1
+          || sample.y > source.row_count - 1) {
         // The pixel is outside of the projected area
-        static_cast<pixelType*>(destination.pixels)[dest_offset] = fill_value;
+        *destination_pixel = fill_value;
         continue;
       }
 
-      temp1 = pixelArea.ul;
-      temp2 = pixelArea.lr;
+      *destination_pixel = source_pixels(sample.x, sample.y);
+    }
+  }
+}
 
-      int64_t ul_x = static_cast<int64_t>(temp1.x);
-      int64_t ul_y = static_cast<int64_t>(temp1.y);
-      int64_t lr_x = static_cast<int64_t>(temp2.x);
-      int64_t lr_y = static_cast<int64_t>(temp2.y);
+// The destination is processed in square blocks. The source footprints of
+// a block are computed first and the whole block is then handed to a
+// block resampler (see BlockResampler), which can share work between
+// neighbouring pixels.
+static const int reprojection_block_size = 32;
+
+// Spans [first, last) of destination columns inside of the projected area
+typedef std::vector<std::pair<int, int> > RowSpans;
+
+// Returns the first column in (low, high] whose validity differs from that
+// of low, given that high differs from low.
+static int FindSpanBoundary(RasterCoordTransformer& rt,
+                            int row,
+                            int low,
+                            int high,
+                            bool low_valid) {
+  while (high - low > 1) {
+    const int middle = low + (high - low) / 2;
+    if (rt.InProjectedArea(Coordinate(middle, row)) == low_valid) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
 
-      //double ul_x = temp1.x;
-      //double ul_y = temp1.y;
-      //double lr_x = temp2.x;
-      //double lr_y = temp2.y;
+  return high;
+}
 
-      if (ul_x < 0) {
-        ul_x = 0;
+// Finds the spans of columns [first_column, last_column) of destination row
+// that are inside of the projected area. Every span_step pixels are tested
+// and each change between two tests is located by bisection, so the row
+// costs about one test per span_step columns. Areas narrower than span_step
+// between two failed tests are missed here, see AddNeighbourSpans().
+static void FindValidSpans(RasterCoordTransformer& rt,
+                           int row,
+                           int first_column,
+                           int last_column,
+                           RowSpans *spans) {
+  const int span_step = 16;
+
+  spans->clear();
+  if (last_column <= first_column) {
+    return;
+  }
+
+  int previous = first_column;
+  bool previous_valid = rt.InProjectedArea(Coordinate(first_column, row));
+  int span_start = first_column;
+
+  while (previous < last_column - 1) {
+    const int x = std::min(previous + span_step, last_column - 1);
+    const bool valid = rt.InProjectedArea(Coordinate(x, row));
+
+    if (valid != previous_valid) {
+      const int boundary = FindSpanBoundary(rt, row, previous, x,
+                                            previous_valid);
+      if (valid) {
+        span_start = boundary;
+      } else {
+        spans->push_back(std::make_pair(span_start, boundary));
       }
+    }
+
+    previous = x;
+    previous_valid = valid;
+  }
 
-      if (ul_y < 0) {
-        ul_y = 0;
+  if (previous_valid) {
+    spans->push_back(std::make_pair(span_start, last_column));
+  }
+}
+
+// Looks for valid areas missed by FindValidSpans() next to the spans of a
+// neighbouring row. Every pixel of a neighbouring span that falls in a gap
+// of row is tested, and a hit is widened by bisection, since every pixel in
+// a gap between spans is known to be invalid at both ends of the gap. The
+// edge of the projected area moves little from one row to the next, so few
+// pixels are tested, and together with the passes in both directions this
+// finds every valid area that touches, directly or through other rows, a
+// span found by sampling. Only islands narrower than the sampling step in
+// every row, and apart from any other valid area, can still be missed.
+static void AddNeighbourSpans(RasterCoordTransformer& rt,
+                              int row,
+                              int first_column,
+                              int last_column,
+                              const RowSpans& neighbour,
+                              RowSpans *spans) {
+  for (size_t i = 0; i < neighbour.size(); ++i) {
+    int x = std::max(neighbour[i].first, first_column);
+    const int end = std::min(neighbour[i].second, last_column);
+
+    while (x < end) {
+      // Find the gap that x falls in, [gap_first, gap_last] are invalid
+      RowSpans::iterator next = spans->begin();
+      while (next != spans->end() && next->second <= x) {
+        ++next;
       }
-      
-      if (lr_x > (source.column_count - 1)) {
-        lr_x = source.column_count - 1;
+      if (next != spans->end() && next->first <= x) {
+        x = next->second;
+        continue;
       }
 
-      if (ul_y > (source.row_count - 1)) {
-        ul_y = source.row_count - 1;
+      const int gap_first = (next == spans->begin()) ? first_column
+          : (next - 1)->second;
+      const int gap_last = (next == spans->end()) ? last_column - 1
+          : next->first - 1;
+      if (x <= gap_first || x >= gap_last
+          || !rt.InProjectedArea(Coordinate(x, row))) {
+        ++x;
+        continue;
       }
 
-      // Perform resampling...
-      pixelType sampled_value;
+      const std::pair<int, int> span(
+          FindSpanBoundary(rt, row, gap_first, x, false),
+          FindSpanBoundary(rt, row, x, gap_last, true));
+      spans->insert(next, span);
+      x = span.second;
+    }
+  }
+}
 
-      if ((resampler == NULL) || ((ul_x > lr_x) || (ul_y > lr_y))) {
-        // ul/lr do not enclose an area, use NN
-        if (ul_x + 1 > source.column_count || ul_y + 1 > source.row_count) {
-          // TODO(dmattli) FIX THIS
-        }
+// Returns the start of the block that follows the one starting at start,
+// along an axis of length pixels. Blocks don't cross the edges of tiles
+// that are tile_length pixels long, unless tile_length is zero.
+static int NextBlockStart(int start, int length, int tile_length) {
+  int next = start + reprojection_block_size;
+
+  if (tile_length > 0) {
+    next = std::min(next, (start / tile_length + 1) * tile_length);
+  }
+
+  return std::min(next, length);
+}
+
+// Fills columns [first, last) of row of destination with value
+template <class pixelType>
+static void FillRow(RasterChunk& destination,
+                    int row,
+                    int first,
+                    int last,
+                    pixelType value) {
+  // Rows of tiled chunks are contiguous within a tile only
+  while (first < last) {
+    const int end = (destination.tile_width == 0) ? last
+        : std::min(last, (first / destination.tile_width + 1)
+                   * destination.tile_width);
+    pixelType *start =
+        destination.Window<pixelType>(first, row, end - first, 1).Row(0);
+
+    std::fill(start, start + (end - first), value);
+    first = end;
+  }
+}
+
+// Resamples one block of destination. Pixels that are not marked in valid
+// have already been filled.
+template <class pixelType>
+static void ResampleBlock(RasterCoordTransformer& rt,
+                          RasterChunk& source,
+                          RasterChunk& destination,
+                          pixelType fill_value,
+                          RESAMPLER resampler,
+                          FILE *resampler_log,
+                          int block_x,
+                          int block_y,
+                          int block_width,
+                          int block_height,
+                          const std::vector<char>& valid,
+                          std::vector<Area> *footprints) {
+  // AUTO blocks that downsample by at least this much are averaged with
+  // MEAN, the rest are interpolated with BILINEAR.
+  const float auto_mean_scale = 2.0;
+
+  // Blocks don't cross the edges of tiles, see NextBlockStart()
+  const RasterView<pixelType> block =
+      destination.Window<pixelType>(block_x, block_y, block_width,
+                                    block_height);
+  const RasterView<const pixelType> source_pixels =
+      source.View<const pixelType>();
+  RESAMPLER block_resampler = resampler;
+  float block_scale = destination.pixel_size / source.pixel_size;
+
+  if (resampler == AUTO) {
+    // Blocks whose scale can't be measured are interpolated
+    const float local_scale = LocalScale(rt, block_x, block_y,
+                                         block_width, block_height);
+    block_resampler = BILINEAR;
+    if (local_scale >= auto_mean_scale) {
+      block_resampler = MEAN;
+      block_scale = local_scale;
+    } else if (local_scale > 0.0) {
+      block_scale = local_scale;
+    }
+
+    if (resampler_log != NULL) {
+      fprintf(resampler_log, "%.0f,%.0f,%d,%d,%.3f,%s\n",
+              destination.raster_location.x + block_x,
+              destination.raster_location.y + block_y,
+              block_width,
+              block_height,
+              local_scale,
+              ResamplerName(block_resampler));
+    }
+  }
+
+  if (block_resampler == NEAREST) {
+    NearestBlock(rt, source, block_x, block_y, fill_value, valid, block);
+    return;
+  }
+
+  const int filter_support = FilterSupport(block_resampler);
+  BlockResampler<pixelType> block_kernel =
+      GetBlockResampler<pixelType>(block_resampler);
+  footprints->resize(block_width * block_height);
+
+  for (int y = 0; y < block_height; ++y) {
+    for (int x = 0; x < block_width; ++x) {
+      Area& footprint = (*footprints)[y * block_width + x];
+
+      if (!valid[y * block_width + x]) {
+        footprint.ul.x = -1.0;
+        footprint.lr.x = -1.0;
+      } else if (!SourceFootprint(rt, source, block_x + x, block_y + y,
+                                  filter_support, &footprint)) {
+        // The pixel is outside of the projected area
+        block(x, y) = fill_value;
+      } else if (block_kernel == NULL) {
+        block(x, y) = source_pixels(footprint.ul.x, footprint.ul.y);
+      }
+    }
+  }
+
+  if (block_kernel != NULL) {
+    block_kernel(source, *footprints, block_scale, block);
+  }
+}
+
+// Interleaves the bits of x and y, the bits of x go to the even positions
+static uint64_t MortonCode(uint32_t x, uint32_t y) {
+  uint64_t code = 0;
+
+  for (int bit = 0; bit < 32; ++bit) {
+    code |= static_cast<uint64_t>((x >> bit) & 1) << (2 * bit);
+    code |= static_cast<uint64_t>((y >> bit) & 1) << (2 * bit + 1);
+  }
 
-        if ((ul_x > lr_x) || (ul_y > lr_y)) {
-          //fprintf(stderr, "ul/lr doesn't enclose an area: ul %ld %ld lr %ld %ld\n", ul_x, ul_y, lr_x, lr_y);
+  return code;
+}
+
+// Returns the size in bytes of the L2 cache of this machine, or a typical
+// size if it isn't known.
+static int64_t L2CacheSize() {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  const long size = sysconf(_SC_LEVEL2_CACHE_SIZE);  // NOLINT
+  if (size > 0) {
+    return size;
+  }
+#endif
+  return 256 * 1024;
+}
+
+// Returns the side of the square regions of MORTON_ORDER. The pixels of a
+// region and the source pixels they read, whose bounding box can cover
+// twice the area when the mapping is rotated, should fit in half of the L2
+// cache. scale is the number of source pixels per destination pixel along
+// each axis.
+static int RegionSize(const RasterChunk& source,
+                      const RasterChunk& destination,
+                      float scale) {
+  const int largest_region = 16 * reprojection_block_size;
+  const double pixel_bytes = GDALGetDataTypeSize(destination.pixel_type) / 8
+      + 2.0 * scale * scale * (GDALGetDataTypeSize(source.pixel_type) / 8);
+  int size = reprojection_block_size;
+
+  while (size < largest_region
+         && 4.0 * size * size * pixel_bytes <= L2CacheSize() / 2) {
+    size *= 2;
+  }
+
+  return size;
+}
+
+// Reprojects the destination pixels in region, which is inclusive like
+// partitions. The blocks of the region are resampled in order.
+template <class pixelType>
+static void ReprojectRegion(RasterCoordTransformer& rt,
+                            RasterChunk& source,
+                            RasterChunk& destination,
+                            pixelType fill_value,
+                            RESAMPLER resampler,
+                            FILE *resampler_log,
+                            Area region,
+                            BLOCK_ORDER order,
+                            std::vector<Area> *footprints) {
+  const int first_column = region.ul.x;
+  const int last_column = region.lr.x + 1;
+  const int first_row = region.ul.y;
+  const int last_row = region.lr.y + 1;
+
+  // Pixels outside of the valid spans of their row are filled up front and
+  // never transformed. Spans are also found for a few rows around the
+  // region so that AddNeighbourSpans() can pass them on in both directions.
+  const int span_halo = 4;
+  const int span_first_row = std::max(0, first_row - span_halo);
+  const int span_last_row = std::min(destination.row_count,
+                                     last_row + span_halo);
+  std::vector<RowSpans> row_spans(span_last_row - span_first_row);
+
+  for (size_t i = 0; i < row_spans.size(); ++i) {
+    FindValidSpans(rt, span_first_row + i, first_column, last_column,
+                   &row_spans[i]);
+  }
+  for (size_t i = 1; i < row_spans.size(); ++i) {
+    AddNeighbourSpans(rt, span_first_row + i, first_column, last_column,
+                      row_spans[i - 1], &row_spans[i]);
+  }
+  for (int i = static_cast<int>(row_spans.size()) - 2; i >= 0; --i) {
+    AddNeighbourSpans(rt, span_first_row + i, first_column, last_column,
+                      row_spans[i + 1], &row_spans[i]);
+  }
+
+  const RowSpans *spans = &row_spans[first_row - span_first_row];
+  for (int y = 0; y < last_row - first_row; ++y) {
+    int filled = first_column;
+
+    for (size_t i = 0; i < spans[y].size(); ++i) {
+      FillRow(destination, first_row + y, filled, spans[y][i].first,
+              fill_value);
+      filled = spans[y][i].second;
+    }
+    FillRow(destination, first_row + y, filled, last_column, fill_value);
+  }
+
+  // Upper-left corners of the blocks, with the key they are sorted by
+  struct Block {
+    uint64_t key;
+    int x;
+    int y;
+
+    bool operator<(const Block& b) const { return key < b.key; }
+  };
+  std::vector<Block> blocks;
+
+  for (int y = first_row, j = 0; y < last_row;
+       y = NextBlockStart(y, last_row, destination.tile_height), ++j) {
+    for (int x = first_column, i = 0; x < last_column;
+         x = NextBlockStart(x, last_column, destination.tile_width), ++i) {
+      Block block;
+      block.key = (order == MORTON_ORDER) ? MortonCode(i, j)
+          : (static_cast<uint64_t>(j) << 32) + i;
+      block.x = x;
+      block.y = y;
+      blocks.push_back(block);
+    }
+  }
+  std::sort(blocks.begin(), blocks.end());
+
+  std::vector<char> valid;
+
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    const int block_x = blocks[b].x;
+    const int block_y = blocks[b].y;
+    const int block_width = NextBlockStart(block_x, last_column,
+                                           destination.tile_width) - block_x;
+    const int block_height = NextBlockStart(block_y, last_row,
+                                            destination.tile_height) - block_y;
+
+    // Mark the pixels of the block that are inside of a valid span
+    const RowSpans *block_spans = spans + (block_y - first_row);
+    bool any_valid = false;
+    valid.assign(block_width * block_height, 0);
+    for (int y = 0; y < block_height; ++y) {
+      for (size_t i = 0; i < block_spans[y].size(); ++i) {
+        const int first = std::max(block_spans[y][i].first, block_x);
+        const int last = std::min(block_spans[y][i].second,
+                                  block_x + block_width);
+
+        if (first < last) {
+          std::fill(valid.begin() + y * block_width + first - block_x,
+                    valid.begin() + y * block_width + last - block_x, 1);
+          any_valid = true;
         }
+      }
+    }
 
-        int64_t src_offset = (int64_t) ul_x + (int64_t) ul_y * source.column_count;
+    if (any_valid) {
+      ResampleBlock(rt, source, destination, fill_value, resampler,
+                    resampler_log, block_x, block_y, block_width,
+                    block_height, valid, footprints);
+    }
+  }
+}
+/** \endcond **/
 
-        sampled_value = static_cast<pixelType*>(source.pixels)[src_offset];
-      } else {
-        Area ia = Area(ul_x, ul_y, lr_x, lr_y);
+template <class pixelType>
+bool ReprojectChunkType(RasterChunk& source,
+                        RasterChunk& destination,
+                        pixelType fill_value,
+                        RESAMPLER resampler,
+                        FILE *resampler_log,
+                        ThreadPool *pool,
+                        BLOCK_ORDER order) {
+  const int worker_count = (pool == NULL) ? 1 : pool->thread_count();
+
+  // OGR transformations are not thread-safe, every worker gets its own
+  // transformer. They are created up front, one at a time.
+  std::vector<std::unique_ptr<RasterCoordTransformer> > transformers;
+  std::vector<std::vector<Area> > footprints(worker_count);
+
+  for (int i = 0; i < worker_count; ++i) {
+    transformers.push_back(std::unique_ptr<RasterCoordTransformer>(
+        new RasterCoordTransformer(destination.projection,
+                                   destination.ul_projected_corner,
+                                   destination.pixel_size,
+                                   destination.row_count,
+                                   destination.column_count,
+                                   source.projection,
+                                   source.ul_projected_corner,
+                                   source.pixel_size)));
+  }
 
-        sampled_value = resampler(source, ia, scale_factor);
+  // ROW_ORDER regions are the bands of blocks across the chunk, aligned to
+  // the tiles of tiled destinations. MORTON_ORDER regions are squares
+  // visited in Morton order, so regions that run at the same time on
+  // different threads are close together too.
+  std::vector<Area> regions;
+  if (order == ROW_ORDER) {
+    for (int y = 0; y < destination.row_count;
+         y = NextBlockStart(y, destination.row_count,
+                            destination.tile_height)) {
+      regions.push_back(Area(0, y, destination.column_count - 1,
+                             NextBlockStart(y, destination.row_count,
+                                            destination.tile_height) - 1));
+    }
+  } else {
+    const float scale = LocalScale(*transformers[0], 0, 0,
+                                   destination.column_count,
+                                   destination.row_count);
+    const int region_size = RegionSize(source, destination,
+                                       (scale > 0.0) ? scale : 1.0);
+
+    // Regions of tiled destinations are made of whole tiles
+    int region_width = region_size;
+    int region_height = region_size;
+    if (destination.tile_width != 0) {
+      region_width = std::max(destination.tile_width, region_size
+                              / destination.tile_width
+                              * destination.tile_width);
+      region_height = std::max(destination.tile_height, region_size
+                               / destination.tile_height
+                               * destination.tile_height);
+    }
+    std::vector<std::pair<uint64_t, Area> > keyed_regions;
+
+    for (int y = 0; y < destination.row_count; y += region_height) {
+      for (int x = 0; x < destination.column_count; x += region_width) {
+        keyed_regions.push_back(std::make_pair(
+            MortonCode(x / region_width, y / region_height),
+            Area(x, y,
+                 std::min(x + region_width, destination.column_count) - 1,
+                 std::min(y + region_height, destination.row_count) - 1)));
       }
+    }
+    std::sort(keyed_regions.begin(), keyed_regions.end(),
+              [](const std::pair<uint64_t, Area>& a,
+                 const std::pair<uint64_t, Area>& b) {
+                return a.first < b.first;
+              });
+
+    for (size_t i = 0; i < keyed_regions.size(); ++i) {
+      regions.push_back(keyed_regions[i].second);
+    }
+  }
 
-      static_cast<pixelType*>(destination.pixels)[dest_offset] = sampled_value;
+  std::function<void(int, int)> region = [&](int worker, int i) {
+    ReprojectRegion(*transformers[worker], source, destination, fill_value,
+                    resampler, resampler_log, regions[i], order,
+                    &footprints[worker]);
+  };
+
+  if (pool == NULL || regions.size() < 2) {
+    for (size_t i = 0; i < regions.size(); ++i) {
+      region(0, i);
     }
+  } else {
+    pool->ParallelFor(regions.size(), region);
   }
 
   return true;
 }
 }
-
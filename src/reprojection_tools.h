@@ -20,12 +20,14 @@
 
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <functional>
 #include <string>
 #include <vector>
 
 #include "rastercoordtransformer.h"
 #include "resampler.h"
+#include "threadpool.h"
 #include "utils.h"
 
 /// Container namespace for librasterblaster project
@@ -51,6 +53,26 @@ PRB_ERROR CreateOutputRaster(GDALDataset *in,
                              int output_tile_size,
                              double output_ratio = 1.0f,
                              double output_no_data_value = NAN);
+/**
+ * @brief Computes the size and georeferencing of the raster the first
+ * CreateOutputRaster creates, without creating it.
+ *
+ * @param in The GDALDataset that represents the input file.
+ * @param output_srs String with a projection specification (WKT, proj4, EPSG) suitable for
+ *        OGRSpatialReference->SetFromUserInput()
+ * @param output_ratio Ratio of the output pixel size to the projected input pixel size
+ * @param output_columns Set to the width of the output raster in pixels
+ * @param output_rows Set to the height of the output raster in pixels
+ * @param output_pixel_size Set to the side of each output pixel in projected coordinates
+ * @param output_projected_area Set to the projected area of the output raster
+ */
+PRB_ERROR OutputRasterGeometry(GDALDataset *in,
+                               string output_srs,
+                               double output_ratio,
+                               int64_t *output_columns,
+                               int64_t *output_rows,
+                               double *output_pixel_size,
+                               Area *output_projected_area);
 /**
  * @brief Creates an output raster based on an input raster, a new projection,
  * and a maximum pixel dimension. This is to be used when the dimensions of the
@@ -126,6 +148,232 @@ Area RasterMinbox2(string source_projection,
                   int destination_row_count,
                   int destination_column_count,
                   Area destination_raster_area);
+/**
+ * @brief DecimationFactor chooses how far the input of a partition can be
+ *        reduced in resolution before it is resampled.
+ *
+ * When the output is much coarser than the input, reading a decimated input
+ * chunk (see RasterChunk::decimation) leaves only the residual scale to the
+ * resampler. Only resamplers that average the source pixels are decimated,
+ * NEAREST, MIN and MAX always get a factor of one.
+ *
+ * @param input_area Minbox of the partition in the input raster
+ * @param output_area Partition of the output raster
+ * @param resampler Resampler that will be used for the partition
+ *
+ * @return The largest power of two not greater than the smaller of the
+ *         horizontal and vertical scale between input_area and output_area.
+ */
+int DecimationFactor(Area input_area, Area output_area, RESAMPLER resampler);
+
+/**
+ * @brief PartitionMemory estimates the bytes of the input and output chunks
+ *        of a partition.
+ *
+ * The input minbox is estimated from a grid of at most 33x33 pixels of the
+ * partition rather than from every pixel as RasterMinbox does, and grown by
+ * the spacing of the grid.
+ *
+ * @param input Description of the input raster: projection, corner, pixel
+ *        size, size, pixel type and band count. Its pixels are not used.
+ * @param output Description of the output raster. Output chunks are padded
+ *        to whole tiles if tile_width is set.
+ * @param partition Partition of the output raster
+ * @param resampler Resampler that will be used for the partition
+ * @param decimate_input Whether the input is decimated, see DecimationFactor
+ */
+int64_t PartitionMemory(const RasterChunk& input,
+                        const RasterChunk& output,
+                        Area partition,
+                        RESAMPLER resampler,
+                        bool decimate_input);
+
+/**
+ * @brief PlanPartitions splits partitions until the estimated input and
+ *        output chunks of each fit in partition_memory bytes.
+ *
+ * Partitions are halved at tile boundaries, across their longer side, down
+ * to single tiles. A single tile that is still too large is streamed: it is
+ * halved into row strips until the strips fit or are a single row. The
+ * pieces of a partition replace it, in order.
+ *
+ * @param input Description of the input raster, see PartitionMemory
+ * @param output Description of the output raster, see PartitionMemory
+ * @param partitions Partitions of the output raster, from BlockPartition
+ * @param resampler Resampler that will be used
+ * @param decimate_input Whether the input is decimated, see DecimationFactor
+ * @param partition_memory Bytes each partition may use, values below one
+ *        disable splitting.
+ * @param whole_tiles Stop at single tiles instead of streaming them, for
+ *        outputs whose tiles are compressed whole.
+ */
+std::vector<Area> PlanPartitions(const RasterChunk& input,
+                                 const RasterChunk& output,
+                                 const std::vector<Area>& partitions,
+                                 RESAMPLER resampler,
+                                 bool decimate_input,
+                                 int64_t partition_memory,
+                                 bool whole_tiles = false);
+
+/**
+ * @brief Overload of PlanPartitions that describes the rasters from their
+ *        datasets.
+ */
+std::vector<Area> PlanPartitions(GDALDataset *input,
+                                 GDALDataset *output,
+                                 const std::vector<Area>& partitions,
+                                 RESAMPLER resampler,
+                                 bool decimate_input,
+                                 int64_t partition_memory,
+                                 bool whole_tiles = false);
+
+/**
+ * @brief PartitionCost estimates the relative time a process spends on a
+ *        partition.
+ *
+ * The input minbox and the fraction of the partition that falls on the
+ * input raster are estimated from the same grid as PartitionMemory. Each
+ * output pixel costs 0.1 to fill and write, and 1 more if it is valid, and
+ * each pixel of the (decimated) input chunk costs 1 to read and resample.
+ * Partitions outside of the input are nearly free, those whose footprint
+ * in the input is large, such as near the poles, cost the most.
+ *
+ * @param input Description of the input raster, see PartitionMemory
+ * @param output Description of the output raster, see PartitionMemory
+ * @param partition Partition of the output raster
+ * @param resampler Resampler that will be used for the partition
+ * @param decimate_input Whether the input is decimated, see DecimationFactor
+ */
+double PartitionCost(const RasterChunk& input,
+                     const RasterChunk& output,
+                     Area partition,
+                     RESAMPLER resampler,
+                     bool decimate_input);
+
+/**
+ * @brief PartitionCosts returns the PartitionCost of each partition.
+ */
+std::vector<double> PartitionCosts(const RasterChunk& input,
+                                   const RasterChunk& output,
+                                   const std::vector<Area>& partitions,
+                                   RESAMPLER resampler,
+                                   bool decimate_input);
+
+/**
+ * @brief Overload of PartitionCosts that describes the rasters from their
+ *        datasets.
+ */
+std::vector<double> PartitionCosts(GDALDataset *input,
+                                   GDALDataset *output,
+                                   const std::vector<Area>& partitions,
+                                   RESAMPLER resampler,
+                                   bool decimate_input);
+
+/**
+ * @brief AssignPartitions returns the partitions of process rank, assigned
+ *        longest processing time first.
+ *
+ * Partitions are taken from the most to the least costly and each is given
+ * to the process with the lowest total cost so far. Every process that
+ * calls AssignPartitions with the same partitions and costs gets its part
+ * of the same assignment.
+ *
+ * @param partitions Partitions of the whole output raster
+ * @param costs Cost of each partition, see PartitionCost
+ * @param rank Rank of the process
+ * @param process_count Number of processes
+ * @param rank_cost Receives the total cost of the returned partitions if it
+ *        isn't NULL
+ *
+ * @return The partitions of rank in the order they have in partitions.
+ */
+std::vector<Area> AssignPartitions(const std::vector<Area>& partitions,
+                                   const std::vector<double>& costs,
+                                   int rank,
+                                   int process_count,
+                                   double *rank_cost);
+
+/**
+ * @brief PartitionsOutsideInput reports, for each partition, whether none
+ *        of its pixels fall on the input raster.
+ *
+ * Such partitions, common in the corners of pseudocylindrical projections
+ * such as sinu, moll and eck4, are only fill. The edges of a partition
+ * and the grid of PartitionMemory are checked first, and a partition is
+ * only reported outside once every one of its pixels has been transformed,
+ * so no part of the input is missed.
+ *
+ * @param input Description of the input raster, see PartitionMemory
+ * @param output Description of the output raster, see PartitionMemory
+ * @param partitions Partitions of the output raster
+ */
+std::vector<bool> PartitionsOutsideInput(const RasterChunk& input,
+                                         const RasterChunk& output,
+                                         const std::vector<Area>& partitions);
+
+/**
+ * @brief Overload of PartitionsOutsideInput that describes the rasters from
+ *        their datasets.
+ */
+std::vector<bool> PartitionsOutsideInput(GDALDataset *input,
+                                         GDALDataset *output,
+                                         const std::vector<Area>& partitions);
+
+/**
+ * @brief HilbertIndex returns the distance of (x, y) along a Hilbert curve
+ *        that fills the 2^32 by 2^32 grid.
+ *
+ * Points that are close along the curve are close in the grid, and any
+ * stretch of the curve covers a compact region.
+ */
+uint64_t HilbertIndex(uint32_t x, uint32_t y);
+
+/**
+ * @brief HilbertOrder returns the indices of partitions sorted by the
+ *        HilbertIndex of their centre pixels.
+ *
+ * Consecutive partitions in this order are neighbours in the output, and
+ * so mostly read neighbouring areas of the input.
+ */
+std::vector<size_t> HilbertOrder(const std::vector<Area>& partitions);
+
+/**
+ * @brief AssignPartitionRanges returns the partitions of process rank, a
+ *        contiguous range of partitions of about equal total cost.
+ *
+ * The partitions are cut into process_count ranges at equal fractions of
+ * their total cost, each partition going to the range that holds the
+ * middle of its cost. Given partitions in HilbertOrder, each process gets
+ * a compact region of the output, at the price of a balance that is only
+ * as even as the cost of a single partition.
+ *
+ * @param partitions Partitions of the whole output raster, in the order to
+ *        cut them
+ * @param costs Cost of each partition, see PartitionCost
+ * @param rank Rank of the process
+ * @param process_count Number of processes
+ * @param rank_cost Receives the total cost of the returned partitions if it
+ *        isn't NULL
+ *
+ * @return The partitions of rank in the order they have in partitions.
+ */
+std::vector<Area> AssignPartitionRanges(const std::vector<Area>& partitions,
+                                        const std::vector<double>& costs,
+                                        int rank,
+                                        int process_count,
+                                        double *rank_cost);
+
+/**
+ * @brief Orders in which ReprojectChunk visits the blocks of the destination
+ */
+enum BLOCK_ORDER {
+  /** Bands of blocks from the top, each band from the left */
+  ROW_ORDER,
+  /** Square regions sized to the L2 cache, and the blocks within each
+   *  region, in Morton (Z) order */
+  MORTON_ORDER
+};
+
 /**
  * \brief This function takes two RasterChunk pointers and performs
  *        reprojection and resampling
@@ -133,6 +381,16 @@ Area RasterMinbox2(string source_projection,
  * \param destination Pointer to the RasterChunk to reproject to
  * \param fillvalue std::string that will be interpreted to be the fill value
  * \param resampler The resampler that should be used
+ * \param resampler_log If not NULL, the resampler chosen for each block of
+ *        destination is written to this file, one CSV line per block:
+ *        upper-left x, upper-left y (destination raster coordinates), width,
+ *        height, measured scale and resampler name.
+ * \param pool If not NULL, regions of destination are reprojected in
+ *        parallel on the threads of pool.
+ * \param order Order in which the blocks of destination are resampled.
+ *        MORTON_ORDER keeps the source pixels read by neighbouring blocks in
+ *        cache when the mapping is rotated or sheared. The output does not
+ *        depend on the order.
  *
  * @return Returns a bool indicating success or failure.
  */
@@ -140,19 +398,33 @@ Area RasterMinbox2(string source_projection,
 bool ReprojectChunk(RasterChunk& source,
                     RasterChunk& destination,
                     string fill_value,
-                    RESAMPLER resampler);
+                    RESAMPLER resampler,
+                    FILE *resampler_log = NULL,
+                    ThreadPool *pool = NULL,
+                    BLOCK_ORDER order = MORTON_ORDER);
+
+/**
+ * @brief Returns the lowercase name of resampler, as accepted by the
+ * --resampler option.
+ */
+const char *ResamplerName(RESAMPLER resampler);
 
 /** @cond DOXYHIDE **/
 
 template<typename T>
 std::function<T(RasterChunk&, Area, float)> GetResampler(RESAMPLER type);
 
+template<typename T>
+BlockResampler<T> GetBlockResampler(RESAMPLER type);
+
 template <typename T>
 bool ReprojectChunkType(RasterChunk& source,
                         RasterChunk& destination,
                         T fill_value,
-                        std::function<T(RasterChunk&, Area, float)> resampler,
-                        int filter_support);
+                        RESAMPLER resampler,
+                        FILE *resampler_log,
+                        ThreadPool *pool,
+                        BLOCK_ORDER order);
 /** @endcond **/
 
 }
@@ -18,12 +18,15 @@
 #ifndef SRC_RESAMPLER_H_
 #define SRC_RESAMPLER_H_
 
+#include <algorithm>
 #include <cmath>
 #include <functional>
+#include <vector>
 
 #include <gdal.h>
 
 #include "rasterchunk.h"
+#include "rasterview.h"
 #include "utils.h"
 
 namespace librasterblaster {
@@ -39,8 +42,22 @@ enum RESAMPLER {
   BILINEAR,/** @brief Bilinear */
   BICUBIC, /** @brief Bicubic (Catmull-Rom spline) */
   LANCZOS, /** @brief Lanczos */
+  AUTO,    /** @brief BILINEAR or MEAN, chosen per block by the local scale */
 };
 
+/**
+ * @brief Returns the support, in output pixels, of the filter used by
+ * resampler. Resamplers that are not filters have a support of zero.
+ */
+inline int FilterSupport(RESAMPLER resampler) {
+  switch (resampler) {
+    case BILINEAR: return 1;
+    case BICUBIC: return 2;
+    case LANCZOS: return 3;
+    default: return 0;
+  }
+}
+
 inline float bilinear_filter(float x) {
   if (x < 0.0)
     x = -x;
@@ -85,14 +102,12 @@ inline float lanczos_filter(float x) {
 /** @cond DOXYHIDE */
 template <typename T>
 T Max(RasterChunk& input, Area pixel_area, float) {
-  T *pixels = static_cast<T*>(input.pixels);
-  T temp = pixels[static_cast<int>(pixel_area.ul.y)
-                  * input.column_count
-                  + static_cast<int>(pixel_area.ul.x)];
+  const RasterView<const T> pixels = input.View<const T>();
+  T temp = pixels(pixel_area.ul.x, pixel_area.ul.y);
   T temp2 = 0;
   for (int y = pixel_area.ul.y; y <= pixel_area.lr.y; ++y) {
     for (int x = pixel_area.ul.x; x <= pixel_area.lr.x; ++x) {
-      temp2 = pixels[y * input.column_count + x];
+      temp2 = pixels(x, y);
 
       if (temp2 > temp) {
         temp = temp2;
@@ -105,16 +120,14 @@ T Max(RasterChunk& input, Area pixel_area, float) {
 
 template <typename T>
 T Min(RasterChunk& input, Area pixel_area, float) {
-  T *pixels = static_cast<T*>(input.pixels);
-  T temp = pixels[static_cast<int>(pixel_area.ul.y)
-    * input.column_count
-    + static_cast<int>(pixel_area.ul.x)];
+  const RasterView<const T> pixels = input.View<const T>();
+  T temp = pixels(pixel_area.ul.x, pixel_area.ul.y);
 
   T temp2 = 0;
 
   for (int y = pixel_area.ul.y; y <= pixel_area.lr.y; ++y) {
     for (int x = pixel_area.ul.x; x <= pixel_area.lr.x; ++x) {
-      temp2 = pixels[y * input.column_count + x];
+      temp2 = pixels(x, y);
 
       if (temp2 < temp) {
         temp = temp2;
@@ -128,13 +141,13 @@ T Min(RasterChunk& input, Area pixel_area, float) {
 template <typename T>
 T Mean(RasterChunk& input, Area pixel_area, float) {
   T temp = 0;
-  T *pixels = static_cast<T*>(input.pixels);
+  const RasterView<const T> pixels = input.View<const T>();
 
   int cells = 0;
 
   for (int y = pixel_area.ul.y; y <= pixel_area.lr.y; ++y) {
     for (int x = pixel_area.ul.x; x <= pixel_area.lr.x; ++x) {
-      temp += pixels[(int64_t) y * input.column_count + (int64_t) x];
+      temp += pixels(x, y);
       cells++;
     }
   }
@@ -146,8 +159,8 @@ T Mean(RasterChunk& input, Area pixel_area, float) {
 
 template <typename T, typename F>
 T Filter(RasterChunk& input, Area pixel_area, F filter, int support, float scale_factor) {
-  T temp = 0;
-  T *pixels = static_cast<T*>(input.pixels);
+  double temp = 0.0;
+  const RasterView<const T> pixels = input.View<const T>();
 
   float ss = support / scale_factor;
 
@@ -167,12 +180,134 @@ T Filter(RasterChunk& input, Area pixel_area, F filter, int support, float scale
 
       float weight = x_weight * y_weight;
 
-      temp += pixels[(int64_t) y * input.column_count + (int64_t) x] * weight;
+      temp += pixels(x, y) * weight;
       total_weight += weight;
     }
   }
 
-  return temp / total_weight;
+  return static_cast<T>(temp / total_weight);
+}
+
+/**
+ * @brief Computes the 1D filter weights of the source pixels first..last,
+ * centered the same way as Filter(), and appends them to weights.
+ *
+ * @return Sum of the appended weights
+ */
+template <typename F>
+float FilterWeights(int first, int last, F filter, float ss,
+                    std::vector<float> *weights) {
+  const float center = first + (last - first) / 2.0;
+  float total_weight = 0.0;
+
+  for (int i = first; i <= last; ++i) {
+    const float weight = filter((i + 0.5 - center) * ss) * ss;
+    weights->push_back(weight);
+    total_weight += weight;
+  }
+
+  return total_weight;
+}
+
+/**
+ * @brief Two-pass version of Filter() for a block of output pixels.
+ *
+ * The block must be axis-aligned: every pixel in a column of the block has
+ * the same horizontal footprint range, and every pixel in a row the same
+ * vertical range. The source rows covered by the block are then filtered
+ * horizontally once into an intermediate buffer, which is filtered
+ * vertically to produce the output, for O(k) instead of O(k^2) work per
+ * pixel.
+ *
+ * @param input Source chunk
+ * @param footprints Source areas of the pixels of output, row-major
+ * @param filter 1D filter kernel
+ * @param support Support of the filter kernel
+ * @param scale_factor Scale between output and input pixels
+ * @param output Pixels of the block
+ */
+template <typename T, typename F>
+void SeparableFilter(RasterChunk& input,
+                     const std::vector<Area>& footprints,
+                     F filter,
+                     int support,
+                     float scale_factor,
+                     RasterView<T> output) {
+  const RasterView<const T> pixels = input.View<const T>();
+  const int block_width = output.column_count();
+  const int block_height = output.row_count();
+  float ss = support / scale_factor;
+
+  // Horizontal weights are shared by each column, vertical weights by each
+  // row.
+  std::vector<float> x_weights, y_weights;
+  std::vector<size_t> x_offsets(block_width), y_offsets(block_height);
+  std::vector<float> x_totals(block_width), y_totals(block_height);
+
+  for (int x = 0; x < block_width; ++x) {
+    const Area& footprint = footprints[x];
+    x_offsets[x] = x_weights.size();
+    x_totals[x] = FilterWeights(footprint.ul.x, footprint.lr.x, filter, ss,
+                                &x_weights);
+  }
+
+  int first_row = footprints[0].ul.y;
+  int last_row = footprints[0].lr.y;
+
+  for (int y = 0; y < block_height; ++y) {
+    const Area& footprint = footprints[y * block_width];
+    y_offsets[y] = y_weights.size();
+    y_totals[y] = FilterWeights(footprint.ul.y, footprint.lr.y, filter, ss,
+                                &y_weights);
+    first_row = std::min(first_row, static_cast<int>(footprint.ul.y));
+    last_row = std::max(last_row, static_cast<int>(footprint.lr.y));
+  }
+
+  // Horizontal pass over every source row the block touches
+  std::vector<double> rows(static_cast<size_t>(last_row - first_row + 1)
+                           * block_width);
+
+  for (int y = first_row; y <= last_row; ++y) {
+    const T *source_row = pixels.Row(y);
+    double *row = &rows[static_cast<size_t>(y - first_row) * block_width];
+
+    for (int x = 0; x < block_width; ++x) {
+      const int first = footprints[x].ul.x;
+      const int last = footprints[x].lr.x;
+      const float *weights = &x_weights[x_offsets[x]];
+      double sum = 0.0;
+
+      for (int i = first; i <= last; ++i) {
+        sum += source_row[i] * weights[i - first];
+      }
+      row[x] = sum;
+    }
+  }
+
+  // Vertical pass from the intermediate rows
+  std::vector<double> sums(block_width);
+
+  for (int y = 0; y < block_height; ++y) {
+    const int first = footprints[y * block_width].ul.y;
+    const int last = footprints[y * block_width].lr.y;
+    const float *weights = &y_weights[y_offsets[y]];
+
+    std::fill(sums.begin(), sums.end(), 0.0);
+    for (int i = first; i <= last; ++i) {
+      const double *row = &rows[static_cast<size_t>(i - first_row)
+                                * block_width];
+      const float weight = weights[i - first];
+
+      for (int x = 0; x < block_width; ++x) {
+        sums[x] += row[x] * weight;
+      }
+    }
+
+    T *output_row = output.Row(y);
+    for (int x = 0; x < block_width; ++x) {
+      output_row[x] = static_cast<T>(sums[x] / (x_totals[x] * y_totals[y]));
+    }
+  }
 }
 
 template<typename T>
@@ -189,6 +324,389 @@ template<typename T>
 T Lanczos(RasterChunk& input, Area pixel_area, float scale_factor) {
   return Filter<T>(input, pixel_area, lanczos_filter, 3, scale_factor);
 }
+
+/**
+ * @brief Signature of a block resampler.
+ *
+ * A block resampler writes a block of output pixels at once from the
+ * source footprints of the block, which lets it reuse work between
+ * neighbouring pixels.
+ *
+ * @param input Source chunk
+ * @param footprints Source areas of the pixels of output, row-major.
+ *        Pixels whose footprint has ul.x == -1 are outside of the projected
+ *        area and are left untouched.
+ * @param scale_factor Scale between output and input pixels
+ * @param output Pixels of the block, usually a window of the destination
+ *        chunk (see RasterChunk::Window())
+ */
+template <typename T>
+using BlockResampler = std::function<void(RasterChunk&,
+                                          const std::vector<Area>&,
+                                          float,
+                                          RasterView<T>)>;
+
+// Footprints that don't enclose an area take the value of their
+// upper-left pixel. Returns true if footprint was handled this way.
+template <typename T>
+bool DegenerateFootprint(const RasterChunk& input, const Area& footprint,
+                         T *output) {
+  if (footprint.ul.x <= footprint.lr.x && footprint.ul.y <= footprint.lr.y) {
+    return false;
+  }
+
+  *output = input.View<const T>()(footprint.ul.x, footprint.ul.y);
+  return true;
+}
+
+/**
+ * @brief Returns true if every footprint of the block is valid, every
+ * pixel in a column has the same horizontal range and every pixel in a row
+ * the same vertical range.
+ */
+inline bool AxisAligned(const std::vector<Area>& footprints,
+                        int block_width,
+                        int block_height) {
+  for (int y = 0; y < block_height; ++y) {
+    for (int x = 0; x < block_width; ++x) {
+      const Area& footprint = footprints[y * block_width + x];
+      const Area& column_start = footprints[x];
+      const Area& row_start = footprints[y * block_width];
+
+      if (footprint.ul.x == -1.0
+          || footprint.ul.x > footprint.lr.x
+          || footprint.ul.y > footprint.lr.y
+          || footprint.ul.x != column_start.ul.x
+          || footprint.lr.x != column_start.lr.x
+          || footprint.ul.y != row_start.ul.y
+          || footprint.lr.y != row_start.lr.y) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Block version of Filter().
+ *
+ * Axis-aligned blocks are handed to SeparableFilter(). Otherwise each pixel
+ * is filtered on its own, but as the weights of a footprint only depend on
+ * its width and height they are computed once per size for the whole block.
+ */
+template <typename T, typename F>
+void BlockFilter(RasterChunk& input,
+                 const std::vector<Area>& footprints,
+                 F filter,
+                 int support,
+                 float scale_factor,
+                 RasterView<T> output) {
+  const int block_width = output.column_count();
+  const int block_height = output.row_count();
+
+  if (AxisAligned(footprints, block_width, block_height)) {
+    SeparableFilter<T>(input, footprints, filter, support, scale_factor,
+                       output);
+    return;
+  }
+
+  const RasterView<const T> pixels = input.View<const T>();
+  float ss = support / scale_factor;
+
+  // Weights of a range of source pixels, indexed by its length
+  std::vector<std::vector<float> > weights;
+
+  for (int y = 0; y < block_height; ++y) {
+    for (int x = 0; x < block_width; ++x) {
+      const Area& footprint = footprints[y * block_width + x];
+      T *output_pixel = &output(x, y);
+
+      if (footprint.ul.x == -1.0
+          || DegenerateFootprint(input, footprint, output_pixel)) {
+        continue;
+      }
+
+      const int ul_x = footprint.ul.x;
+      const int ul_y = footprint.ul.y;
+      const size_t width = footprint.lr.x - footprint.ul.x + 1;
+      const size_t height = footprint.lr.y - footprint.ul.y + 1;
+      const size_t longest = std::max(width, height);
+
+      if (weights.size() <= longest) {
+        weights.resize(longest + 1);
+      }
+      if (weights[width].empty()) {
+        FilterWeights(0, width - 1, filter, ss, &weights[width]);
+      }
+      if (weights[height].empty()) {
+        FilterWeights(0, height - 1, filter, ss, &weights[height]);
+      }
+
+      const float *x_weights = &weights[width][0];
+      const float *y_weights = &weights[height][0];
+      double temp = 0.0;
+      float total_weight = 0.0;
+
+      for (size_t j = 0; j < height; ++j) {
+        const T *source_row = pixels.Row(ul_y + j) + ul_x;
+        const float y_weight = y_weights[j];
+
+        for (size_t i = 0; i < width; ++i) {
+          float weight = x_weights[i] * y_weight;
+
+          temp += source_row[i] * weight;
+          total_weight += weight;
+        }
+      }
+
+      *output_pixel = static_cast<T>(temp / total_weight);
+    }
+  }
+}
+
+/**
+ * @brief Block version of Min() and Max().
+ *
+ * Consecutive pixels of an output row that cover the same source rows and
+ * overlapping source columns form a run. The source columns of a run are
+ * reduced over its rows once, and each pixel then only reduces its own
+ * columns.
+ *
+ * @param better Returns true if its first argument should replace the second
+ */
+template <typename T, typename Compare>
+void BlockReduce(RasterChunk& input,
+                 const std::vector<Area>& footprints,
+                 Compare better,
+                 RasterView<T> output) {
+  const RasterView<const T> pixels = input.View<const T>();
+  const int block_width = output.column_count();
+  const int block_height = output.row_count();
+  std::vector<T> columns;
+
+  for (int y = 0; y < block_height; ++y) {
+    const Area *row_footprints = &footprints[y * block_width];
+    T *output_row = output.Row(y);
+    int x = 0;
+
+    while (x < block_width) {
+      const Area& start = row_footprints[x];
+
+      if (start.ul.x == -1.0
+          || DegenerateFootprint(input, start, &output_row[x])) {
+        ++x;
+        continue;
+      }
+
+      int first_column = start.ul.x;
+      int last_column = start.lr.x;
+      int end = x + 1;
+
+      while (end < block_width) {
+        const Area& footprint = row_footprints[end];
+
+        if (footprint.ul.x == -1.0
+            || footprint.ul.y != start.ul.y
+            || footprint.lr.y != start.lr.y
+            || footprint.ul.x > footprint.lr.x
+            || footprint.ul.x < row_footprints[end - 1].ul.x
+            || footprint.ul.x > last_column + 1) {
+          break;
+        }
+
+        last_column = std::max(last_column, static_cast<int>(footprint.lr.x));
+        ++end;
+      }
+
+      const T *first_row = pixels.Row(start.ul.y);
+      columns.assign(first_row + first_column, first_row + last_column + 1);
+
+      for (int row = start.ul.y + 1; row <= start.lr.y; ++row) {
+        const T *source_row = pixels.Row(row);
+
+        for (int column = first_column; column <= last_column; ++column) {
+          if (better(source_row[column], columns[column - first_column])) {
+            columns[column - first_column] = source_row[column];
+          }
+        }
+      }
+
+      for (; x < end; ++x) {
+        const Area& footprint = row_footprints[x];
+        const T *column = &columns[static_cast<int>(footprint.ul.x)
+                                   - first_column];
+        const int count = footprint.lr.x - footprint.ul.x + 1;
+        T value = column[0];
+
+        for (int i = 1; i < count; ++i) {
+          if (better(column[i], value)) {
+            value = column[i];
+          }
+        }
+
+        output_row[x] = value;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Block version of Mean().
+ *
+ * The footprints are summed from a summed-area table of the source pixels
+ * under the block, so each pixel costs four lookups whatever its size. Sums
+ * are accumulated in double precision. If the footprints only cover a small
+ * part of their bounding box, as when a block straddles the edge of the
+ * projected area, each footprint is summed directly instead.
+ */
+template <typename T>
+void BlockMean(RasterChunk& input,
+               const std::vector<Area>& footprints,
+               float,
+               RasterView<T> output) {
+  const RasterView<const T> pixels = input.View<const T>();
+  const int block_width = output.column_count();
+  const int block_height = output.row_count();
+  int first_column = input.column_count, last_column = -1;
+  int first_row = input.row_count, last_row = -1;
+  double covered = 0.0;
+
+  for (int y = 0; y < block_height; ++y) {
+    for (int x = 0; x < block_width; ++x) {
+      const Area& footprint = footprints[y * block_width + x];
+
+      if (footprint.ul.x == -1.0
+          || DegenerateFootprint(input, footprint, &output(x, y))) {
+        continue;
+      }
+
+      first_column = std::min(first_column, static_cast<int>(footprint.ul.x));
+      last_column = std::max(last_column, static_cast<int>(footprint.lr.x));
+      first_row = std::min(first_row, static_cast<int>(footprint.ul.y));
+      last_row = std::max(last_row, static_cast<int>(footprint.lr.y));
+      covered += (footprint.lr.x - footprint.ul.x + 1)
+          * (footprint.lr.y - footprint.ul.y + 1);
+    }
+  }
+
+  if (last_column < 0) {
+    return;
+  }
+
+  const int table_width = last_column - first_column + 2;
+  const int table_height = last_row - first_row + 2;
+  const bool use_table =
+      static_cast<double>(table_width) * table_height <= 4.0 * covered;
+
+  // table[(y + 1) * table_width + (x + 1)] is the sum of the source pixels
+  // from (first_column, first_row) to (first_column + x, first_row + y)
+  std::vector<double> table;
+
+  if (use_table) {
+    table.assign(static_cast<size_t>(table_width) * table_height, 0.0);
+
+    for (int y = 1; y < table_height; ++y) {
+      const T *source_row = pixels.Row(first_row + y - 1) + first_column;
+      const double *above = &table[(size_t) (y - 1) * table_width];
+      double *row = &table[(size_t) y * table_width];
+      double row_sum = 0.0;
+
+      for (int x = 1; x < table_width; ++x) {
+        row_sum += source_row[x - 1];
+        row[x] = above[x] + row_sum;
+      }
+    }
+  }
+
+  for (int y = 0; y < block_height; ++y) {
+    for (int x = 0; x < block_width; ++x) {
+      const Area& footprint = footprints[y * block_width + x];
+
+      if (footprint.ul.x == -1.0
+          || footprint.ul.x > footprint.lr.x
+          || footprint.ul.y > footprint.lr.y) {
+        continue;
+      }
+
+      const int ul_x = footprint.ul.x, ul_y = footprint.ul.y;
+      const int lr_x = footprint.lr.x, lr_y = footprint.lr.y;
+      double sum = 0.0;
+
+      if (use_table) {
+        const size_t top = (size_t) (ul_y - first_row) * table_width;
+        const size_t bottom = (size_t) (lr_y - first_row + 1) * table_width;
+        const int left = ul_x - first_column;
+        const int right = lr_x - first_column + 1;
+
+        sum = table[bottom + right] - table[top + right]
+            - table[bottom + left] + table[top + left];
+      } else {
+        for (int row = ul_y; row <= lr_y; ++row) {
+          const T *source_row = pixels.Row(row);
+
+          for (int column = ul_x; column <= lr_x; ++column) {
+            sum += source_row[column];
+          }
+        }
+      }
+
+      const double cells = static_cast<double>(lr_x - ul_x + 1)
+          * (lr_y - ul_y + 1);
+      output(x, y) = static_cast<T>(sum / cells);
+    }
+  }
+}
+
+template <typename T>
+bool greater_than(T a, T b) {
+  return a > b;
+}
+
+template <typename T>
+bool less_than(T a, T b) {
+  return a < b;
+}
+
+template<typename T>
+void BlockMin(RasterChunk& input,
+              const std::vector<Area>& footprints,
+              float,
+              RasterView<T> output) {
+  BlockReduce<T>(input, footprints, less_than<T>, output);
+}
+
+template<typename T>
+void BlockMax(RasterChunk& input,
+              const std::vector<Area>& footprints,
+              float,
+              RasterView<T> output) {
+  BlockReduce<T>(input, footprints, greater_than<T>, output);
+}
+
+template<typename T>
+void BlockBilinear(RasterChunk& input,
+                   const std::vector<Area>& footprints,
+                   float scale_factor,
+                   RasterView<T> output) {
+  BlockFilter<T>(input, footprints, bilinear_filter, 1, scale_factor, output);
+}
+
+template<typename T>
+void BlockBicubic(RasterChunk& input,
+                  const std::vector<Area>& footprints,
+                  float scale_factor,
+                  RasterView<T> output) {
+  BlockFilter<T>(input, footprints, bicubic_filter, 2, scale_factor, output);
+}
+
+template<typename T>
+void BlockLanczos(RasterChunk& input,
+                  const std::vector<Area>& footprints,
+                  float scale_factor,
+                  RasterView<T> output) {
+  BlockFilter<T>(input, footprints, lanczos_filter, 3, scale_factor, output);
+}
 }
 
 /** @cond DOXYHIDE */
@@ -0,0 +1,193 @@
+//
+// Copyright 0000 <Nobody>
+// @file
+// @author David Matthew Mattli <dmattli@usgs.gov>
+//
+// @section LICENSE
+//
+// This software is in the public domain, furnished "as is", without
+// technical support, and with no warranty, express or implied, as to
+// its usefulness for any purpose.
+//
+// @section DESCRIPTION
+//
+// A fixed-size pool of threads that runs parallel loops.
+//
+//
+
+#include <algorithm>
+#include <cstdint>
+
+#include "threadpool.h"
+
+namespace librasterblaster {
+ThreadPool::ThreadPool(int thread_count)
+    : task_count_(0), next_task_(0), stealing_(false),
+      ranges_(std::max(thread_count, 1)), generation_(0), busy_(0),
+      stopping_(false) {
+  for (int i = 1; i < thread_count; ++i) {
+    threads_.push_back(std::thread(&ThreadPool::Work, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  start_.notify_all();
+
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i].join();
+  }
+}
+
+int ThreadPool::thread_count() const {
+  return threads_.size() + 1;
+}
+
+void ThreadPool::ParallelFor(int task_count,
+                             std::function<void(int, int)> task) {
+  if (threads_.empty() || task_count <= 1) {
+    for (int i = 0; i < task_count; ++i) {
+      task(0, i);
+    }
+    return;
+  }
+
+  Start(task_count, task, false);
+}
+
+void ThreadPool::StealingFor(int task_count,
+                             std::function<void(int, int)> task) {
+  if (threads_.empty() || task_count <= 1) {
+    for (int i = 0; i < task_count; ++i) {
+      task(0, i);
+    }
+    return;
+  }
+
+  // Split the tasks into one contiguous range per worker
+  const int worker_count = ranges_.size();
+  for (int i = 0; i < worker_count; ++i) {
+    ranges_[i].next = static_cast<int64_t>(task_count) * i / worker_count;
+    ranges_[i].end = static_cast<int64_t>(task_count) * (i + 1)
+        / worker_count;
+  }
+
+  Start(task_count, task, true);
+}
+
+void ThreadPool::Start(int task_count, std::function<void(int, int)> task,
+                       bool stealing) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = task;
+    task_count_ = task_count;
+    next_task_ = 0;
+    stealing_ = stealing;
+    busy_ = threads_.size();
+    ++generation_;
+  }
+  start_.notify_all();
+
+  RunTasks(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (busy_ > 0) {
+    done_.wait(lock);
+  }
+  task_ = NULL;
+}
+
+void ThreadPool::Work(int worker) {
+  int generation = 0;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    while (!stopping_ && generation == generation_) {
+      start_.wait(lock);
+    }
+
+    if (stopping_) {
+      return;
+    }
+
+    generation = generation_;
+    lock.unlock();
+    RunTasks(worker);
+    lock.lock();
+
+    if (--busy_ == 0) {
+      done_.notify_all();
+    }
+  }
+}
+
+void ThreadPool::RunTasks(int worker) {
+  if (!stealing_) {
+    for (int i = next_task_++; i < task_count_; i = next_task_++) {
+      task_(worker, i);
+    }
+    return;
+  }
+
+  TaskRange& own = ranges_[worker];
+  while (true) {
+    int task;
+    {
+      std::lock_guard<std::mutex> lock(own.mutex);
+      task = (own.next < own.end) ? own.next++ : -1;
+    }
+
+    if (task == -1 && !NextStolenTask(worker, &task)) {
+      return;
+    }
+
+    task_(worker, task);
+  }
+}
+
+bool ThreadPool::NextStolenTask(int worker, int *task) {
+  TaskRange& own = ranges_[worker];
+
+  while (true) {
+    // Find the worker with the most tasks left
+    int victim = -1;
+    int most_left = 0;
+    for (size_t i = 0; i < ranges_.size(); ++i) {
+      std::lock_guard<std::mutex> lock(ranges_[i].mutex);
+      const int left = ranges_[i].end - ranges_[i].next;
+      if (left > most_left) {
+        victim = i;
+        most_left = left;
+      }
+    }
+
+    if (victim == -1) {
+      return false;
+    }
+
+    int first, last;
+    {
+      std::lock_guard<std::mutex> lock(ranges_[victim].mutex);
+      TaskRange& range = ranges_[victim];
+      const int left = range.end - range.next;
+      if (left <= 0) {
+        // Taken by its owner or another thief in the meantime
+        continue;
+      }
+
+      last = range.end;
+      first = range.end - (left + 1) / 2;
+      range.end = first;
+    }
+
+    std::lock_guard<std::mutex> lock(own.mutex);
+    own.next = first + 1;
+    own.end = last;
+    *task = first;
+    return true;
+  }
+}
+}
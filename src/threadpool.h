@@ -0,0 +1,118 @@
+//
+// Copyright 0000 <Nobody>
+// @file
+// @author David Matthew Mattli <dmattli@usgs.gov>
+//
+// @section LICENSE
+//
+// This software is in the public domain, furnished "as is", without
+// technical support, and with no warranty, express or implied, as to
+// its usefulness for any purpose.
+//
+// @section DESCRIPTION
+//
+// A fixed-size pool of threads that runs parallel loops.
+//
+//
+
+#ifndef SRC_THREADPOOL_H_
+#define SRC_THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace librasterblaster {
+/// Thread pool class
+/**
+ * The threads of the pool are started once and reused by every call to
+ * ParallelFor(), so a pool can be kept for the whole run.
+ */
+class ThreadPool {
+ public:
+  /**
+   * @brief Constructor
+   *
+   * @param thread_count Number of threads that run tasks, including the
+   * thread that calls ParallelFor(). Values below one are treated as one.
+   */
+  explicit ThreadPool(int thread_count);
+
+  /**
+   * @brief Destructor, stops and joins the threads of the pool.
+   */
+  ~ThreadPool();
+
+  /**
+   * @brief Returns the number of threads that run tasks.
+   */
+  int thread_count() const;
+
+  /**
+   * @brief Runs task(worker, i) for every i in [0, task_count) and returns
+   * when all of them are done.
+   *
+   * Tasks are handed out one at a time, so tasks of uneven cost are
+   * balanced across the threads. The calling thread runs tasks as worker 0,
+   * the threads of the pool as workers 1 to thread_count() - 1, which lets
+   * tasks keep per-worker state. Only one ParallelFor() or StealingFor()
+   * may run on a pool at a time.
+   *
+   * @param task_count Number of tasks
+   * @param task Function called with the worker number and task number
+   */
+  void ParallelFor(int task_count, std::function<void(int, int)> task);
+
+  /**
+   * @brief Like ParallelFor(), but tasks that are close in number stay on
+   * the same worker.
+   *
+   * Every worker starts with its own contiguous range of tasks and runs it
+   * in order. A worker that runs out of tasks steals the back half of the
+   * largest range that is left, so neighbouring tasks only move between
+   * workers when the load is uneven.
+   *
+   * @param task_count Number of tasks
+   * @param task Function called with the worker number and task number
+   */
+  void StealingFor(int task_count, std::function<void(int, int)> task);
+
+ private:
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+
+  // Tasks [next, end) not yet started by the worker that owns the range
+  struct TaskRange {
+    std::mutex mutex;
+    int next;
+    int end;
+  };
+
+  void Start(int task_count, std::function<void(int, int)> task,
+             bool stealing);
+  void Work(int worker);
+  void RunTasks(int worker);
+  bool NextStolenTask(int worker, int *task);
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  std::function<void(int, int)> task_;
+  int task_count_;
+  std::atomic<int> next_task_;
+  // Set for StealingFor(), which uses ranges_ instead of next_task_
+  bool stealing_;
+  std::vector<TaskRange> ranges_;
+  // Incremented by each loop to wake the threads of the pool
+  int generation_;
+  // Threads of the pool that have not finished the current loop
+  int busy_;
+  bool stopping_;
+};
+}
+
+#endif  // SRC_THREADPOOL_H_
@@ -0,0 +1,122 @@
+/*!
+ * Copyright 0000 <Nobody>
+ * @file
+ * @author David Matthew Mattli <dmattli@usgs.gov>
+ *
+ * @section LICENSE
+ *
+ * This software is in the public domain, furnished "as is", without
+ * technical support, and with no warranty, express or implied, as to
+ * its usefulness for any purpose.
+ *
+ * @section DESCRIPTION
+ *
+ * Tests over the node input cache
+ *
+ */
+
+#include <cstring>
+#include <vector>
+
+#include <mpi.h>
+#include <unistd.h>
+
+#include <gdal_priv.h>
+#include <gtest/gtest.h>
+
+#include "../src/rasterchunk.h"
+#include "../src/demos/nodecache.h"
+
+using librasterblaster::Area;
+using librasterblaster::NodeInputCache;
+using librasterblaster::PRB_ERROR;
+using librasterblaster::PRB_NOERROR;
+using librasterblaster::RasterChunk;
+using std::vector;
+
+namespace {
+TEST(NodeInputCache, ReadsLikeRasterChunk) {
+  const char *filename = "nodecache_test.tif";
+  const int columns = 70;
+  const int rows = 50;
+  const int bands = 2;
+  int rank = 0;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  GDALAllRegister();
+
+  // A tiled input whose pixels give their own band, row and column
+  if (rank == 0) {
+    char **options = NULL;
+    options = CSLSetNameValue(options, "TILED", "YES");
+    options = CSLSetNameValue(options, "BLOCKXSIZE", "16");
+    options = CSLSetNameValue(options, "BLOCKYSIZE", "16");
+    GDALDriver *driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+    GDALDataset *ds = driver->Create(filename, columns, rows, bands,
+                                     GDT_Float32, options);
+    CSLDestroy(options);
+    ASSERT_TRUE(ds != NULL);
+
+    vector<float> pixels(columns * rows * bands);
+    for (int b = 0; b < bands; ++b) {
+      for (int y = 0; y < rows; ++y) {
+        for (int x = 0; x < columns; ++x) {
+          pixels[(b * rows + y) * columns + x] = 1000 * b + 100 * y + x;
+        }
+      }
+    }
+    ASSERT_EQ(CE_None, ds->RasterIO(GF_Write, 0, 0, columns, rows,
+                                    &pixels[0], columns, rows, GDT_Float32,
+                                    bands, NULL, 0, 0, 0));
+    GDALClose(ds);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  GDALDataset *input = static_cast<GDALDataset*>(GDALOpen(filename,
+                                                          GA_ReadOnly));
+  ASSERT_TRUE(input != NULL);
+
+  vector<Area> areas;
+  areas.push_back(Area(5, 3, 40, 30));
+  areas.push_back(Area(30, 20, 69, 49));
+  areas.push_back(Area(-1, -1, -1, -1));
+
+  // Every tile an area needs is shared, even with a single process, so
+  // that the areas are filled from the window. Room for all of the tiles,
+  // then for only three, which leaves the others to be read from input.
+  const int64_t tile_bytes = 16 * 16 * bands * sizeof(float);
+  const int64_t memory_limits[] = { 1 << 20, 3 * tile_bytes };
+  for (size_t m = 0; m < 2; ++m) {
+    PRB_ERROR err = PRB_NOERROR;
+    NodeInputCache *cache = NodeInputCache::Create(MPI_COMM_WORLD, input,
+                                                   areas, memory_limits[m],
+                                                   &err, 1);
+    EXPECT_EQ(PRB_NOERROR, err);
+    EXPECT_GT(cache->tile_count(), 0);
+    EXPECT_LE(cache->bytes(), memory_limits[m]);
+
+    for (size_t i = 0; i < areas.size(); ++i) {
+      if (areas[i].ul.x == -1.0) {
+        continue;
+      }
+      RasterChunk expected(input, areas[i]);
+      RasterChunk cached(input, areas[i]);
+      ASSERT_EQ(PRB_NOERROR, expected.Read(input));
+      ASSERT_EQ(PRB_NOERROR, cache->Read(&cached, input));
+
+      const size_t bytes = static_cast<size_t>(expected.row_count)
+          * expected.column_count * expected.band_count * sizeof(float);
+      EXPECT_EQ(0, memcmp(expected.pixels, cached.pixels, bytes))
+          << "area " << i << " with " << cache->tile_count() << " tiles";
+    }
+
+    delete cache;
+  }
+
+  GDALClose(input);
+  MPI_Barrier(MPI_COMM_WORLD);
+  if (rank == 0) {
+    unlink(filename);
+  }
+}
+}  // namespace
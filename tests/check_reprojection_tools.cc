@@ -15,17 +15,83 @@
  *
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
 
 #include "../src/utils.h"
+#include "../src/bufferpool.h"
+#include "../src/mappedraster.h"
+#include "../src/pipeline.h"
+#include "../src/rastercoordtransformer.h"
+#include "../src/rasterchunk.h"
+#include "../src/rasterview.h"
 #include "../src/reprojection_tools.h"
+#include "../src/resampler.h"
+#include "../src/threadpool.h"
 
 using librasterblaster::Area;
+using librasterblaster::AssignPartitionRanges;
+using librasterblaster::AssignPartitions;
 using librasterblaster::BlockPartition;
+using librasterblaster::Coordinate;
+using librasterblaster::DecimationFactor;
+using librasterblaster::HilbertIndex;
+using librasterblaster::HilbertOrder;
+using librasterblaster::MappedRaster;
+using librasterblaster::PartitionCosts;
+using librasterblaster::PartitionMemory;
+using librasterblaster::PartitionsOutsideInput;
+using librasterblaster::PlanPartitions;
+using librasterblaster::RasterChunk;
+using librasterblaster::RasterCoordTransformer;
+using librasterblaster::RasterView;
 using std::vector;
 
+// Describes a longitude/latitude raster of the whole globe in pixels of
+// pixel_size degrees, the input of most tests below
+static void DescribeGlobalInput(double pixel_size, RasterChunk *chunk) {
+  chunk->projection = "+proj=longlat +R=6370997";
+  chunk->ul_projected_corner = Coordinate(-180.0, 90.0);
+  chunk->pixel_size = pixel_size;
+  chunk->row_count = static_cast<int>(180.0 / pixel_size + 0.5);
+  chunk->column_count = static_cast<int>(360.0 / pixel_size + 0.5);
+  chunk->pixel_type = GDT_Float32;
+  chunk->band_count = 1;
+}
+
+// Describes a sinusoidal float raster with its upper left corner at ul
+static void DescribeSinusoidal(Coordinate ul,
+                               double pixel_size,
+                               int row_count,
+                               int column_count,
+                               RasterChunk *chunk) {
+  chunk->projection = "+proj=sinu +lon_0=0 +R=6370997";
+  chunk->ul_projected_corner = ul;
+  chunk->pixel_size = pixel_size;
+  chunk->row_count = row_count;
+  chunk->column_count = column_count;
+  chunk->pixel_type = GDT_Float32;
+  chunk->band_count = 1;
+}
+
+// Allocates the float pixels of chunk and fills them with a pattern that
+// differs between neighbouring pixels
+static void FillPattern(RasterChunk *chunk) {
+  const int count = chunk->row_count * chunk->column_count;
+  chunk->pixels = calloc(count, sizeof(float));
+
+  float *pixels = static_cast<float*>(chunk->pixels);
+  for (int i = 0; i < count; ++i) {
+    pixels[i] = (i * 37) % 101;
+  }
+}
+
 TEST(BlockPartition, SmallRasterManyProcesses) {
   const int process_count = 1000;
   const int64_t row_count = 180;
@@ -82,3 +148,786 @@ TEST(BlockPartition, HugeRasterManyProcesses) {
   SUCCEED();
 }
 
+
+TEST(DecimationFactor, PowerOfTwoBelowScale) {
+  const Area output(0, 0, 99, 99);
+
+  ASSERT_EQ(1, DecimationFactor(Area(0, 0, 149, 149), output,
+                                librasterblaster::MEAN));
+  ASSERT_EQ(8, DecimationFactor(Area(0, 0, 899, 899), output,
+                                librasterblaster::MEAN));
+  // The smaller of the two axis scales limits the factor
+  ASSERT_EQ(2, DecimationFactor(Area(0, 0, 6399, 299), output,
+                                librasterblaster::BILINEAR));
+}
+
+TEST(DecimationFactor, NonAveragingResamplers) {
+  const Area output(0, 0, 99, 99);
+  const Area input(0, 0, 6399, 6399);
+
+  ASSERT_EQ(1, DecimationFactor(input, output, librasterblaster::NEAREST));
+  ASSERT_EQ(1, DecimationFactor(input, output, librasterblaster::MIN));
+  ASSERT_EQ(1, DecimationFactor(input, output, librasterblaster::MAX));
+  ASSERT_EQ(64, DecimationFactor(input, output, librasterblaster::LANCZOS));
+}
+
+TEST(DecimationFactor, OutsideProjectedSpace) {
+  ASSERT_EQ(1, DecimationFactor(Area(-1, -1, -1, -1), Area(0, 0, 99, 99),
+                                librasterblaster::MEAN));
+}
+
+TEST(PlanPartitions, SplitsToFitMemory) {
+  RasterChunk input, output;
+  DescribeGlobalInput(0.1, &input);
+  DescribeSinusoidal(Coordinate(-20000000.0, 10000000.0), 50000.0, 400, 800,
+                     &output);
+  output.tile_width = 64;
+  output.tile_height = 64;
+
+  const vector<Area> partitions = BlockPartition(0, 1, 400, 800, 64, 16);
+  ASSERT_EQ(partitions.size(),
+            PlanPartitions(input, output, partitions, librasterblaster::NEAREST,
+                           true, 0).size());
+
+  // Every pixel of the output is still in exactly one partition, and
+  // partitions fit unless they are a single row
+  const int64_t partition_memory = 512 * 1024;
+  const vector<Area> planned =
+      PlanPartitions(input, output, partitions, librasterblaster::NEAREST,
+                     true, partition_memory);
+  ASSERT_LT(partitions.size(), planned.size());
+
+  vector<int> coverage(400 * 800, 0);
+  bool streamed = false;
+  for (size_t i = 0; i < planned.size(); ++i) {
+    const Area& p = planned[i];
+    for (int y = p.ul.y; y <= p.lr.y; ++y) {
+      for (int x = p.ul.x; x <= p.lr.x; ++x) {
+        coverage[y * 800 + x]++;
+      }
+    }
+
+    if (p.ul.y != p.lr.y) {
+      ASSERT_GE(partition_memory,
+                PartitionMemory(input, output, p, librasterblaster::NEAREST,
+                                true));
+    }
+    if (static_cast<int>(p.lr.y + 1) % 64 != 0 && p.lr.y != 399) {
+      streamed = true;
+    }
+  }
+  ASSERT_EQ(vector<int>(400 * 800, 1), coverage);
+  ASSERT_TRUE(streamed);
+
+  // Compressed outputs keep their tiles whole
+  const vector<Area> whole =
+      PlanPartitions(input, output, partitions, librasterblaster::NEAREST,
+                     true, partition_memory, true);
+  for (size_t i = 0; i < whole.size(); ++i) {
+    const Area& p = whole[i];
+    ASSERT_EQ(0, static_cast<int>(p.ul.y) % 64);
+    ASSERT_TRUE(static_cast<int>(p.lr.y + 1) % 64 == 0 || p.lr.y == 399);
+  }
+}
+
+TEST(AssignPartitions, BalancesEstimatedCost) {
+  RasterChunk input, output;
+  DescribeGlobalInput(0.1, &input);
+  DescribeSinusoidal(Coordinate(-20000000.0, 10000000.0), 50000.0, 400, 800,
+                     &output);
+
+  const vector<Area> partitions = BlockPartition(0, 1, 400, 800, 64, 1);
+  const vector<double> costs = PartitionCosts(input, output, partitions,
+                                              librasterblaster::NEAREST,
+                                              false);
+  ASSERT_EQ(partitions.size(), costs.size());
+
+  // The upper left corner of the sinusoidal output is outside of the input
+  ASSERT_LT(costs[0] * 5, costs[partitions.size() / 2]);
+
+  // Every partition is assigned once, and the most loaded process is
+  // within a few percent of the mean
+  const int process_count = 4;
+  vector<int> assigned(partitions.size(), 0);
+  double total = 0.0, max_cost = 0.0;
+  for (int rank = 0; rank < process_count; ++rank) {
+    double rank_cost = 0.0;
+    const vector<Area> mine = AssignPartitions(partitions, costs, rank,
+                                               process_count, &rank_cost);
+    for (size_t i = 0; i < mine.size(); ++i) {
+      for (size_t j = 0; j < partitions.size(); ++j) {
+        if (mine[i].ul.x == partitions[j].ul.x
+            && mine[i].ul.y == partitions[j].ul.y) {
+          assigned[j]++;
+        }
+      }
+    }
+    total += rank_cost;
+    max_cost = std::max(max_cost, rank_cost);
+  }
+  ASSERT_EQ(vector<int>(partitions.size(), 1), assigned);
+  ASSERT_LT(max_cost, 1.05 * total / process_count);
+}
+
+TEST(PartitionsOutsideInput, FindsSinusoidalCorners) {
+  RasterChunk input, output;
+  DescribeGlobalInput(0.1, &input);
+  DescribeSinusoidal(Coordinate(-20000000.0, 10000000.0), 50000.0, 400, 800,
+                     &output);
+
+  const vector<Area> partitions = BlockPartition(0, 1, 400, 800, 32, 1);
+  const vector<bool> outside = PartitionsOutsideInput(input, output,
+                                                      partitions);
+  ASSERT_EQ(partitions.size(), outside.size());
+
+  // A partition is outside exactly when none of its pixels reach the input
+  RasterCoordTransformer rt(output.projection, output.ul_projected_corner,
+                            output.pixel_size, output.row_count,
+                            output.column_count, input.projection,
+                            input.ul_projected_corner, input.pixel_size);
+  int outside_count = 0;
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    const Area& p = partitions[i];
+    bool any_valid = false;
+    for (int y = p.ul.y; y <= p.lr.y && !any_valid; ++y) {
+      for (int x = p.ul.x; x <= p.lr.x && !any_valid; ++x) {
+        const Area footprint = rt.Transform(Coordinate(x, y));
+        any_valid = footprint.ul.x != -1.0
+            && footprint.lr.x >= 0.0 && footprint.ul.x < input.column_count
+            && footprint.lr.y >= 0.0 && footprint.ul.y < input.row_count;
+      }
+    }
+    ASSERT_EQ(!any_valid, outside[i]);
+    outside_count += outside[i];
+  }
+  ASSERT_TRUE(outside[0]);
+  ASSERT_LT(0, outside_count);
+}
+
+TEST(PartitionsOutsideInput, FindsIslandBetweenGridPoints) {
+  // A one pixel input under output pixel (5, 3), away from the edges of the
+  // partition and from the points of the grid of PartitionMemory
+  RasterChunk input, output;
+  DescribeGlobalInput(1.0, &output);
+  input.projection = output.projection;
+  input.ul_projected_corner = Coordinate(-175.0, 87.0);
+  input.pixel_size = 1.0;
+  input.row_count = 1;
+  input.column_count = 1;
+  input.pixel_type = GDT_Float32;
+  input.band_count = 1;
+
+  vector<Area> partitions;
+  partitions.push_back(Area(0, 0, output.column_count - 1,
+                            output.row_count - 1));
+  partitions.push_back(Area(100, 100, 200, 150));
+  const vector<bool> outside = PartitionsOutsideInput(input, output,
+                                                      partitions);
+  ASSERT_EQ(partitions.size(), outside.size());
+  EXPECT_FALSE(outside[0]);
+  EXPECT_TRUE(outside[1]);
+}
+
+TEST(HilbertIndex, VisitsNeighbours) {
+  // Along the curve each point of the 8x8 corner of the grid follows one of
+  // its neighbours
+  const int side = 8;
+  vector<int> x_of(side * side, -1), y_of(side * side, -1);
+  for (int y = 0; y < side; ++y) {
+    for (int x = 0; x < side; ++x) {
+      const uint64_t index = HilbertIndex(x, y);
+      ASSERT_GT(side * side, index);
+      x_of[index] = x;
+      y_of[index] = y;
+    }
+  }
+  for (int i = 1; i < side * side; ++i) {
+    ASSERT_EQ(1, abs(x_of[i] - x_of[i - 1]) + abs(y_of[i] - y_of[i - 1]));
+  }
+}
+
+TEST(AssignPartitionRanges, SplitsAtEqualCost) {
+  const vector<Area> partitions = BlockPartition(0, 1, 512, 512, 64, 1);
+  vector<double> costs(partitions.size(), 1.0);
+  costs[0] = 8.0;
+
+  // The ranges are contiguous along the Hilbert order and hold about the
+  // same cost
+  const vector<size_t> order = HilbertOrder(partitions);
+  vector<Area> ordered;
+  vector<double> ordered_costs;
+  for (size_t i = 0; i < order.size(); ++i) {
+    ordered.push_back(partitions[order[i]]);
+    ordered_costs.push_back(costs[order[i]]);
+  }
+
+  size_t next = 0;
+  for (int rank = 0; rank < 4; ++rank) {
+    double rank_cost = 0.0;
+    const vector<Area> mine = AssignPartitionRanges(ordered, ordered_costs,
+                                                    rank, 4, &rank_cost);
+    for (size_t i = 0; i < mine.size(); ++i, ++next) {
+      ASSERT_EQ(ordered[next].ul.x, mine[i].ul.x);
+      ASSERT_EQ(ordered[next].ul.y, mine[i].ul.y);
+    }
+    ASSERT_NEAR(71.0 / 4, rank_cost, 1.0);
+  }
+  ASSERT_EQ(ordered.size(), next);
+}
+
+TEST(BlockResampler, SeparableMatchesFilter) {
+  const int source_size = 64;
+  const int block_size = 8;
+  RasterChunk source;
+  source.row_count = source_size;
+  source.column_count = source_size;
+  FillPattern(&source);
+
+  // Axis-aligned footprints, each output pixel covers a 4x4 source area
+  // grown by the filter support.
+  std::vector<Area> footprints;
+  for (int y = 0; y < block_size; ++y) {
+    for (int x = 0; x < block_size; ++x) {
+      footprints.push_back(Area(std::max(0, x * 4 - 2),
+                                std::max(0, y * 4 - 2),
+                                std::min(source_size - 1, x * 4 + 5),
+                                std::min(source_size - 1, y * 4 + 5)));
+    }
+  }
+
+  std::vector<float> output(block_size * block_size);
+  librasterblaster::BlockBicubic<float>(source, footprints, 4.0,
+                                        RasterView<float>(&output[0],
+                                                          block_size,
+                                                          block_size,
+                                                          block_size));
+
+  for (int i = 0; i < block_size * block_size; ++i) {
+    ASSERT_NEAR(librasterblaster::Bicubic<float>(source, footprints[i], 4.0),
+                output[i], 0.001);
+  }
+}
+
+TEST(BlockResampler, MatchesPixelResamplers) {
+  const int source_size = 64;
+  const int block_size = 8;
+  RasterChunk source;
+  source.row_count = source_size;
+  source.column_count = source_size;
+  FillPattern(&source);
+
+  // Sheared footprints of varying sizes, with one pixel outside of the
+  // projected area.
+  std::vector<Area> footprints;
+  for (int y = 0; y < block_size; ++y) {
+    for (int x = 0; x < block_size; ++x) {
+      footprints.push_back(Area(x * 4 + y, y * 4 + x / 2,
+                                x * 4 + y + 3 + x % 3, y * 4 + x / 2 + 4));
+    }
+  }
+  footprints[10] = Area(-1, -1, -1, -1);
+
+  std::vector<librasterblaster::BlockResampler<float> > block_resamplers;
+  std::vector<std::function<float(RasterChunk&, Area, float)> > resamplers;
+  block_resamplers.push_back(&librasterblaster::BlockMin<float>);
+  resamplers.push_back(&librasterblaster::Min<float>);
+  block_resamplers.push_back(&librasterblaster::BlockMax<float>);
+  resamplers.push_back(&librasterblaster::Max<float>);
+  block_resamplers.push_back(&librasterblaster::BlockMean<float>);
+  resamplers.push_back(&librasterblaster::Mean<float>);
+  block_resamplers.push_back(&librasterblaster::BlockLanczos<float>);
+  resamplers.push_back(&librasterblaster::Lanczos<float>);
+
+  for (size_t r = 0; r < resamplers.size(); ++r) {
+    std::vector<float> output(block_size * block_size, -1.0);
+    block_resamplers[r](source, footprints, 4.0,
+                        RasterView<float>(&output[0], block_size, block_size,
+                                          block_size));
+
+    for (int i = 0; i < block_size * block_size; ++i) {
+      if (footprints[i].ul.x == -1.0) {
+        ASSERT_EQ(-1.0, output[i]);
+        continue;
+      }
+
+      ASSERT_NEAR(resamplers[r](source, footprints[i], 4.0), output[i], 0.001);
+    }
+  }
+}
+
+TEST(RasterCoordTransformer, NearestMatchesTransform) {
+  // Sinusoidal output pixels mapped back to a one-degree global input
+  RasterCoordTransformer rt("+proj=sinu +lon_0=0 +R=6370997",
+                            Coordinate(-20000000.0, 10000000.0),
+                            100000.0,
+                            200,
+                            400,
+                            "+proj=longlat +R=6370997",
+                            Coordinate(-180.0, 90.0),
+                            1.0);
+
+  for (int y = 0; y < 200; ++y) {
+    for (int x = 0; x < 400; ++x) {
+      const Area full = rt.Transform(Coordinate(x, y));
+      const Coordinate nearest = rt.TransformNearest(Coordinate(x, y));
+
+      if (full.ul.x == -1.0) {
+        continue;
+      }
+
+      // Both sample the same point of the pixel, the same input pixel
+      ASSERT_EQ(full.ul.x, nearest.x) << "pixel " << x << ", " << y;
+      ASSERT_EQ(full.ul.y, nearest.y) << "pixel " << x << ", " << y;
+    }
+  }
+}
+
+TEST(ReprojectChunk, TiledDestinationMatchesRowMajor) {
+  RasterChunk source;
+  DescribeGlobalInput(1.0, &source);
+  FillPattern(&source);
+
+  // Tiles that don't divide the chunk or the blocks of ReprojectChunk
+  const int tile_width = 24;
+  const int tile_height = 20;
+  RasterChunk row_major, tiled;
+  RasterChunk *destinations[2] = { &row_major, &tiled };
+  for (int i = 0; i < 2; ++i) {
+    DescribeSinusoidal(Coordinate(-4500000.0, 3500000.0), 100000.0, 70, 90,
+                       destinations[i]);
+  }
+  row_major.pixels = calloc(70 * 90, sizeof(float));
+  tiled.tile_width = tile_width;
+  tiled.tile_height = tile_height;
+  tiled.pixels = calloc(4 * tile_height * 4 * tile_width, sizeof(float));
+
+  const librasterblaster::RESAMPLER resamplers[2] = {
+    librasterblaster::NEAREST, librasterblaster::BILINEAR
+  };
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(librasterblaster::ReprojectChunk(source, row_major, "-1",
+                                                 resamplers[i]));
+    ASSERT_TRUE(librasterblaster::ReprojectChunk(source, tiled, "-1",
+                                                 resamplers[i]));
+
+    const float *row_major_pixels = static_cast<float*>(row_major.pixels);
+    const float *tiled_pixels = static_cast<float*>(tiled.pixels);
+    for (int y = 0; y < 70; ++y) {
+      for (int x = 0; x < 90; ++x) {
+        ASSERT_EQ(row_major_pixels[row_major.PixelIndex(x, y)],
+                  tiled_pixels[tiled.PixelIndex(x, y)]);
+      }
+    }
+  }
+
+  // Four tiles across, pixel (53, 23) is in the seventh tile
+  ASSERT_EQ(6 * tile_width * tile_height + 3 * tile_width + 5,
+            tiled.PixelIndex(2 * tile_width + 5, tile_height + 3));
+}
+
+TEST(ReprojectChunk, BlockOrderDoesNotChangeOutput) {
+  RasterChunk source;
+  DescribeGlobalInput(0.5, &source);
+  FillPattern(&source);
+
+  RasterChunk row_order, morton_order;
+  RasterChunk *destinations[2] = { &row_order, &morton_order };
+  for (int i = 0; i < 2; ++i) {
+    RasterChunk *destination = destinations[i];
+    destination->projection =
+        "+proj=omerc +lat_0=40 +lonc=-100 +alpha=45 +R=6370997";
+    destination->ul_projected_corner = Coordinate(-6000000.0, 6000000.0);
+    destination->pixel_size = 10000.0;
+    destination->row_count = 1200;
+    destination->column_count = 1200;
+    destination->pixel_type = GDT_Float32;
+    destination->band_count = 1;
+    destination->pixels = calloc(1200 * 1200, sizeof(float));
+  }
+
+  const librasterblaster::RESAMPLER resamplers[2] = {
+    librasterblaster::BILINEAR, librasterblaster::MEAN
+  };
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(librasterblaster::ReprojectChunk(
+        source, row_order, "-1", resamplers[i], NULL, NULL,
+        librasterblaster::ROW_ORDER));
+    ASSERT_TRUE(librasterblaster::ReprojectChunk(
+        source, morton_order, "-1", resamplers[i], NULL, NULL,
+        librasterblaster::MORTON_ORDER));
+    ASSERT_EQ(0, memcmp(row_order.pixels, morton_order.pixels,
+                        1200 * 1200 * sizeof(float)));
+  }
+}
+
+TEST(RasterCoordTransformer, InProjectedArea) {
+  RasterCoordTransformer rt("+proj=sinu +lon_0=0 +R=6370997",
+                            Coordinate(-20000000.0, 10000000.0),
+                            100000.0,
+                            200,
+                            400,
+                            "+proj=longlat +R=6370997",
+                            Coordinate(-180.0, 90.0),
+                            1.0);
+
+  // The corners of the output are outside of the sinusoidal area
+  ASSERT_FALSE(rt.InProjectedArea(Coordinate(0, 0)));
+  ASSERT_FALSE(rt.InProjectedArea(Coordinate(399, 199)));
+  ASSERT_TRUE(rt.InProjectedArea(Coordinate(200, 100)));
+
+  // Pixels outside of the area are rejected by Transform() as well
+  for (int y = 0; y < 200; y += 7) {
+    for (int x = 0; x < 400; x += 13) {
+      if (!rt.InProjectedArea(Coordinate(x, y))) {
+        ASSERT_EQ(-1.0, rt.Transform(Coordinate(x, y)).ul.x);
+      }
+    }
+  }
+}
+
+TEST(ReprojectChunk, FillsOnlyOutsideProjectedArea) {
+  RasterChunk source, destination;
+  DescribeGlobalInput(1.0, &source);
+  FillPattern(&source);
+  DescribeSinusoidal(Coordinate(-20000000.0, 10000000.0), 100000.0, 200, 400,
+                     &destination);
+  destination.pixels = calloc(200 * 400, sizeof(float));
+  ASSERT_TRUE(librasterblaster::ReprojectChunk(source, destination, "-1",
+                                               librasterblaster::NEAREST));
+
+  // The rows next to the poles are narrower than the sampling step of the
+  // valid spans, yet pixels are filled exactly where the full transform of
+  // each pixel on its own rejects them
+  RasterCoordTransformer rt(destination.projection,
+                            destination.ul_projected_corner,
+                            destination.pixel_size, destination.row_count,
+                            destination.column_count, source.projection,
+                            source.ul_projected_corner, source.pixel_size);
+  const float *pixels = static_cast<float*>(destination.pixels);
+  for (int y = 0; y < 200; ++y) {
+    for (int x = 0; x < 400; ++x) {
+      const Area footprint = rt.Transform(Coordinate(x, y));
+      const bool valid = footprint.ul.x != -1.0
+          && footprint.ul.x <= source.column_count - 1
+          && footprint.lr.y <= source.row_count - 1;
+      ASSERT_EQ(valid, pixels[y * 400 + x] != -1.0) << x << ", " << y;
+    }
+  }
+}
+
+TEST(ThreadPool, RunsEveryTaskOnce) {
+  librasterblaster::ThreadPool pool(4);
+  ASSERT_EQ(4, pool.thread_count());
+
+  // The pool is reused between loops
+  for (int loop = 0; loop < 3; ++loop) {
+    std::vector<int> runs(100, 0);
+    std::vector<int> workers(100, -1);
+
+    pool.ParallelFor(runs.size(), [&](int worker, int task) {
+      runs[task]++;
+      workers[task] = worker;
+    });
+
+    for (size_t i = 0; i < runs.size(); ++i) {
+      ASSERT_EQ(1, runs[i]);
+      ASSERT_LE(0, workers[i]);
+      ASSERT_GT(4, workers[i]);
+    }
+  }
+}
+
+TEST(ThreadPool, StealingRunsEveryTaskOnce) {
+  librasterblaster::ThreadPool pool(4);
+  std::vector<int> runs(100, 0);
+
+  // Uneven tasks, the first quarter is much slower than the rest
+  pool.StealingFor(runs.size(), [&](int, int task) {
+    if (task < 25) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    runs[task]++;
+  });
+
+  for (size_t i = 0; i < runs.size(); ++i) {
+    ASSERT_EQ(1, runs[i]);
+  }
+}
+
+TEST(Pipeline, WritesEveryItemInOrder) {
+  std::vector<int> written;
+  librasterblaster::PipelineTimes times;
+
+  // The read stage is slow, so the other stages wait on the queues
+  librasterblaster::PRB_ERROR err = librasterblaster::RunPipeline<int>(
+      50, 2,
+      [](int i, int *item) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        *item = i * 3;
+        return librasterblaster::PRB_NOERROR;
+      },
+      [](int, int& item) {
+        item += 1;
+        return librasterblaster::PRB_NOERROR;
+      },
+      [&](int i, int& item) {
+        EXPECT_EQ(i * 3 + 1, item);
+        written.push_back(i);
+        return librasterblaster::PRB_NOERROR;
+      },
+      &times);
+
+  ASSERT_EQ(librasterblaster::PRB_NOERROR, err);
+  ASSERT_EQ(50u, written.size());
+  for (size_t i = 0; i < written.size(); ++i) {
+    ASSERT_EQ(static_cast<int>(i), written[i]);
+  }
+  ASSERT_LT(times.Utilization(librasterblaster::COMPUTE_STAGE),
+            times.Utilization(librasterblaster::READ_STAGE));
+  ASSERT_GE(1.0, times.Utilization(librasterblaster::READ_STAGE));
+}
+
+TEST(Pipeline, CallsIdleWhileWriteStageWaits) {
+  const std::thread::id caller = std::this_thread::get_id();
+  int idle_calls = 0;
+  int written = 0;
+
+  // The compute stage is slow, so the write stage waits for every item
+  librasterblaster::PRB_ERROR err = librasterblaster::RunPipeline<int>(
+      5, 2,
+      [](int i, int *item) {
+        *item = i;
+        return librasterblaster::PRB_NOERROR;
+      },
+      [](int, int&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return librasterblaster::PRB_NOERROR;
+      },
+      [&](int i, int& item) {
+        EXPECT_EQ(i, item);
+        ++written;
+        return librasterblaster::PRB_NOERROR;
+      },
+      NULL,
+      [&] {
+        EXPECT_EQ(caller, std::this_thread::get_id());
+        ++idle_calls;
+      });
+
+  ASSERT_EQ(librasterblaster::PRB_NOERROR, err);
+  ASSERT_EQ(5, written);
+  ASSERT_LT(5, idle_calls);
+}
+
+TEST(Pipeline, StopsAtFirstError) {
+  int computed = 0;
+  int written = 0;
+
+  librasterblaster::PRB_ERROR err = librasterblaster::RunPipeline<int>(
+      1000, 2,
+      [](int i, int *item) {
+        *item = i;
+        return librasterblaster::PRB_NOERROR;
+      },
+      [&](int i, int&) {
+        ++computed;
+        return (i == 10) ? librasterblaster::PRB_PROJERROR
+            : librasterblaster::PRB_NOERROR;
+      },
+      [&](int, int&) {
+        ++written;
+        return librasterblaster::PRB_NOERROR;
+      },
+      NULL);
+
+  ASSERT_EQ(librasterblaster::PRB_PROJERROR, err);
+  ASSERT_EQ(11, computed);
+  ASSERT_GE(10, written);
+}
+
+TEST(BufferPool, ReusesAlignedBuffers) {
+  librasterblaster::BufferPool pool;
+
+  void *first = pool.Acquire(100000);
+  ASSERT_TRUE(first != NULL);
+  ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(first)
+            % librasterblaster::BufferPool::alignment);
+  ASSERT_TRUE(pool.Release(first));
+  ASSERT_FALSE(pool.Release(first));
+
+  // A slightly different size is rounded to the same buffer
+  void *second = pool.Acquire(99000);
+  ASSERT_EQ(first, second);
+  void *third = pool.Acquire(1000);
+  ASSERT_NE(second, third);
+
+  // Buffers that don't come from the pool are left to the caller
+  void *foreign = malloc(64);
+  ASSERT_FALSE(pool.Release(foreign));
+  free(foreign);
+
+  librasterblaster::BufferPool::Statistics statistics = pool.statistics();
+  ASSERT_EQ(3, statistics.acquires);
+  ASSERT_EQ(1, statistics.reuses);
+  ASSERT_EQ(2, statistics.allocations);
+  ASSERT_EQ(0, statistics.bytes_idle);
+  ASSERT_LE(100000 + 1000, statistics.bytes_in_use);
+
+  // Released buffers beyond the idle limit are freed
+  pool.set_idle_limit(4096);
+  ASSERT_TRUE(pool.Release(second));
+  ASSERT_TRUE(pool.Release(third));
+  statistics = pool.statistics();
+  ASSERT_EQ(0, statistics.bytes_in_use);
+  ASSERT_GE(4096, statistics.bytes_idle);
+  ASSERT_LT(0, statistics.bytes_idle);
+}
+
+TEST(RasterView, WindowsShareChunkPixels) {
+  RasterChunk chunk;
+  chunk.row_count = 6;
+  chunk.column_count = 10;
+  chunk.tile_width = 4;
+  chunk.tile_height = 4;
+  chunk.pixels = calloc(8 * 12, sizeof(int));
+
+  // A window within a tile of a tiled chunk
+  RasterView<int> window = chunk.Window<int>(4, 0, 4, 4);
+  ASSERT_EQ(4, window.row_stride());
+  window(1, 2) = 7;
+  ASSERT_EQ(7, static_cast<int*>(chunk.pixels)[chunk.PixelIndex(5, 2)]);
+
+  // Sub-windows of a view share its pixels
+  RasterView<const int> sub_window = window.Window(1, 1, 2, 2);
+  ASSERT_EQ(7, sub_window(0, 1));
+  ASSERT_EQ(&window(1, 2), sub_window.Row(1));
+
+  // Moves transfer the pixels, which are freed once
+  void *pixels = chunk.pixels;
+  RasterChunk moved(std::move(chunk));
+  ASSERT_TRUE(chunk.pixels == NULL);
+  ASSERT_EQ(pixels, moved.pixels);
+  ASSERT_EQ(4, moved.tile_width);
+
+  chunk = std::move(moved);
+  ASSERT_EQ(pixels, chunk.pixels);
+  ASSERT_TRUE(moved.pixels == NULL);
+  ASSERT_EQ(7, chunk.Window<int>(5, 2, 1, 1)(0, 0));
+}
+
+// Appends value to file as a little-endian integer of size bytes
+static void AppendBytes(vector<uint8_t> *file, uint64_t value, int size) {
+  for (int i = 0; i < size; ++i) {
+    file->push_back((value >> (8 * i)) & 0xff);
+  }
+}
+
+// Appends a BigTIFF directory entry with a single inline value
+static void AppendEntry(vector<uint8_t> *file, int tag, int type, int size,
+                        uint64_t value) {
+  AppendBytes(file, tag, 2);
+  AppendBytes(file, type, 2);
+  AppendBytes(file, 1, 8);
+  AppendBytes(file, value, size);
+  AppendBytes(file, 0, 8 - size);
+}
+
+TEST(MappedRaster, ReadsTilesOfBigTiff) {
+  // A 10x6 float BigTIFF in 4x4 tiles, pixel (x, y) holds 100 * y + x and
+  // the padding of the edge tiles holds -1.
+  const int columns = 10, rows = 6, tile_size = 4;
+  const int tiles = 3 * 2;
+  const int64_t tile_bytes = tile_size * tile_size * sizeof(float);
+  vector<uint8_t> file;
+  file.push_back(0x49);
+  file.push_back(0x49);
+  AppendBytes(&file, 0x2B, 2);
+  AppendBytes(&file, 8, 2);
+  AppendBytes(&file, 0, 2);
+  AppendBytes(&file, 16, 8);
+
+  const int entry_count = 10;
+  const uint64_t offsets_offset = 16 + 8 + entry_count * 20 + 8;
+  const uint64_t counts_offset = offsets_offset + tiles * 8;
+  const uint64_t first_tile = counts_offset + tiles * 8;
+  AppendBytes(&file, entry_count, 8);
+  AppendEntry(&file, 256, 4, 4, columns);
+  AppendEntry(&file, 257, 4, 4, rows);
+  AppendEntry(&file, 258, 3, 2, 32);
+  AppendEntry(&file, 259, 3, 2, 1);
+  AppendEntry(&file, 277, 3, 2, 1);
+  AppendEntry(&file, 322, 3, 2, tile_size);
+  AppendEntry(&file, 323, 3, 2, tile_size);
+  AppendBytes(&file, 324, 2);
+  AppendBytes(&file, 16, 2);
+  AppendBytes(&file, tiles, 8);
+  AppendBytes(&file, offsets_offset, 8);
+  AppendBytes(&file, 325, 2);
+  AppendBytes(&file, 16, 2);
+  AppendBytes(&file, tiles, 8);
+  AppendBytes(&file, counts_offset, 8);
+  AppendEntry(&file, 339, 3, 2, 3);
+  AppendBytes(&file, 0, 8);
+
+  for (int i = 0; i < tiles; ++i) {
+    AppendBytes(&file, first_tile + i * tile_bytes, 8);
+  }
+  for (int i = 0; i < tiles; ++i) {
+    AppendBytes(&file, tile_bytes, 8);
+  }
+  for (int tile = 0; tile < tiles; ++tile) {
+    for (int i = 0; i < tile_size * tile_size; ++i) {
+      const int x = (tile % 3) * tile_size + i % tile_size;
+      const int y = (tile / 3) * tile_size + i / tile_size;
+      const float value = (x < columns && y < rows) ? 100 * y + x : -1;
+      uint32_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      AppendBytes(&file, bits, 4);
+    }
+  }
+
+  const std::string filename = "mappedraster_test.tif";
+  FILE *f = fopen(filename.c_str(), "wb");
+  ASSERT_TRUE(f != NULL);
+  fwrite(&file[0], 1, file.size(), f);
+  fclose(f);
+
+  MappedRaster *raster = MappedRaster::Open(filename);
+  ASSERT_TRUE(raster != NULL);
+  ASSERT_EQ(columns, raster->x_size());
+  ASSERT_EQ(rows, raster->y_size());
+  ASSERT_EQ(4, raster->sample_size());
+
+  // Tiles are views of the mapped file
+  RasterView<const float> tile = raster->Tile<float>(2, 1);
+  ASSERT_EQ(509.0, tile(1, 1));
+  ASSERT_EQ(-1.0, tile(2, 1));
+
+  // A window crossing four tiles
+  RasterChunk chunk;
+  chunk.raster_location = Coordinate(3, 2);
+  chunk.row_count = 3;
+  chunk.column_count = 6;
+  chunk.pixel_type = GDT_Float32;
+  chunk.band_count = 1;
+  chunk.pixels = calloc(3 * 6, sizeof(float));
+  raster->Prefetch(Area(3, 2, 8, 4));
+  ASSERT_EQ(librasterblaster::PRB_NOERROR, raster->Read(&chunk));
+  for (int y = 0; y < 3; ++y) {
+    for (int x = 0; x < 6; ++x) {
+      ASSERT_EQ(100 * (y + 2) + x + 3, chunk.View<float>()(x, y));
+    }
+  }
+
+  chunk.column_count = 8;
+  ASSERT_EQ(librasterblaster::PRB_BADARG, raster->Read(&chunk));
+  delete raster;
+
+  // Compressed files are left to GDAL
+  file[16 + 8 + 3 * 20 + 12] = 5;
+  f = fopen(filename.c_str(), "wb");
+  fwrite(&file[0], 1, file.size(), f);
+  fclose(f);
+  ASSERT_TRUE(MappedRaster::Open(filename) == NULL);
+  remove(filename.c_str());
+}
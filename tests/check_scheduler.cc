@@ -0,0 +1,61 @@
+/*!
+ * Copyright 0000 <Nobody>
+ * @file
+ * @author David Matthew Mattli <dmattli@usgs.gov>
+ *
+ * @section LICENSE
+ *
+ * This software is in the public domain, furnished "as is", without
+ * technical support, and with no warranty, express or implied, as to
+ * its usefulness for any purpose.
+ *
+ * @section DESCRIPTION
+ *
+ * Tests over the partition scheduler
+ *
+ */
+
+#include <vector>
+
+#include <mpi.h>
+
+#include <gtest/gtest.h>
+
+#include "../src/demos/scheduler.h"
+
+using librasterblaster::PartitionScheduler;
+using std::vector;
+
+namespace {
+TEST(PartitionScheduler, ClaimsEveryItemOnce) {
+  const int64_t item_counts[] = { 0, 1, 7, 1000 };
+
+  for (size_t c = 0; c < sizeof(item_counts) / sizeof(item_counts[0]); ++c) {
+    const int64_t item_count = item_counts[c];
+    PartitionScheduler *scheduler = PartitionScheduler::Create(MPI_COMM_WORLD,
+                                                               item_count);
+    vector<int> claims(item_count + 1, 0);
+
+    int64_t first = -1;
+    int64_t count = 0;
+    while ((count = scheduler->Claim(&first)) != 0) {
+      ASSERT_GT(count, 0);
+      ASSERT_GE(first, 0);
+      ASSERT_LE(first + count, item_count);
+      for (int64_t i = first; i < first + count; ++i) {
+        ++claims[i];
+      }
+    }
+    // Once everything is handed out the scheduler keeps saying so
+    EXPECT_EQ(0, scheduler->Claim(&first));
+
+    MPI_Allreduce(MPI_IN_PLACE, &claims[0], static_cast<int>(claims.size()),
+                  MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    for (int64_t i = 0; i < item_count; ++i) {
+      EXPECT_EQ(1, claims[i]) << "item " << i << " of " << item_count;
+    }
+
+    delete scheduler;
+  }
+}
+}  // namespace
@@ -0,0 +1,477 @@
+/*!
+ * Copyright 0000 <Nobody>
+ * @file
+ * @author David Matthew Mattli <dmattli@usgs.gov>
+ *
+ * @section LICENSE
+ *
+ * This software is in the public domain, furnished "as is", without
+ * technical support, and with no warranty, express or implied, as to
+ * its usefulness for any purpose.
+ *
+ * @section DESCRIPTION
+ *
+ * Tests over the sptw library
+ *
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+#include <tiffio.h>
+#include <unistd.h>
+
+#include <gdal_priv.h>
+#include <gtest/gtest.h>
+#include <ogr_spatialref.h>
+
+#include "../src/demos/sptw.h"
+
+using sptw::PTIFF;
+using std::string;
+using std::vector;
+
+namespace {
+// Returns a file name for this test that no other process uses
+string ProcessFilename(const char *name) {
+  int rank = 0;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  char filename[64];
+  snprintf(filename, sizeof(filename), "%s_%d.tif", name, rank);
+  return filename;
+}
+
+// Returns size bytes in which no two neighbours are repeated, so LZW adds
+// exactly one code to its table for each byte. Block j lists the bytes in
+// steps of 2j + 1, a step that no other block uses.
+vector<uint8_t> DistinctPairs(int64_t size) {
+  vector<uint8_t> data(size);
+  for (int64_t i = 0; i < size; ++i) {
+    const int64_t step = 2 * (i / 256) + 1;
+    data[i] = static_cast<uint8_t>((i % 256) * step);
+  }
+  return data;
+}
+
+// Compresses data as one tile, a single row of data.size() bytes, writes it
+// as the only strip of a TIFF file and decodes it with libtiff
+void ExpectLzwRoundTrip(const vector<uint8_t>& data) {
+  PTIFF ptiff = PTIFF();
+  ptiff.compression = sptw::SP_Lzw;
+  ptiff.block_x_size = data.size();
+  ptiff.block_y_size = 1;
+  ptiff.band_type_size = 1;
+  ptiff.band_count = 1;
+  vector<uint8_t> compressed;
+  ASSERT_EQ(sptw::SP_None, sptw::compress_tile(&ptiff, &data[0], &compressed));
+
+  const string filename = ProcessFilename("lzw_strip");
+  TIFF *tiff = TIFFOpen(filename.c_str(), "w");
+  ASSERT_TRUE(tiff != NULL);
+  TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(data.size()));
+  TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, 1);
+  TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 8);
+  TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, 1);
+  TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+  TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+  ASSERT_EQ(static_cast<tmsize_t>(compressed.size()),
+            TIFFWriteRawStrip(tiff, 0, &compressed[0], compressed.size()));
+  TIFFClose(tiff);
+
+  tiff = TIFFOpen(filename.c_str(), "r");
+  ASSERT_TRUE(tiff != NULL);
+  vector<uint8_t> decoded(data.size(), 0);
+  EXPECT_EQ(static_cast<tmsize_t>(data.size()),
+            TIFFReadEncodedStrip(tiff, 0, &decoded[0], decoded.size()));
+  TIFFClose(tiff);
+  unlink(filename.c_str());
+
+  EXPECT_TRUE(decoded == data);
+}
+
+// Creates a tiled Byte BigTIFF with GDAL, whose tiles are not placed, on
+// the first process and opens it on every process. Returns NULL if either
+// fails.
+PTIFF *OpenNewTiledRaster(const char *filename, int64_t columns,
+                          int64_t rows, int64_t tile_size) {
+  int rank = 0;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  int created = 1;
+  if (rank == 0) {
+    double geotransform[6] = { 500000.0, 30.0, 0.0, 4000000.0, 0.0, -30.0 };
+    created = sptw::create_tiled_raster(filename, columns, rows, 1, GDT_Byte,
+                                        geotransform, "EPSG:32633", tile_size)
+        == sptw::SP_None;
+  }
+  MPI_Bcast(&created, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (!created) {
+    return NULL;
+  }
+  return sptw::open_raster(filename);
+}
+
+// Closes ptiff after the first process has changed its directory, and
+// opens it again on every process
+PTIFF *Reopen(PTIFF *ptiff, const char *filename) {
+  MPI_Barrier(MPI_COMM_WORLD);
+  sptw::close_raster(ptiff);
+  return sptw::open_raster(filename);
+}
+
+TEST(CompressTile, LzwCodeWidths) {
+  // The table of n distinct pairs holds 258 + n codes after the last one.
+  // The codes grow to 10, 11 and 12 bits when it reaches 512, 1024 and
+  // 2048 codes, and it is cleared at 4094, so every change is tried both
+  // in the middle and at the very end of a tile.
+  const int64_t sizes[] = { 1, 2, 3, 253, 254, 255, 765, 766, 767,
+                            1789, 1790, 1791, 3835, 3836, 3837, 3838,
+                            7672, 7673, 9000 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    SCOPED_TRACE(sizes[i]);
+    ExpectLzwRoundTrip(DistinctPairs(sizes[i]));
+  }
+}
+
+TEST(CompressTile, LzwTilesDecodeWithLibtiff) {
+  const int tile_size = 64;
+  const int band_count = 3;
+  const int64_t tile_bytes = tile_size * tile_size * band_count;
+  PTIFF ptiff = PTIFF();
+  ptiff.compression = sptw::SP_Lzw;
+  ptiff.block_x_size = tile_size;
+  ptiff.block_y_size = tile_size;
+  ptiff.band_type_size = 1;
+  ptiff.band_count = band_count;
+
+  // A smooth tile whose strings grow long, a noisy one whose codes are
+  // mostly single bytes and a constant one
+  vector<vector<uint8_t> > tiles(3, vector<uint8_t>(tile_bytes));
+  uint32_t state = 12345;
+  for (int64_t i = 0; i < tile_bytes; ++i) {
+    const int64_t pixel = i / band_count;
+    tiles[0][i] = static_cast<uint8_t>(pixel / tile_size + pixel % tile_size
+                                       + 40 * (i % band_count));
+    state = state * 1103515245 + 12345;
+    tiles[1][i] = static_cast<uint8_t>(state >> 16);
+    tiles[2][i] = 7;
+  }
+
+  const string filename = ProcessFilename("lzw_tiles");
+  TIFF *tiff = TIFFOpen(filename.c_str(), "w");
+  ASSERT_TRUE(tiff != NULL);
+  TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, tile_size * tiles.size());
+  TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, tile_size);
+  TIFFSetField(tiff, TIFFTAG_TILEWIDTH, tile_size);
+  TIFFSetField(tiff, TIFFTAG_TILELENGTH, tile_size);
+  TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 8);
+  TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, band_count);
+  TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+  TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    vector<uint8_t> compressed;
+    ASSERT_EQ(sptw::SP_None,
+              sptw::compress_tile(&ptiff, &tiles[i][0], &compressed));
+    ASSERT_EQ(static_cast<tmsize_t>(compressed.size()),
+              TIFFWriteRawTile(tiff, i, &compressed[0], compressed.size()));
+  }
+  TIFFClose(tiff);
+
+  tiff = TIFFOpen(filename.c_str(), "r");
+  ASSERT_TRUE(tiff != NULL);
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    vector<uint8_t> decoded(tile_bytes, 0);
+    EXPECT_EQ(tile_bytes,
+              TIFFReadEncodedTile(tiff, i, &decoded[0], decoded.size()));
+    EXPECT_TRUE(decoded == tiles[i]) << "tile " << i;
+  }
+  TIFFClose(tiff);
+  unlink(filename.c_str());
+}
+
+TEST(CreateTiledBigtiff, SparseTilesReadBackWithGdal) {
+  const char *filename = "sparse_bigtiff_test.tif";
+  const int64_t columns = 70;
+  const int64_t rows = 50;
+  const int64_t tile_size = 16;
+  const int64_t tiles_across = 5;
+  const int64_t tiles_down = 4;
+  double geotransform[6] = { 500000.0, 30.0, 0.0, 4000000.0, 0.0, -30.0 };
+  const double no_data = 255.0;
+  int rank = 0;
+  int process_count = 1;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &process_count);
+
+  GDALAllRegister();
+
+  GDALColorTable color_table;
+  for (int i = 0; i < 4; ++i) {
+    const GDALColorEntry entry = { static_cast<short>(10 * i),
+                                   static_cast<short>(20 * i),
+                                   static_cast<short>(30 * i), 255 };
+    color_table.SetColorEntry(i, &entry);
+  }
+
+  int created = 1;
+  if (rank == 0) {
+    created = sptw::create_tiled_bigtiff(filename, columns, rows, 1, GDT_Byte,
+                                         geotransform, "EPSG:32633",
+                                         tile_size, &no_data, &color_table)
+        == sptw::SP_None;
+  }
+  MPI_Bcast(&created, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  ASSERT_TRUE(created);
+
+  PTIFF *ptiff = sptw::open_raster(filename);
+  ASSERT_TRUE(ptiff != NULL);
+  ASSERT_EQ(tiles_across, ptiff->tiles_across);
+  ASSERT_EQ(tiles_down, ptiff->tiles_down);
+
+  // Every third tile is left out, the others give their own index
+  vector<bool> sparse_tiles(tiles_across * tiles_down);
+  for (size_t t = 0; t < sparse_tiles.size(); ++t) {
+    sparse_tiles[t] = t % 3 == 1;
+  }
+  ASSERT_EQ(sptw::SP_None, sptw::leave_out_tiles_all(ptiff, sparse_tiles));
+
+  for (int64_t t = rank; t < tiles_across * tiles_down; t += process_count) {
+    if (sparse_tiles[t]) {
+      continue;
+    }
+    const int64_t ul_x = (t % tiles_across) * tile_size;
+    const int64_t ul_y = (t / tiles_across) * tile_size;
+    vector<uint8_t> tile(tile_size * tile_size, static_cast<uint8_t>(t));
+    EXPECT_EQ(sptw::SP_None,
+              sptw::write_tiles(ptiff, &tile[0], ul_x, ul_y,
+                                std::min(ul_x + tile_size, columns) - 1,
+                                std::min(ul_y + tile_size, rows) - 1));
+  }
+  EXPECT_EQ(sptw::SP_None, sptw::close_raster(ptiff));
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  GDALDataset *ds = static_cast<GDALDataset*>(GDALOpen(filename,
+                                                       GA_ReadOnly));
+  ASSERT_TRUE(ds != NULL);
+  EXPECT_EQ(columns, ds->GetRasterXSize());
+  EXPECT_EQ(rows, ds->GetRasterYSize());
+
+  double read_geotransform[6];
+  ASSERT_EQ(CE_None, ds->GetGeoTransform(read_geotransform));
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_DOUBLE_EQ(geotransform[i], read_geotransform[i]) << "term " << i;
+  }
+
+  OGRSpatialReference expected_srs;
+  OGRSpatialReference read_srs;
+  ASSERT_EQ(OGRERR_NONE, expected_srs.SetFromUserInput("EPSG:32633"));
+  ASSERT_EQ(OGRERR_NONE, read_srs.SetFromUserInput(ds->GetProjectionRef()));
+  EXPECT_TRUE(read_srs.IsSame(&expected_srs)) << ds->GetProjectionRef();
+
+  GDALRasterBand *band = ds->GetRasterBand(1);
+  int has_no_data = 0;
+  EXPECT_DOUBLE_EQ(no_data, band->GetNoDataValue(&has_no_data));
+  EXPECT_TRUE(has_no_data);
+
+  GDALColorTable *read_table = band->GetColorTable();
+  ASSERT_TRUE(read_table != NULL);
+  ASSERT_GE(read_table->GetColorEntryCount(), 4);
+  for (int i = 0; i < 4; ++i) {
+    const GDALColorEntry *expected = color_table.GetColorEntry(i);
+    const GDALColorEntry *read = read_table->GetColorEntry(i);
+    EXPECT_EQ(expected->c1, read->c1) << "entry " << i;
+    EXPECT_EQ(expected->c2, read->c2) << "entry " << i;
+    EXPECT_EQ(expected->c3, read->c3) << "entry " << i;
+  }
+
+  // Left out tiles read as nodata
+  vector<uint8_t> pixels(columns * rows);
+  ASSERT_EQ(CE_None, band->RasterIO(GF_Read, 0, 0, columns, rows, &pixels[0],
+                                    columns, rows, GDT_Byte, 0, 0));
+  for (int64_t y = 0; y < rows; ++y) {
+    for (int64_t x = 0; x < columns; ++x) {
+      const int64_t t = (y / tile_size) * tiles_across + x / tile_size;
+      const int expected = sparse_tiles[t] ? 255 : static_cast<int>(t);
+      ASSERT_EQ(expected, pixels[y * columns + x])
+          << "pixel " << x << ", " << y;
+    }
+  }
+  GDALClose(ds);
+
+  // Left out tiles have no offset or byte count, the others follow each
+  // other in the file
+  TIFF *tiff = TIFFOpen(filename, "r");
+  ASSERT_TRUE(tiff != NULL);
+  uint64_t *offsets = NULL;
+  uint64_t *byte_counts = NULL;
+  ASSERT_TRUE(TIFFGetField(tiff, TIFFTAG_TILEOFFSETS, &offsets));
+  ASSERT_TRUE(TIFFGetField(tiff, TIFFTAG_TILEBYTECOUNTS, &byte_counts));
+  uint64_t next_offset = 0;
+  for (size_t t = 0; t < sparse_tiles.size(); ++t) {
+    if (sparse_tiles[t]) {
+      EXPECT_EQ(0u, offsets[t]) << "tile " << t;
+      EXPECT_EQ(0u, byte_counts[t]) << "tile " << t;
+    } else {
+      EXPECT_EQ(static_cast<uint64_t>(tile_size * tile_size), byte_counts[t])
+          << "tile " << t;
+      if (next_offset != 0) {
+        EXPECT_EQ(next_offset, offsets[t]) << "tile " << t;
+      }
+      next_offset = offsets[t] + byte_counts[t];
+    }
+  }
+  TIFFClose(tiff);
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  if (rank == 0) {
+    unlink(filename);
+  }
+}
+
+TEST(PopulateTileOffsets, SparseTilesReadBackWithLibtiff) {
+  const char *filename = "populate_offsets_test.tif";
+  const int64_t columns = 70;
+  const int64_t rows = 50;
+  const int64_t tile_size = 16;
+  const int64_t tile_count = 5 * 4;
+  int rank = 0;
+  int process_count = 1;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &process_count);
+
+  GDALAllRegister();
+  PTIFF *ptiff = OpenNewTiledRaster(filename, columns, rows, tile_size);
+  ASSERT_TRUE(ptiff != NULL);
+
+  // Every third tile is left out, the others give their own index
+  vector<bool> sparse_tiles(tile_count);
+  for (int64_t t = 0; t < tile_count; ++t) {
+    sparse_tiles[t] = t % 3 == 1;
+  }
+  int err = sptw::SP_None;
+  if (rank == 0) {
+    err = sptw::populate_tile_offsets(ptiff, tile_size, &sparse_tiles);
+  }
+  MPI_Bcast(&err, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  ASSERT_EQ(sptw::SP_None, err);
+  ptiff = Reopen(ptiff, filename);
+  ASSERT_TRUE(ptiff != NULL);
+
+  for (int64_t t = 0; t < tile_count; ++t) {
+    EXPECT_EQ(sparse_tiles[t], ptiff->tile_offsets[t] == 0) << "tile " << t;
+  }
+  for (int64_t t = rank; t < tile_count; t += process_count) {
+    if (sparse_tiles[t]) {
+      continue;
+    }
+    const int64_t ul_x = (t % ptiff->tiles_across) * tile_size;
+    const int64_t ul_y = (t / ptiff->tiles_across) * tile_size;
+    vector<uint8_t> tile(tile_size * tile_size, static_cast<uint8_t>(t));
+    EXPECT_EQ(sptw::SP_None,
+              sptw::write_tiles(ptiff, &tile[0], ul_x, ul_y,
+                                std::min(ul_x + tile_size, columns) - 1,
+                                std::min(ul_y + tile_size, rows) - 1));
+  }
+  EXPECT_EQ(sptw::SP_None, sptw::close_raster(ptiff));
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  // Left out tiles have no offset or byte count, the others are read back
+  TIFF *tiff = TIFFOpen(filename, "r");
+  ASSERT_TRUE(tiff != NULL);
+  uint64_t *offsets = NULL;
+  uint64_t *byte_counts = NULL;
+  ASSERT_TRUE(TIFFGetField(tiff, TIFFTAG_TILEOFFSETS, &offsets));
+  ASSERT_TRUE(TIFFGetField(tiff, TIFFTAG_TILEBYTECOUNTS, &byte_counts));
+  for (int64_t t = 0; t < tile_count; ++t) {
+    if (sparse_tiles[t]) {
+      EXPECT_EQ(0u, offsets[t]) << "tile " << t;
+      EXPECT_EQ(0u, byte_counts[t]) << "tile " << t;
+      continue;
+    }
+    EXPECT_EQ(static_cast<uint64_t>(tile_size * tile_size), byte_counts[t])
+        << "tile " << t;
+    vector<uint8_t> tile(tile_size * tile_size, 0);
+    EXPECT_EQ(static_cast<tmsize_t>(tile.size()),
+              TIFFReadEncodedTile(tiff, t, &tile[0], tile.size()));
+    EXPECT_TRUE(tile == vector<uint8_t>(tile.size(), static_cast<uint8_t>(t)))
+        << "tile " << t;
+  }
+  TIFFClose(tiff);
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  if (rank == 0) {
+    unlink(filename);
+  }
+}
+
+TEST(SetTileCompression, ReopenedFileTakesCompressedTiles) {
+  const char *filename = "tile_compression_test.tif";
+  const int64_t columns = 70;
+  const int64_t rows = 50;
+  const int64_t tile_size = 16;
+  const int64_t tile_bytes = tile_size * tile_size;
+  int rank = 0;
+  int process_count = 1;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &process_count);
+
+  GDALAllRegister();
+  PTIFF *ptiff = OpenNewTiledRaster(filename, columns, rows, tile_size);
+  ASSERT_TRUE(ptiff != NULL);
+
+  int err = sptw::SP_None;
+  if (rank == 0) {
+    err = sptw::set_tile_compression(ptiff, sptw::SP_Lzw);
+  }
+  MPI_Bcast(&err, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  ASSERT_EQ(sptw::SP_None, err);
+  ptiff = Reopen(ptiff, filename);
+  ASSERT_TRUE(ptiff != NULL);
+  EXPECT_EQ(sptw::SP_Lzw, ptiff->compression);
+
+  // Each process compresses a share of the tiles, every one of them
+  // different, and all of them are written with one call
+  const int64_t tile_count = ptiff->tiles_across * ptiff->tiles_down;
+  vector<vector<uint8_t> > tiles(tile_count, vector<uint8_t>(tile_bytes));
+  for (int64_t t = 0; t < tile_count; ++t) {
+    for (int64_t i = 0; i < tile_bytes; ++i) {
+      tiles[t][i] = static_cast<uint8_t>(t * 7 + i / tile_size);
+    }
+  }
+  sptw::CompressedTiles compressed;
+  for (int64_t t = rank; t < tile_count; t += process_count) {
+    vector<uint8_t> tile;
+    ASSERT_EQ(sptw::SP_None, sptw::compress_tile(ptiff, &tiles[t][0], &tile));
+    compressed.tile_indices.push_back(t);
+    compressed.sizes.push_back(tile.size());
+    compressed.data.insert(compressed.data.end(), tile.begin(), tile.end());
+  }
+  EXPECT_EQ(sptw::SP_None,
+            sptw::write_compressed_tiles_all(ptiff, &compressed));
+  EXPECT_EQ(sptw::SP_None, sptw::close_raster(ptiff));
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  TIFF *tiff = TIFFOpen(filename, "r");
+  ASSERT_TRUE(tiff != NULL);
+  uint16_t compression = COMPRESSION_NONE;
+  ASSERT_TRUE(TIFFGetField(tiff, TIFFTAG_COMPRESSION, &compression));
+  EXPECT_EQ(COMPRESSION_LZW, compression);
+  for (int64_t t = 0; t < tile_count; ++t) {
+    vector<uint8_t> decoded(tile_bytes, 0);
+    EXPECT_EQ(tile_bytes,
+              TIFFReadEncodedTile(tiff, t, &decoded[0], decoded.size()));
+    EXPECT_TRUE(decoded == tiles[t]) << "tile " << t;
+  }
+  TIFFClose(tiff);
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  if (rank == 0) {
+    unlink(filename);
+  }
+}
+}  // namespace
@@ -15,6 +15,7 @@
  *
  */
 
+#include <cstdio>
 #include <vector>
 
 #include <mpi.h>
@@ -81,7 +82,14 @@ TEST(SystemTest, GLOBALVEG) {
 }  // namespace
 
 int main(int argc, char *argv[]) {
-  MPI_Init(&argc, &argv);
+  // prasterblasterpio reads and reprojects on other threads, only the main
+  // thread makes MPI calls
+  int provided = MPI_THREAD_SINGLE;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  if (provided < MPI_THREAD_FUNNELED) {
+    fprintf(stderr, "The MPI library does not support threads\n");
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
   ::testing::InitGoogleTest(&argc, argv);
   int ret = RUN_ALL_TESTS();
   MPI_Finalize();